@@ -1,7 +1,42 @@
 #pragma once
+#include <cstddef>
 #include <string>
+#include <vector>
 
-bool KpmInstall(const std::string& package, const std::string& path);
+bool KpmInstall(const std::vector<std::string>& packages, const std::string& path, std::size_t jobs);
+
+// Installs over the installed version, files with unchanged content are not written again
+bool KpmUpgrade(const std::vector<std::string>& packages, const std::string& path, std::size_t jobs);
 bool KpmRemove(const std::string& package);
 
+// Removes files (in parallel) and then every directory left empty, deepest first
+bool KpmRemovePaths(const std::vector<std::string>& files, std::vector<std::string> dirs, bool missing_ok);
+bool KpmOwns(const std::string& path);
+
+// Activates another generation of a package installed with the store (0 is the one before the active one)
+bool KpmRollback(const std::string& package, unsigned generation);
+
+// Deletes the store generations that are not active, of one package or of all of them (empty).
+// Collecting all of them also deletes the objects no package refers to.
+bool KpmGc(const std::string& package);
+
 std::string KpmGetCachePath();
+
+// Let packages overwrite files owned by other packages (they take over ownership)
+void KpmSetOverwrite(bool overwrite);
+bool KpmIsOverwrite();
+
+// Install new versions into the package store and switch the prefix over with symlinks
+void KpmSetStore(bool store);
+
+// Share identical files between prefixes through the content addressed object store (see kpm_objects.h)
+void KpmSetDedup(bool dedup);
+
+// Write extracted files and unlink removed ones in batches over io_uring (Linux), when available
+void KpmSetIoUring(bool enable);
+
+void KpmSetOffline(bool offline);
+bool KpmIsOffline();
+
+// Download large files as <segments> concurrent byte ranges of <segment_size> bytes
+void KpmSetDownloadSegments(std::size_t segments, std::size_t segment_size);
@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <optional>
+#include <string>
+
+#include "kpm_hash.h"
+
+// Download cache layout under KpmGetCachePath():
+//   blobs/<sha256>      : downloaded content, addressed by its hash
+//   urls/<sha256(url)>  : json metadata of the last response for that url
+//   partial/<sha256(url)>[.json] : interrupted download of that url and its validators
+//   probes/<sha256(key)> : json output of a post install command marked cache, see KpmCacheProbeLookup
+struct KpmCacheEntry
+{
+	std::string url;
+	std::string etag;
+	std::string last_modified;
+	std::string blob;
+	std::uint64_t size = 0;
+};
+
+std::optional<KpmCacheEntry> KpmCacheLookup(const std::string& url);
+std::string KpmCacheBlobPath(const std::string& blob);
+bool KpmCacheUpdate(const KpmCacheEntry& entry);
+void KpmCacheEvict(const std::string& url);
+
+// Output an earlier install got from a post install command, key is the command and the fingerprint
+// of everything its output depends on (see KpmShellFingerprint)
+std::optional<std::string> KpmCacheProbeLookup(const std::string& key);
+bool KpmCacheProbeUpdate(const std::string& key, const std::string& output);
+
+// Writes a blob to the cache while it downloads.
+// Nothing is visible in the cache until commit() succeeds.
+class KpmCacheWriter
+{
+public:
+	explicit KpmCacheWriter(const std::string& url);
+	~KpmCacheWriter();
+
+	KpmCacheWriter(const KpmCacheWriter&) = delete;
+	KpmCacheWriter& operator=(const KpmCacheWriter&) = delete;
+
+	bool write(const void* data, std::size_t size);
+
+	// Partial download left behind by an interrupted fetch of this url
+	std::optional<KpmCacheEntry> partial() const;
+
+	// Take over the partial download and append to it, returns the bytes already there
+	std::optional<std::uint64_t> resume();
+
+	// Keep what was written so far for a later resume() instead of discarding it
+	void suspend(const std::string& etag, const std::string& last_modified);
+
+	std::uint64_t size() const { return _size; }
+
+	// Random access mode for segmented downloads, the hash is computed on commit
+	bool reserve(std::uint64_t size);
+	bool write_at(std::uint64_t offset, const void* data, std::size_t size);
+
+	std::optional<KpmCacheEntry> commit(const std::string& etag, const std::string& last_modified);
+	void discard();
+
+private:
+	std::string _url;
+	std::string _tmp_path;
+	std::fstream _file;
+	KpmSha256 _sha;
+	std::uint64_t _size = 0;
+	bool _open = false;
+	bool _failed = false;
+	bool _random_access = false;
+};
@@ -0,0 +1,83 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+enum class KpmCodec
+{
+	NONE,
+	GZIP, // Passed through, libarchive decodes it
+	XZ,
+	ZSTD
+};
+
+// Decompresses package payloads ahead of libarchive.
+// The codec is detected from the content, never from the file name.
+// xz streams are decoded with the liblzma multithreaded decoder (parallel over blocks)
+// and zstd streams made of small frames (pzstd) are decoded one frame per thread.
+class KpmDecoder
+{
+public:
+	// Reads compressed bytes. Returns the count, 0 at the end or -1 on error.
+	using Source = std::function<std::int64_t(std::uint8_t*, std::size_t)>;
+
+	KpmDecoder(Source source, unsigned threads);
+
+	// Decodes straight from memory (e.g. a mapped file), nothing is copied
+	KpmDecoder(const std::uint8_t* data, std::size_t size, unsigned threads);
+	~KpmDecoder();
+
+	KpmDecoder(const KpmDecoder&) = delete;
+	KpmDecoder& operator=(const KpmDecoder&) = delete;
+
+	// Next chunk of decoded data, valid until the next call.
+	// Returns its size, 0 at the end or -1 on error (see error()).
+	std::int64_t read(const std::uint8_t** data);
+
+	KpmCodec codec() const { return _codec; }
+
+	// Bytes of the memory given to the constructor decoded (or handed to a frame worker) so far
+	std::size_t consumed() const { return _memory ? _in_begin : 0; }
+	const std::string& error() const { return _error; }
+
+private:
+	struct Xz;
+	struct Zstd;
+
+	bool fill();
+	std::int64_t fail(std::string error);
+	std::int64_t read_raw(const std::uint8_t** data);
+	std::int64_t read_xz(const std::uint8_t** data);
+	std::int64_t read_zstd(const std::uint8_t** data);
+
+	std::size_t available() const { return (_memory ? _memory_size : _in.size()) - _in_begin; }
+	const std::uint8_t* input() const { return (_memory ? _memory : _in.data()) + _in_begin; }
+
+	Source _source;
+	unsigned _threads;
+	KpmCodec _codec = KpmCodec::NONE;
+	bool _detected = false;
+	bool _done = false;
+
+	// Compressed bytes read ahead (or all of _memory), from _in_begin on
+	std::vector<std::uint8_t> _in;
+	const std::uint8_t* _memory = nullptr;
+	std::size_t _memory_size = 0;
+	std::size_t _in_begin = 0;
+	bool _eof = false;
+
+	std::vector<std::uint8_t> _out;
+	std::string _error;
+
+	std::unique_ptr<Xz> _xz;
+	std::unique_ptr<Zstd> _zstd;
+};
+
+const char* KpmCodecName(KpmCodec codec);
+
+// Rebuilds the file a `zstd --patch-from=<base>` patch was made for and writes it to out.
+// Returns the SHA-256 (hex) of what was written.
+std::optional<std::string> KpmZstdPatch(const std::uint8_t* base, std::size_t base_size, const std::uint8_t* patch, std::size_t patch_size, const std::string& out);
@@ -0,0 +1,26 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Incremental SHA-256 used to content address cached and installed files
+class KpmSha256
+{
+public:
+	KpmSha256();
+
+	void update(const void* data, std::size_t size);
+	std::array<std::uint8_t, 32> digest();
+	std::string hexdigest();
+
+private:
+	void transform(const std::uint8_t* block);
+
+	std::array<std::uint32_t, 8> _state;
+	std::array<std::uint8_t, 64> _block;
+	std::size_t _block_size = 0;
+	std::uint64_t _length = 0;
+};
+
+std::string KpmSha256Hex(std::string_view data);
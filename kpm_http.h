@@ -0,0 +1,103 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <curl/curl.h>
+
+enum class KpmHttpWrite
+{
+	OK,
+	PAUSE, // Sink is full, the same chunk is delivered again after KpmHttpClient::resume()
+	ABORT
+};
+
+using KpmHttpSink = std::function<KpmHttpWrite(const std::uint8_t*, std::size_t)>;
+
+struct KpmHttpRequest
+{
+	std::string url;
+	std::vector<std::string> headers;
+	bool fail_on_error = false;
+	bool head = false;
+	std::uint64_t resume_from = 0; // Ask only for the content after this many bytes
+	KpmHttpSink on_data;
+	std::function<void(std::string_view)> on_header;
+};
+
+struct KpmHttpResult
+{
+	bool ok = false;
+	long status = 0;
+	CURLcode code = CURLE_OK;
+	std::string error;
+	std::string effective_url;
+};
+
+// Process wide http client.
+// All transfers run concurrently on a single curl multi handle driven by a background thread.
+// DNS, TLS sessions and connections are shared (CURLSH) and kept alive between requests,
+// and transfers to the same host are multiplexed over HTTP/2 when the server supports it.
+// Callbacks of a request are invoked from that thread and must not block.
+class KpmHttpClient
+{
+public:
+	static KpmHttpClient& Get();
+
+	~KpmHttpClient();
+
+	std::future<KpmHttpResult> submit(KpmHttpRequest request);
+	KpmHttpResult perform(KpmHttpRequest request);
+
+	// Retry transfers paused by their sinks
+	void resume();
+
+	// Maximum number of transfers running at the same time
+	void set_max_transfers(std::size_t max);
+
+private:
+	struct Transfer;
+
+	KpmHttpClient();
+	void run();
+	void finish(Transfer* transfer, CURLcode code);
+
+	CURLM* _multi = nullptr;
+	CURLSH* _share = nullptr;
+	std::array<std::mutex, CURL_LOCK_DATA_LAST> _share_mutex;
+	std::mutex _mutex;
+	std::queue<std::unique_ptr<Transfer>> _pending;
+	std::list<std::unique_ptr<Transfer>> _running;
+	std::size_t _max_transfers = 8;
+	bool _resume = false;
+	bool _stop = false;
+	std::thread _driver;
+};
+
+struct KpmHttpResponse
+{
+	bool ok = false;
+	long status = 0;
+	bool cached = false;
+	std::string blob_path; // Set when the content went to the cache instead of the sink
+};
+
+// Fetches an url through the download cache (see kpm_cache.h).
+// Transient failures are retried with exponential backoff, continuing interrupted downloads
+// with range requests validated by the ETag. Downloads that still fail are kept to be resumed
+// on the next fetch of the same url.
+// With replay = false, content that is (or ends up) in the cache is not fed to the sink
+// and the caller reads blob_path instead. This covers cached responses and segmented downloads.
+// Sinks that may return KpmHttpWrite::PAUSE must use replay = false.
+KpmHttpResponse KpmFetchUrl(const std::string& url, const KpmHttpSink& sink, bool fail_on_error, bool replay = true);
+
+std::size_t KpmGetDownloadSegments();
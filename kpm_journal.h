@@ -0,0 +1,64 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+// Paths created by a package install that is still running, kept in <cache>/<package>.journal.
+// Layout: "KPMJRNL1", then records of u8 type, u32 path length (little endian) and the path
+// (for relinked symlinks the path, a zero byte and the previous target).
+// A path is recorded before it is created, records are synced to disk in batches.
+// The journal of an install that failed or crashed is rolled back: every recorded path is removed.
+// Once the manifest is written a commit record is appended, after that the journal only rolls forward.
+class KpmJournal
+{
+public:
+	enum class Type : std::uint8_t
+	{
+		FILE = 'F',
+		DIRECTORY = 'D',
+		LINK = 'L',
+		COMMIT = 'C'
+	};
+
+	// Locks the journal of package, rolls back whatever a crashed install left in it first.
+	// nullptr if another install of the same package holds it.
+	static std::unique_ptr<KpmJournal> Begin(const std::string& package);
+	~KpmJournal();
+
+	KpmJournal(const KpmJournal&) = delete;
+	KpmJournal& operator=(const KpmJournal&) = delete;
+
+	// Records path (and its missing parent directories) unless it already exists.
+	// Paths that existed before the install are never rolled back. Safe to call from several threads.
+	bool create(const std::string& path, Type type);
+
+	// Points symlink path at target with one rename, rollback points it back where it was
+	bool relink(const std::string& path, const std::string& target);
+
+	// The manifest is written, a crash from now on keeps the install
+	bool commit();
+
+	// Removes every recorded path that is still there
+	bool rollback();
+
+	// Deletes the journal, after commit or rollback
+	void close();
+
+	// Replays the journals that crashed installs left in the cache, locked ones are still running
+	static void Recover();
+
+private:
+	struct Handle;
+
+	KpmJournal(const std::string& package, const std::string& file, std::unique_ptr<Handle> handle);
+	bool append(const std::string& records, std::size_t count);
+
+	std::string _package;
+	std::string _file;
+	std::unique_ptr<Handle> _handle;
+	std::string _known_dir;
+	bool _known_created = false;
+	std::size_t _unsynced = 0;
+	std::mutex _mutex; // Post install steps journal from several threads
+};
@@ -0,0 +1,90 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "kpm_mmap.h"
+
+enum class KpmManifestType : std::uint8_t
+{
+	FILE,
+	DIRECTORY,
+	SYMLINK,
+	HARDLINK,
+	OTHER
+};
+
+// One installed path and what was written there
+struct KpmManifestEntry
+{
+	std::string path;
+	KpmManifestType type = KpmManifestType::OTHER;
+	std::uint32_t mode = 0;
+	std::uint64_t size = 0;
+	std::int64_t mtime = 0;
+	bool hashed = false; // Manifests migrated from text have no hashes
+	std::array<std::uint8_t, 32> hash = {}; // SHA-256 of the content of regular files
+};
+
+// Binary manifest layout, all integers little endian:
+//   header    "KPMMANIF", u32 version, u32 entry count, u32 restart interval,
+//             u32 restart count, u64 restart table offset
+//   records   sorted by path, each one varint shared prefix length, varint suffix length,
+//             suffix, u8 type, u8 flags, varint mode, varint size, zigzag varint mtime
+//             and the hash when flagged. Every restart interval records the prefix is reset.
+//   restarts  u32 file offset of every restart record
+class KpmManifestWriter
+{
+public:
+	// The entry stays valid until write(), it can be filled in later (e.g. the hash from a writer thread)
+	KpmManifestEntry& add(std::string path, KpmManifestType type);
+	KpmManifestEntry& add(KpmManifestEntry entry);
+
+	// Sorts the entries and replaces file atomically. Repeated paths keep the last entry.
+	bool write(const std::string& file);
+
+	std::size_t size() const { return _entries.size(); }
+	const std::deque<KpmManifestEntry>& entries() const { return _entries; }
+
+private:
+	std::deque<KpmManifestEntry> _entries;
+};
+
+// Entry for a path as it is on disk now, regular files are hashed when hash is set
+KpmManifestEntry KpmManifestStatPath(const std::string& path, bool hash);
+
+// Binary manifest read in place from a mapping, only the records actually visited are decoded
+class KpmManifest
+{
+public:
+	// Text manifests written by older kpm versions are converted (and rewritten) on open
+	static std::optional<KpmManifest> Open(const std::string& file);
+
+	std::size_t size() const { return _count; }
+
+	std::optional<KpmManifestEntry> find(std::string_view path) const;
+
+	// Visits every entry in path order until fn returns false. Returns false on corrupt data.
+	bool for_each(const std::function<bool(const KpmManifestEntry&)>& fn) const;
+
+	// Entries that current doesn't have anymore, e.g. the files a new version of the package dropped
+	std::vector<KpmManifestEntry> dropped(const KpmManifestWriter& current) const;
+
+private:
+	KpmManifest() = default;
+
+	bool load();
+	bool decode(std::size_t& offset, KpmManifestEntry& entry) const;
+	std::size_t restart(std::size_t index) const;
+
+	KpmMappedFile _file;
+	std::size_t _count = 0;
+	std::size_t _interval = 0;
+	std::size_t _restarts = 0;
+	std::size_t _restart_table = 0;
+};
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+// Read-only memory mapping of a whole file
+class KpmMappedFile
+{
+public:
+	KpmMappedFile() = default;
+	explicit KpmMappedFile(const std::string& path);
+	~KpmMappedFile();
+
+	// Read-write mapping of an existing file, shared with it. The file is grown to size first if it is smaller.
+	static KpmMappedFile Writable(const std::string& path, std::size_t size);
+
+	KpmMappedFile(KpmMappedFile&& other) noexcept;
+	KpmMappedFile& operator=(KpmMappedFile&& other) noexcept;
+
+	KpmMappedFile(const KpmMappedFile&) = delete;
+	KpmMappedFile& operator=(const KpmMappedFile&) = delete;
+
+	bool is_open() const { return _open; }
+	const std::uint8_t* data() const { return _data; }
+	std::size_t size() const { return _size; }
+
+	// nullptr unless opened with Writable
+	std::uint8_t* writable_data() const { return _writable ? const_cast<std::uint8_t*>(_data) : nullptr; }
+
+	// Writes the modified pages back to the file
+	bool flush() const;
+
+private:
+	void close();
+
+	const std::uint8_t* _data = nullptr;
+	std::size_t _size = 0;
+	bool _open = false;
+	bool _writable = false;
+#ifdef _WIN32
+	void* _mapping = nullptr;
+#endif
+};
@@ -0,0 +1,32 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Content addressed bodies of installed files, shared by every prefix packages are installed into (--dedup):
+//   <cache>/objects/<sha256>-<mode>-<mtime>  file content with the mode (octal) and mtime it is installed with
+//   <cache>/objects/refs/<package>           objects the installed files of package share, one per line
+// Files are made reflinks (FICLONE) of their object where the filesystem supports it, hard links otherwise.
+// Hard links share the inode, so installs always replace such files instead of writing into them.
+// An object is deleted once no package refers to it anymore.
+std::string KpmObjectName(const std::array<std::uint8_t, 32>& hash, std::uint32_t mode, std::int64_t mtime);
+
+// Replaces path by a reflink or hard link of object name.
+// False if the object is missing or can't be linked from there (another filesystem), path is untouched then.
+// An object whose mode or mtime no longer match its name was changed through a hard link,
+// it is deleted and false returned so that the freshly written file is adopted in its place.
+bool KpmObjectLink(const std::string& name, const std::string& path);
+
+// Makes the file just written to path object name, or links path to that object if it already exists.
+// Files on another filesystem than the cache are left as they are.
+bool KpmObjectAdopt(const std::string& path, const std::string& name);
+
+// Whether object name exists
+bool KpmObjectExists(const std::string& name);
+
+// Replaces the objects package refers to (none to forget it), those no package refers to anymore are deleted
+bool KpmObjectsReference(const std::string& package, const std::vector<std::string>& names);
+
+// Deletes every object no package refers to, returns how many
+std::size_t KpmObjectsPrune();
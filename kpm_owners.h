@@ -0,0 +1,89 @@
+#pragma once
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "kpm_mmap.h"
+
+// Lock on <file>.lock, shared between readers and exclusive for writers, across kpm processes.
+// Blocks until it is granted. A thread must not ask for it again while it holds it.
+class KpmOwnersLock
+{
+public:
+	KpmOwnersLock() = default;
+	KpmOwnersLock(const std::string& file, bool exclusive);
+	~KpmOwnersLock();
+
+	KpmOwnersLock(KpmOwnersLock&& other) noexcept;
+	KpmOwnersLock& operator=(KpmOwnersLock&& other) noexcept;
+
+	KpmOwnersLock(const KpmOwnersLock&) = delete;
+	KpmOwnersLock& operator=(const KpmOwnersLock&) = delete;
+
+	bool is_locked() const { return _fd >= 0; }
+
+private:
+	void release();
+
+	int _fd = -1;
+};
+
+// Which installed package owns each file, kept in <cache>/owners.db.
+// Layout (little endian):
+//   header    "KPMOWNRS", u32 version, u32 package count, u64 slot count (power of two),
+//             u64 path count, u64 used slot count (paths and tombstones), u64 package capacity,
+//             u64 string heap size, u32 dirty flag, u32 reserved
+//   slots     u64 path hash, u32 path heap offset, u32 package index + 1 (0 is an empty slot, UINT32_MAX a tombstone),
+//             u32 previous and u32 next slot + 1 of the same package (0 ends the chain),
+//             open addressing with linear probing, at most half used
+//   packages  u32 heap offset of the name and u32 first slot + 1 of every package (package capacity entries)
+//   heap      u32 length and bytes of every string, then room for more
+// Lookups hash the path and probe the mapped slots, nothing else is read.
+// Updates change the slots of one package in place, through its chain, and append new strings to the heap.
+// The whole file is only rebuilt when the slots would get more than half used or the package table is full.
+class KpmOwners
+{
+public:
+	// A missing database reads as empty. Holds the lock shared as long as it lives.
+	static std::optional<KpmOwners> Open(const std::string& file);
+
+	// Package owning path, valid as long as this object
+	std::optional<std::string_view> find(std::string_view path) const;
+
+	// Whether package may write path: nobody else owns it, or overwriting was allowed
+	bool claim(std::string_view path, std::string_view package) const;
+
+	// Makes package the owner of exactly paths (none to forget it).
+	// Paths of other packages are kept, those also in paths change owner.
+	// Takes the lock exclusive, the calling thread must not have this database open.
+	// Costs O(paths of package before and after), a rebuild O(all paths).
+	static bool Update(const std::string& file, const std::string& package, const std::vector<std::string>& paths);
+
+private:
+	KpmOwners() = default;
+
+	bool load();
+	std::string_view string(std::size_t offset) const;
+	std::string_view package_name(std::size_t index) const;
+
+	// The whole database anew from what current (if any) holds with the change applied, nullopt if it gets too large
+	static std::optional<std::string> Build(const KpmOwners* current, const std::string& package, const std::vector<std::string>& paths);
+
+	// In place, false if the database has to be rebuilt instead
+	bool update(const std::string& package, const std::vector<std::string>& paths);
+
+	KpmOwnersLock _lock;
+	KpmMappedFile _file;
+	std::size_t _packages = 0;
+	std::size_t _slots = 0;
+	std::size_t _count = 0;
+	std::size_t _used = 0;
+	std::size_t _capacity = 0;
+	std::size_t _package_table = 0;
+	std::size_t _heap = 0;
+	std::size_t _heap_size = 0;
+	bool _dirty = false;
+};
+
+std::string KpmGetOwnersPath();
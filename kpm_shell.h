@@ -0,0 +1,59 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+// What a command wrote to stdout, whole, and how it exited
+struct KpmShellResult
+{
+	std::string output;
+	int status = -1;
+};
+
+// A bash kept running to run many commands without starting a new process for each (POSIX only).
+// Each command goes to its stdin as one line followed by a marker with the exit status:
+//   ( eval '<command>' ) </dev/null; printf '\n<token> %d\n' $?
+// The subshell keeps cd, exit and such from leaking into the next command.
+// Everything the command writes to stdout before the marker is its output, stderr goes to kpm's stderr.
+class KpmShell
+{
+public:
+	// nullptr if bash can't be started
+	static std::unique_ptr<KpmShell> Start();
+	~KpmShell();
+
+	KpmShell(const KpmShell&) = delete;
+	KpmShell& operator=(const KpmShell&) = delete;
+
+	// nullopt if the shell is gone, it can't run anything else then
+	std::optional<KpmShellResult> run(const std::string& command);
+
+private:
+	KpmShell(int fd, int pid, std::string token);
+
+	int _fd;
+	int _pid;
+	std::string _token;
+};
+
+// Runs command in a process of its own (bash -c, cmd.exe /C on Windows)
+std::optional<KpmShellResult> KpmShellRunFresh(const std::string& command);
+
+// What the output of command depends on besides its text: the environment variables that pick
+// interpreters and their search paths, and the path, size and mtime of each program it starts
+std::string KpmShellFingerprint(const std::string& command);
+
+// Shells of one install, each command takes an idle one or starts another.
+// There are as many as commands ever ran at the same time, they exit with the pool.
+class KpmShellPool
+{
+public:
+	// Falls back to a fresh process when no shell can be started
+	std::optional<KpmShellResult> run(const std::string& command);
+
+private:
+	std::mutex _mutex;
+	std::vector<std::unique_ptr<KpmShell>> _idle;
+};
@@ -0,0 +1,35 @@
+#pragma once
+#include <optional>
+#include <string>
+#include <vector>
+
+class KpmJournal;
+class KpmManifestWriter;
+
+// Versioned package store, every install in store mode extracts into a new generation:
+//   <cache>/store/<package>/<n>/          generation n, never written again once sealed
+//   <cache>/store/<package>/<n>.manifest  paths of generation n (post install files outside of it included)
+//   <cache>/store/<package>/<n>.prefix    prefix generation n is activated into
+//   <cache>/store/<package>/current       symlink to the active generation
+// The prefix holds real directories and one symlink per file pointing through current.
+// Switching generations renames current once, only links the two file sets differ in change.
+std::string KpmGetStorePath(const std::string& package);
+
+// Generation directory, ends with a separator
+std::string KpmStoreGenerationPath(const std::string& package, unsigned generation);
+
+// Sealed generations of package, oldest first
+std::vector<unsigned> KpmStoreGenerations(const std::string& package);
+
+// Next unused generation number of package
+unsigned KpmStoreNextGeneration(const std::string& package);
+
+// Active generation of package, if it is installed from the store
+std::optional<unsigned> KpmStoreCurrent(const std::string& package);
+
+// Saves what an extracted generation holds and where it goes, the generation is complete after this
+bool KpmStoreSeal(const std::string& package, unsigned generation, KpmManifestWriter& manifest, const std::string& prefix, KpmJournal& journal);
+
+// Links generation into its prefix, switches current and replaces the package manifest and owners.
+// Links of the previous generation that the new one doesn't have are removed last.
+bool KpmStoreActivate(const std::string& package, unsigned generation, KpmJournal& journal);
@@ -0,0 +1,54 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <span>
+#include <string>
+
+// Batched file IO over io_uring (Linux only, raw syscalls, no liburing).
+// Every call submits a whole batch and waits for it, one ring per thread.
+class KpmUring
+{
+public:
+	// Regular file to create with its whole content.
+	// The path and data must stay valid for the call, result is 0 or -errno.
+	struct File
+	{
+		const char* path;
+		const void* data;
+		std::uint32_t size;
+		std::uint32_t mode;
+		std::int64_t mtime;
+		long mtime_nsec;
+		int result;
+	};
+
+	// nullptr if io_uring (or one of the operations used) is not available, the reason is logged once
+	static std::unique_ptr<KpmUring> Create();
+	~KpmUring();
+
+	KpmUring(const KpmUring&) = delete;
+	KpmUring& operator=(const KpmUring&) = delete;
+
+	// Replaces each path by a new file (unlinkat, openat, write, close linked per file) and sets its mtime.
+	// The mode is applied through the umask, callers only pass modes the umask leaves intact.
+	void write_files(std::span<File> files);
+
+	// unlinkat for every path, results are 0 or -errno
+	void unlink(std::span<const std::string> paths, std::span<int> results);
+
+private:
+	struct Ring;
+
+	KpmUring();
+	struct io_uring_sqe* next_sqe();
+	bool submit_and_wait(unsigned count, const std::function<void(std::uint64_t, int)>& complete);
+
+	std::unique_ptr<Ring> _ring;
+};
+
+// Runtime switch, blocking file IO is used unless enabled (and available)
+bool KpmIsIoUring();
+
+// Process umask, read from one thread before any worker that creates files starts
+std::uint32_t KpmProcessUmask();
@@ -7,16 +7,50 @@ int main(int argc, char* argv[])
 	CLI::App app {"KISS package manager.\nJust keep it simple.", "kpm"};
 
 	CLI::App* install = app.add_subcommand("install", "Install a package.");
+	CLI::App* upgrade = app.add_subcommand("upgrade", "Upgrade a package, only changed files are written.");
 	CLI::App* pack    = app.add_subcommand("pack", "Create a package.");
 	CLI::App* remove  = app.add_subcommand("remove", "Remove a package.");
+	CLI::App* owns    = app.add_subcommand("owns", "Show which package owns a file.");
+	CLI::App* rollback = app.add_subcommand("rollback", "Activate an older store generation of a package.");
+	CLI::App* gc      = app.add_subcommand("gc", "Delete inactive store generations and unused objects.");
 
 	std::string package_name;
+	std::string owns_path;
+	std::vector<std::string> install_packages;
 	std::string install_prefix;
+	std::size_t install_jobs = 4;
+	std::size_t install_segments = 1;
+	std::size_t install_segment_size = 8;
+	bool offline = false;
+	bool overwrite = false;
+	bool io_uring = false;
+	bool store = false;
+	bool dedup = false;
+	unsigned rollback_generation = 0;
 
-	install->add_option("package", package_name, "The package YAML file.")->required();
-	install->add_option("--prefix", install_prefix, "Where to install the package.");
+	for(CLI::App* command : { install, upgrade })
+	{
+		command->add_option("packages", install_packages, "The package YAML files.")->required();
+		command->add_option("--prefix", install_prefix, "Where to install the packages.");
+		command->add_option("-j,--jobs", install_jobs, "How many packages to download at the same time.");
+		command->add_flag("--offline", offline, "Only use previously downloaded files from the kpm cache.");
+		command->add_flag("--overwrite", overwrite, "Replace files owned by other packages.");
+		command->add_flag("--io-uring", io_uring, "Write files in batches through io_uring (Linux).");
+		command->add_flag("--store", store, "Install a new generation into the package store and link it into the prefix.");
+		command->add_flag("--dedup", dedup, "Share identical files with other prefixes through the kpm object store.");
+		command->add_option("--segments", install_segments, "Download large packages as this many concurrent byte ranges.");
+		command->add_option("--segment-size", install_segment_size, "Size of each byte range in MiB.");
+	}
 
 	remove->add_option("package", package_name, "The package to remove.")->required();
+	remove->add_flag("--io-uring", io_uring, "Unlink files in batches through io_uring (Linux).");
+
+	owns->add_option("path", owns_path, "The installed file.")->required();
+
+	rollback->add_option("package", package_name, "The package to roll back.")->required();
+	rollback->add_option("-g,--generation", rollback_generation, "The generation to activate (default: the previous one).");
+
+	gc->add_option("package", package_name, "Only collect this package.");
 
 	// idea is something as simple as:
 	// kpm install <file>.yaml : e.g. install package from local file
@@ -46,14 +80,40 @@ int main(int argc, char* argv[])
 
 	CLI11_PARSE(app, argc, argv);
 
-	if(install->parsed())
+	if(install->parsed() || upgrade->parsed())
 	{
-		KpmInstall(package_name, install_prefix);
+		KpmSetOffline(offline);
+		KpmSetOverwrite(overwrite);
+		KpmSetIoUring(io_uring);
+		KpmSetStore(store);
+		KpmSetDedup(dedup);
+		KpmSetDownloadSegments(install_segments, install_segment_size * 1024 * 1024);
+		if(upgrade->parsed())
+		{
+			KpmUpgrade(install_packages, install_prefix, install_jobs);
+		}
+		else
+		{
+			KpmInstall(install_packages, install_prefix, install_jobs);
+		}
 	}
 	else if(remove->parsed())
 	{
+		KpmSetIoUring(io_uring);
 		KpmRemove(package_name);
 	}
+	else if(owns->parsed())
+	{
+		KpmOwns(owns_path);
+	}
+	else if(rollback->parsed())
+	{
+		KpmRollback(package_name, rollback_generation);
+	}
+	else if(gc->parsed())
+	{
+		KpmGc(package_name);
+	}
 	else if(pack->parsed())
 	{
 	}
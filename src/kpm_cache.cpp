@@ -0,0 +1,453 @@
+#include "../kpm.h"
+#include "../kpm_cache.h"
+#include "logger.inl"
+
+#include <atomic>
+#include <filesystem>
+#include <random>
+#include <system_error>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+static std::atomic<bool> _kpm_offline = false;
+
+void KpmSetOffline(bool offline)
+{
+	_kpm_offline = offline;
+}
+
+bool KpmIsOffline()
+{
+	return _kpm_offline;
+}
+
+static std::filesystem::path KpmCacheDir(const std::string& name)
+{
+	std::filesystem::path dir = std::filesystem::path(KpmGetCachePath()) / name;
+	std::error_code ec;
+	std::filesystem::create_directories(dir, ec);
+	return dir;
+}
+
+static std::filesystem::path KpmCacheMetaPath(const std::string& url)
+{
+	return KpmCacheDir("urls") / KpmSha256Hex(url);
+}
+
+static std::filesystem::path KpmCachePartialPath(const std::string& url)
+{
+	return KpmCacheDir("partial") / KpmSha256Hex(url);
+}
+
+static std::string KpmCacheTempName()
+{
+	static thread_local std::mt19937_64 rng(std::random_device{}());
+	return "tmp-" + std::to_string(rng());
+}
+
+std::string KpmCacheBlobPath(const std::string& blob)
+{
+	return (KpmCacheDir("blobs") / blob).string();
+}
+
+std::optional<KpmCacheEntry> KpmCacheLookup(const std::string& url)
+{
+	std::ifstream file(KpmCacheMetaPath(url));
+	if(!file.is_open())
+	{
+		return std::nullopt;
+	}
+
+	nlohmann::json meta = nlohmann::json::parse(file, nullptr, false);
+	if(meta.is_discarded() || !meta.contains("blob") || meta.value("url", "") != url)
+	{
+		KpmLogWarning("Ignoring corrupt cache entry for {}.", url);
+		return std::nullopt;
+	}
+
+	KpmCacheEntry entry;
+	entry.url = url;
+	entry.etag = meta.value("etag", "");
+	entry.last_modified = meta.value("last_modified", "");
+	entry.blob = meta.value("blob", "");
+	entry.size = meta.value("size", std::uint64_t(0));
+
+	std::error_code ec;
+	if(std::filesystem::file_size(KpmCacheBlobPath(entry.blob), ec) != entry.size || ec)
+	{
+		KpmLogTrace("Cache blob missing for {}.", url);
+		return std::nullopt;
+	}
+
+	return entry;
+}
+
+static bool KpmCacheWriteMeta(const std::filesystem::path& path, const KpmCacheEntry& entry)
+{
+	nlohmann::json meta = {
+		{ "url", entry.url },
+		{ "etag", entry.etag },
+		{ "last_modified", entry.last_modified },
+		{ "blob", entry.blob },
+		{ "size", entry.size }
+	};
+
+	// Write and rename so concurrent readers never see a partial file
+	std::filesystem::path tmp = path.parent_path() / KpmCacheTempName();
+	{
+		std::ofstream file(tmp);
+		if(!file.is_open())
+		{
+			KpmLogError("Failed to write cache metadata for {}.", entry.url);
+			return false;
+		}
+		file << meta.dump();
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(tmp, path, ec);
+	if(ec)
+	{
+		KpmLogError("Failed to write cache metadata for {}: {}", entry.url, ec.message());
+		std::filesystem::remove(tmp, ec);
+		return false;
+	}
+	return true;
+}
+
+bool KpmCacheUpdate(const KpmCacheEntry& entry)
+{
+	return KpmCacheWriteMeta(KpmCacheMetaPath(entry.url), entry);
+}
+
+void KpmCacheEvict(const std::string& url)
+{
+	std::error_code ec;
+	std::filesystem::remove(KpmCacheMetaPath(url), ec);
+}
+
+std::optional<std::string> KpmCacheProbeLookup(const std::string& key)
+{
+	std::ifstream file(KpmCacheDir("probes") / KpmSha256Hex(key));
+	if(!file.is_open())
+	{
+		return std::nullopt;
+	}
+
+	nlohmann::json probe = nlohmann::json::parse(file, nullptr, false);
+	if(probe.is_discarded() || !probe["output"].is_string() || probe.value("key", "") != key)
+	{
+		return std::nullopt;
+	}
+	return probe["output"].get<std::string>();
+}
+
+bool KpmCacheProbeUpdate(const std::string& key, const std::string& output)
+{
+	const std::filesystem::path path = KpmCacheDir("probes") / KpmSha256Hex(key);
+	const nlohmann::json probe = {
+		{ "key", key },
+		{ "output", output }
+	};
+
+	// Output (or a command) that isn't valid UTF-8 is not cached
+	std::string text;
+	try
+	{
+		text = probe.dump();
+	}
+	catch(const nlohmann::json::type_error&)
+	{
+		return false;
+	}
+
+	std::filesystem::path tmp = path.parent_path() / KpmCacheTempName();
+	{
+		std::ofstream file(tmp);
+		if(!file.is_open())
+		{
+			return false;
+		}
+		file << text;
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(tmp, path, ec);
+	if(ec)
+	{
+		std::filesystem::remove(tmp, ec);
+		return false;
+	}
+	return true;
+}
+
+KpmCacheWriter::KpmCacheWriter(const std::string& url) : _url(url)
+{
+}
+
+KpmCacheWriter::~KpmCacheWriter()
+{
+	discard();
+}
+
+bool KpmCacheWriter::write(const void* data, std::size_t size)
+{
+	if(!_open && !_failed)
+	{
+		// Only touch the disk once there is something to cache
+		_tmp_path = (KpmCacheDir("blobs") / KpmCacheTempName()).string();
+		_file.open(_tmp_path, std::ios::binary | std::ios::out);
+		_open = _file.is_open();
+
+		if(!_open)
+		{
+			KpmLogWarning("Failed to open cache file {}. Download will not be cached.", _tmp_path);
+			_failed = true;
+		}
+	}
+
+	if(!_open)
+	{
+		return false;
+	}
+
+	_file.write(static_cast<const char*>(data), size);
+	_sha.update(data, size);
+	_size += size;
+
+	if(!_file)
+	{
+		KpmLogWarning("Failed to write cache file {}. Download will not be cached.", _tmp_path);
+		discard();
+		_failed = true;
+		return false;
+	}
+	return true;
+}
+
+bool KpmCacheWriter::reserve(std::uint64_t size)
+{
+	discard();
+
+	_tmp_path = (KpmCacheDir("blobs") / KpmCacheTempName()).string();
+	_file.open(_tmp_path, std::ios::binary | std::ios::out);
+	_file.close();
+
+	std::error_code ec;
+	std::filesystem::resize_file(_tmp_path, size, ec);
+	if(!ec)
+	{
+		_file.open(_tmp_path, std::ios::binary | std::ios::in | std::ios::out);
+	}
+
+	_open = _file.is_open();
+	if(!_open)
+	{
+		KpmLogWarning("Failed to allocate cache file {}.", _tmp_path);
+		std::filesystem::remove(_tmp_path, ec);
+		_failed = true;
+		return false;
+	}
+
+	_random_access = true;
+	_size = size;
+	return true;
+}
+
+bool KpmCacheWriter::write_at(std::uint64_t offset, const void* data, std::size_t size)
+{
+	if(!_open || !_random_access || offset + size > _size)
+	{
+		return false;
+	}
+
+	_file.seekp(static_cast<std::streamoff>(offset));
+	_file.write(static_cast<const char*>(data), size);
+
+	if(!_file)
+	{
+		KpmLogWarning("Failed to write cache file {}.", _tmp_path);
+		discard();
+		_failed = true;
+		return false;
+	}
+	return true;
+}
+
+std::optional<KpmCacheEntry> KpmCacheWriter::partial() const
+{
+	std::filesystem::path path = KpmCachePartialPath(_url);
+	std::ifstream file(path.string() + ".json");
+	if(!file.is_open())
+	{
+		return std::nullopt;
+	}
+
+	nlohmann::json meta = nlohmann::json::parse(file, nullptr, false);
+	if(meta.is_discarded() || meta.value("url", "") != _url)
+	{
+		return std::nullopt;
+	}
+
+	KpmCacheEntry entry;
+	entry.url = _url;
+	entry.etag = meta.value("etag", "");
+	entry.last_modified = meta.value("last_modified", "");
+	entry.size = meta.value("size", std::uint64_t(0));
+
+	std::error_code ec;
+	if(entry.etag.empty() || std::filesystem::file_size(path, ec) != entry.size || ec)
+	{
+		return std::nullopt;
+	}
+	return entry;
+}
+
+std::optional<std::uint64_t> KpmCacheWriter::resume()
+{
+	std::optional<KpmCacheEntry> entry = partial();
+	if(!entry.has_value())
+	{
+		return std::nullopt;
+	}
+
+	discard();
+
+	// Claim it with a rename, so two processes never append to the same file
+	std::filesystem::path path = KpmCachePartialPath(_url);
+	std::error_code ec;
+	_tmp_path = (KpmCacheDir("blobs") / KpmCacheTempName()).string();
+	std::filesystem::rename(path, _tmp_path, ec);
+	std::filesystem::remove(path.string() + ".json", ec);
+	if(std::filesystem::file_size(_tmp_path, ec) != entry->size || ec)
+	{
+		std::filesystem::remove(_tmp_path, ec);
+		return std::nullopt;
+	}
+
+	_file.open(_tmp_path, std::ios::binary | std::ios::in | std::ios::out | std::ios::app);
+	_open = _file.is_open();
+	if(!_open)
+	{
+		std::filesystem::remove(_tmp_path, ec);
+		return std::nullopt;
+	}
+
+	_failed = false;
+
+	std::vector<char> block(256 * 1024);
+	while(_file)
+	{
+		_file.read(block.data(), block.size());
+		_sha.update(block.data(), static_cast<std::size_t>(_file.gcount()));
+		_size += static_cast<std::uint64_t>(_file.gcount());
+	}
+	_file.clear();
+
+	if(_size != entry->size)
+	{
+		discard();
+		return std::nullopt;
+	}
+
+	KpmLogTrace("Resuming {} from byte {}.", _url, _size);
+	return _size;
+}
+
+void KpmCacheWriter::suspend(const std::string& etag, const std::string& last_modified)
+{
+	if(!_open || _random_access || _size == 0 || etag.empty())
+	{
+		discard();
+		return;
+	}
+
+	_file.close();
+	_open = false;
+
+	KpmCacheEntry entry;
+	entry.url = _url;
+	entry.etag = etag;
+	entry.last_modified = last_modified;
+	entry.size = _size;
+
+	std::filesystem::path path = KpmCachePartialPath(_url);
+	std::error_code ec;
+	std::filesystem::rename(_tmp_path, path, ec);
+	if(ec || !KpmCacheWriteMeta(path.string() + ".json", entry))
+	{
+		std::filesystem::remove(_tmp_path, ec);
+		std::filesystem::remove(path, ec);
+		return;
+	}
+
+	KpmLogTrace("Kept {} bytes of {} to resume later.", _size, _url);
+}
+
+std::optional<KpmCacheEntry> KpmCacheWriter::commit(const std::string& etag, const std::string& last_modified)
+{
+	if(!_open)
+	{
+		return std::nullopt;
+	}
+
+	if(_random_access)
+	{
+		// Written out of order, hash it back from the (hot) page cache
+		_file.flush();
+		_file.seekg(0);
+
+		std::vector<char> block(256 * 1024);
+		while(_file)
+		{
+			_file.read(block.data(), block.size());
+			_sha.update(block.data(), static_cast<std::size_t>(_file.gcount()));
+		}
+	}
+
+	_file.close();
+	_open = false;
+
+	KpmCacheEntry entry;
+	entry.url = _url;
+	entry.etag = etag;
+	entry.last_modified = last_modified;
+	entry.blob = _sha.hexdigest();
+	entry.size = _size;
+
+	// Same content may already be there from another url, the rename just replaces it
+	std::error_code ec;
+	std::filesystem::rename(_tmp_path, KpmCacheBlobPath(entry.blob), ec);
+	if(ec)
+	{
+		KpmLogWarning("Failed to store cache blob for {}: {}", _url, ec.message());
+		std::filesystem::remove(_tmp_path, ec);
+		return std::nullopt;
+	}
+
+	if(!KpmCacheUpdate(entry))
+	{
+		return std::nullopt;
+	}
+
+	KpmLogTrace("Cached {} as blob {}.", _url, entry.blob);
+	return entry;
+}
+
+void KpmCacheWriter::discard()
+{
+	if(!_open)
+	{
+		return;
+	}
+
+	_file.close();
+	_open = false;
+	_random_access = false;
+	_sha = KpmSha256();
+	_size = 0;
+
+	std::error_code ec;
+	std::filesystem::remove(_tmp_path, ec);
+}
@@ -0,0 +1,455 @@
+#include "../kpm_decode.h"
+#include "../kpm_hash.h"
+#include "logger.inl"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <optional>
+
+#include <lzma.h>
+#include <zstd.h>
+
+static constexpr std::size_t KPM_DECODE_CHUNK = 256 * 1024;
+
+// zstd frames are only decoded whole on a worker when their header says they decode to at most this
+// (pzstd frames at its default level), everything else is decoded as it streams in
+static constexpr std::size_t KPM_DECODE_FRAME_MAX = 32 * KPM_DECODE_CHUNK;
+
+const char* KpmCodecName(KpmCodec codec)
+{
+	switch(codec)
+	{
+		case KpmCodec::NONE: return "none";
+		case KpmCodec::GZIP: return "gzip";
+		case KpmCodec::XZ:   return "xz";
+		case KpmCodec::ZSTD: return "zstd";
+	}
+	return "unknown";
+}
+
+struct KpmDecoder::Xz
+{
+	lzma_stream stream = LZMA_STREAM_INIT;
+
+	~Xz()
+	{
+		lzma_end(&stream);
+	}
+};
+
+struct KpmDecoder::Zstd
+{
+	ZSTD_DCtx* dctx = ZSTD_createDCtx();
+	bool streaming = false; // Inside a large frame decoded in line
+	std::deque<std::future<std::optional<std::vector<std::uint8_t>>>> frames;
+
+	~Zstd()
+	{
+		frames.clear();
+		ZSTD_freeDCtx(dctx);
+	}
+};
+
+// Size of the frame at data once decoded (the payload of skippable frames),
+// ZSTD_CONTENTSIZE_UNKNOWN if its header leaves it out and ZSTD_CONTENTSIZE_ERROR while the header is incomplete
+static unsigned long long KpmZstdFrameSize(const std::uint8_t* data, std::size_t size)
+{
+	if(size >= 8 && (data[0] & 0xf0) == 0x50 && data[1] == 0x2a && data[2] == 0x4d && data[3] == 0x18)
+	{
+		return std::uint32_t(data[4]) | std::uint32_t(data[5]) << 8 | std::uint32_t(data[6]) << 16 | std::uint32_t(data[7]) << 24;
+	}
+	return ZSTD_getFrameContentSize(data, size);
+}
+
+// frame points either into owned or into memory that outlives the decoder, it decodes to at most KPM_DECODE_FRAME_MAX
+static std::optional<std::vector<std::uint8_t>> KpmZstdDecodeFrame(const std::uint8_t* frame, std::size_t size, std::vector<std::uint8_t> owned)
+{
+	std::vector<std::uint8_t> out;
+	out.reserve(KpmZstdFrameSize(frame, size));
+
+	ZSTD_DCtx* dctx = ZSTD_createDCtx();
+	ZSTD_inBuffer in { frame, size, 0 };
+	bool ok = false;
+
+	while(true)
+	{
+		std::size_t used = out.size();
+		out.resize(used + KPM_DECODE_CHUNK);
+		ZSTD_outBuffer chunk { out.data() + used, KPM_DECODE_CHUNK, 0 };
+		std::size_t ret = ZSTD_decompressStream(dctx, &chunk, &in);
+		out.resize(used + chunk.pos);
+
+		if(ZSTD_isError(ret) || (ret != 0 && in.pos == in.size && chunk.pos == 0))
+		{
+			break;
+		}
+
+		if(ret == 0)
+		{
+			ok = true;
+			break;
+		}
+	}
+
+	ZSTD_freeDCtx(dctx);
+	return ok ? std::optional(std::move(out)) : std::nullopt;
+}
+
+KpmDecoder::KpmDecoder(Source source, unsigned threads) : _source(std::move(source)), _threads(std::max(threads, 1u))
+{
+}
+
+KpmDecoder::KpmDecoder(const std::uint8_t* data, std::size_t size, unsigned threads)
+	: _threads(std::max(threads, 1u)), _memory(data), _memory_size(size), _eof(true)
+{
+}
+
+KpmDecoder::~KpmDecoder() = default;
+
+bool KpmDecoder::fill()
+{
+	if(_eof)
+	{
+		return false;
+	}
+
+	if(_in_begin > 0)
+	{
+		_in.erase(_in.begin(), _in.begin() + _in_begin);
+		_in_begin = 0;
+	}
+
+	std::size_t used = _in.size();
+	_in.resize(used + KPM_DECODE_CHUNK);
+	std::int64_t count = _source(_in.data() + used, KPM_DECODE_CHUNK);
+	_in.resize(used + static_cast<std::size_t>(std::max<std::int64_t>(count, 0)));
+
+	if(count < 0)
+	{
+		_error = "Failed to read package data.";
+	}
+
+	_eof = count <= 0;
+	return count > 0;
+}
+
+std::int64_t KpmDecoder::fail(std::string error)
+{
+	_error = std::move(error);
+	_done = true;
+	return -1;
+}
+
+std::int64_t KpmDecoder::read(const std::uint8_t** data)
+{
+	if(!_detected)
+	{
+		_detected = true;
+		while(available() < 6 && fill())
+		{
+		}
+
+		if(!_error.empty())
+		{
+			return -1;
+		}
+
+		const std::uint8_t* magic = input();
+		const std::size_t size = available();
+		if(size >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		{
+			_codec = KpmCodec::GZIP;
+		}
+		else if(size >= 6 && std::memcmp(magic, "\xfd" "7zXZ\0", 6) == 0)
+		{
+			_codec = KpmCodec::XZ;
+		}
+		else if(size >= 4 && ((magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) ||
+			((magic[0] & 0xf0) == 0x50 && magic[1] == 0x2a && magic[2] == 0x4d && magic[3] == 0x18)))
+		{
+			// Regular or skippable zstd frame
+			_codec = KpmCodec::ZSTD;
+		}
+
+		KpmLogTrace("Package data compression: {}.", KpmCodecName(_codec));
+
+		if(_codec == KpmCodec::XZ)
+		{
+			_xz = std::make_unique<Xz>();
+#if LZMA_VERSION >= 50040002
+			lzma_mt options = {};
+			options.flags = LZMA_CONCATENATED;
+			options.threads = _threads;
+			options.memlimit_threading = std::max<std::uint64_t>(lzma_physmem() / 4, 64 * 1024 * 1024);
+			options.memlimit_stop = UINT64_MAX;
+			lzma_ret ret = lzma_stream_decoder_mt(&_xz->stream, &options);
+#else
+			lzma_ret ret = lzma_stream_decoder(&_xz->stream, UINT64_MAX, LZMA_CONCATENATED);
+#endif
+			if(ret != LZMA_OK)
+			{
+				return fail("Failed to init the xz decoder.");
+			}
+		}
+		else if(_codec == KpmCodec::ZSTD)
+		{
+			_zstd = std::make_unique<Zstd>();
+		}
+	}
+
+	if(_done)
+	{
+		return _error.empty() ? 0 : -1;
+	}
+
+	switch(_codec)
+	{
+		case KpmCodec::XZ:
+			return read_xz(data);
+		case KpmCodec::ZSTD:
+			return read_zstd(data);
+		default:
+			return read_raw(data);
+	}
+}
+
+std::int64_t KpmDecoder::read_raw(const std::uint8_t** data)
+{
+	if(available() == 0 && !fill())
+	{
+		_done = true;
+		return _error.empty() ? 0 : -1;
+	}
+
+	*data = input();
+	std::size_t count = available();
+	_in_begin += count;
+	return static_cast<std::int64_t>(count);
+}
+
+std::int64_t KpmDecoder::read_xz(const std::uint8_t** data)
+{
+	lzma_stream& stream = _xz->stream;
+	_out.resize(KPM_DECODE_CHUNK);
+	stream.next_out = _out.data();
+	stream.avail_out = _out.size();
+
+	while(stream.avail_out == _out.size())
+	{
+		if(available() == 0 && !_eof && !fill() && !_error.empty())
+		{
+			return -1;
+		}
+
+		stream.next_in = input();
+		stream.avail_in = available();
+		lzma_ret ret = lzma_code(&stream, _eof && available() == 0 ? LZMA_FINISH : LZMA_RUN);
+		_in_begin += available() - stream.avail_in;
+
+		if(ret == LZMA_STREAM_END)
+		{
+			_done = true;
+			break;
+		}
+
+		if(ret != LZMA_OK)
+		{
+			return fail("Failed to decode xz data (lzma error " + std::to_string(ret) + ").");
+		}
+	}
+
+	*data = _out.data();
+	return static_cast<std::int64_t>(_out.size() - stream.avail_out);
+}
+
+std::int64_t KpmDecoder::read_zstd(const std::uint8_t** data)
+{
+	Zstd& zstd = *_zstd;
+
+	while(true)
+	{
+		// Split complete frames off the input and decode them on worker threads,
+		// reading ahead while the oldest one is still being decoded.
+		// Frames of unknown or large decoded size (plain zstd output is one frame) are streamed instead,
+		// that keeps memory bounded and extraction going while they download.
+		while(!zstd.streaming && zstd.frames.size() < _threads)
+		{
+			const unsigned long long content = KpmZstdFrameSize(input(), available());
+			if(content != ZSTD_CONTENTSIZE_ERROR && (content == ZSTD_CONTENTSIZE_UNKNOWN || content > KPM_DECODE_FRAME_MAX))
+			{
+				zstd.streaming = true;
+				break;
+			}
+
+			std::size_t size = content == ZSTD_CONTENTSIZE_ERROR ? 0 : ZSTD_findFrameCompressedSize(input(), available());
+			if(size > 0 && !ZSTD_isError(size))
+			{
+				std::vector<std::uint8_t> owned;
+				const std::uint8_t* frame = input();
+				if(!_memory)
+				{
+					owned.assign(frame, frame + size);
+					frame = owned.data();
+				}
+				_in_begin += size;
+				zstd.frames.push_back(std::async(std::launch::async, KpmZstdDecodeFrame, frame, size, std::move(owned)));
+				continue;
+			}
+
+			if(available() > 2 * KPM_DECODE_FRAME_MAX)
+			{
+				// No small frame is this large compressed, corrupt data. The stream decoder reports what is wrong.
+				zstd.streaming = true;
+				break;
+			}
+
+			if(!zstd.frames.empty() && zstd.frames.front().wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+			{
+				break;
+			}
+
+			if(!fill())
+			{
+				break;
+			}
+		}
+
+		if(!zstd.frames.empty())
+		{
+			std::optional<std::vector<std::uint8_t>> frame = zstd.frames.front().get();
+			zstd.frames.pop_front();
+			if(!frame.has_value())
+			{
+				return fail("Failed to decode zstd data (corrupt frame).");
+			}
+
+			if(frame->empty())
+			{
+				// Skippable frame
+				continue;
+			}
+
+			_out = std::move(frame.value());
+			*data = _out.data();
+			return static_cast<std::int64_t>(_out.size());
+		}
+
+		if(!_error.empty())
+		{
+			return -1;
+		}
+
+		if(!zstd.streaming)
+		{
+			if(available() > 0)
+			{
+				return fail("Failed to decode zstd data (truncated).");
+			}
+			_done = true;
+			return 0;
+		}
+
+		_out.resize(KPM_DECODE_CHUNK);
+		ZSTD_outBuffer chunk { _out.data(), _out.size(), 0 };
+		while(chunk.pos == 0 && zstd.streaming)
+		{
+			if(available() == 0 && !fill())
+			{
+				return _error.empty() ? fail("Failed to decode zstd data (truncated).") : -1;
+			}
+
+			ZSTD_inBuffer in { input(), available(), 0 };
+			std::size_t ret = ZSTD_decompressStream(zstd.dctx, &chunk, &in);
+			_in_begin += in.pos;
+
+			if(ZSTD_isError(ret))
+			{
+				return fail(std::string("Failed to decode zstd data (") + ZSTD_getErrorName(ret) + ").");
+			}
+
+			// End of the large frame, back to splitting
+			zstd.streaming = ret != 0;
+		}
+
+		if(chunk.pos > 0)
+		{
+			*data = _out.data();
+			return static_cast<std::int64_t>(chunk.pos);
+		}
+	}
+}
+
+std::optional<std::string> KpmZstdPatch(const std::uint8_t* base, std::size_t base_size, const std::uint8_t* patch, std::size_t patch_size, const std::string& out)
+{
+	std::ofstream file(out, std::ios::binary | std::ios::trunc);
+	if(!file.is_open())
+	{
+		KpmLogError("Failed to open {} for writing.", out);
+		return std::nullopt;
+	}
+
+	ZSTD_DCtx* dctx = ZSTD_createDCtx();
+	if(!dctx)
+	{
+		KpmLogError("Failed to create zstd decoder.");
+		return std::nullopt;
+	}
+
+	// Patches against large files reference the whole base, their windows are as large
+	ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, ZSTD_dParam_getBounds(ZSTD_d_windowLogMax).upperBound);
+
+	KpmSha256 sha;
+	std::vector<std::uint8_t> chunk(KPM_DECODE_CHUNK);
+	ZSTD_inBuffer in { patch, patch_size, 0 };
+	std::size_t ret = 0;
+	bool ok = true;
+	while(ok && in.pos < in.size)
+	{
+		// The prefix only lasts for one frame
+		if(ret == 0 && ZSTD_isError(ZSTD_DCtx_refPrefix(dctx, base, base_size)))
+		{
+			ok = false;
+			break;
+		}
+
+		ZSTD_outBuffer decoded { chunk.data(), chunk.size(), 0 };
+		ret = ZSTD_decompressStream(dctx, &decoded, &in);
+		if(ZSTD_isError(ret))
+		{
+			KpmLogError("Failed to apply patch ({}).", ZSTD_getErrorName(ret));
+			ok = false;
+			break;
+		}
+
+		sha.update(decoded.dst, decoded.pos);
+		ok = static_cast<bool>(file.write(reinterpret_cast<const char*>(decoded.dst), decoded.pos));
+	}
+
+	// Drain what the last frame still holds
+	while(ok && ret != 0)
+	{
+		ZSTD_outBuffer decoded { chunk.data(), chunk.size(), 0 };
+		ret = ZSTD_decompressStream(dctx, &decoded, &in);
+		if(ZSTD_isError(ret) || decoded.pos == 0)
+		{
+			KpmLogError("Failed to apply patch (truncated).");
+			ok = false;
+			break;
+		}
+
+		sha.update(decoded.dst, decoded.pos);
+		ok = static_cast<bool>(file.write(reinterpret_cast<const char*>(decoded.dst), decoded.pos));
+	}
+	ZSTD_freeDCtx(dctx);
+
+	if(!ok || !file.flush())
+	{
+		KpmLogError("Failed to write patched file {}.", out);
+		return std::nullopt;
+	}
+	return sha.hexdigest();
+}
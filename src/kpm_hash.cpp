@@ -0,0 +1,150 @@
+#include "../kpm_hash.h"
+
+#include <algorithm>
+#include <cstring>
+
+static constexpr std::array<std::uint32_t, 64> KPM_SHA256_K = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static constexpr std::uint32_t KpmRotr(std::uint32_t x, int n)
+{
+	return (x >> n) | (x << (32 - n));
+}
+
+KpmSha256::KpmSha256()
+	: _state({ 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 })
+{
+}
+
+void KpmSha256::transform(const std::uint8_t* block)
+{
+	std::uint32_t w[64];
+	for(int i = 0; i < 16; i++)
+	{
+		w[i] = (std::uint32_t(block[i * 4]) << 24) | (std::uint32_t(block[i * 4 + 1]) << 16) |
+			   (std::uint32_t(block[i * 4 + 2]) << 8) | std::uint32_t(block[i * 4 + 3]);
+	}
+
+	for(int i = 16; i < 64; i++)
+	{
+		std::uint32_t s0 = KpmRotr(w[i - 15], 7) ^ KpmRotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		std::uint32_t s1 = KpmRotr(w[i - 2], 17) ^ KpmRotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	std::uint32_t a = _state[0], b = _state[1], c = _state[2], d = _state[3];
+	std::uint32_t e = _state[4], f = _state[5], g = _state[6], h = _state[7];
+
+	for(int i = 0; i < 64; i++)
+	{
+		std::uint32_t s1 = KpmRotr(e, 6) ^ KpmRotr(e, 11) ^ KpmRotr(e, 25);
+		std::uint32_t ch = (e & f) ^ (~e & g);
+		std::uint32_t t1 = h + s1 + ch + KPM_SHA256_K[i] + w[i];
+		std::uint32_t s0 = KpmRotr(a, 2) ^ KpmRotr(a, 13) ^ KpmRotr(a, 22);
+		std::uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+		std::uint32_t t2 = s0 + maj;
+
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+
+	_state[0] += a; _state[1] += b; _state[2] += c; _state[3] += d;
+	_state[4] += e; _state[5] += f; _state[6] += g; _state[7] += h;
+}
+
+void KpmSha256::update(const void* data, std::size_t size)
+{
+	const auto* bytes = static_cast<const std::uint8_t*>(data);
+	_length += size;
+
+	if(_block_size > 0)
+	{
+		std::size_t count = std::min(size, _block.size() - _block_size);
+		std::memcpy(_block.data() + _block_size, bytes, count);
+		_block_size += count;
+		bytes += count;
+		size -= count;
+
+		if(_block_size < _block.size())
+		{
+			return;
+		}
+
+		transform(_block.data());
+		_block_size = 0;
+	}
+
+	while(size >= _block.size())
+	{
+		transform(bytes);
+		bytes += _block.size();
+		size -= _block.size();
+	}
+
+	std::memcpy(_block.data(), bytes, size);
+	_block_size = size;
+}
+
+std::array<std::uint8_t, 32> KpmSha256::digest()
+{
+	std::uint64_t bit_length = _length * 8;
+	std::uint8_t pad = 0x80;
+	update(&pad, 1);
+
+	pad = 0x00;
+	while(_block_size != 56)
+	{
+		update(&pad, 1);
+	}
+
+	std::uint8_t length[8];
+	for(int i = 0; i < 8; i++)
+	{
+		length[i] = static_cast<std::uint8_t>(bit_length >> (56 - i * 8));
+	}
+	update(length, 8);
+
+	std::array<std::uint8_t, 32> out;
+	for(int i = 0; i < 8; i++)
+	{
+		out[i * 4]     = static_cast<std::uint8_t>(_state[i] >> 24);
+		out[i * 4 + 1] = static_cast<std::uint8_t>(_state[i] >> 16);
+		out[i * 4 + 2] = static_cast<std::uint8_t>(_state[i] >> 8);
+		out[i * 4 + 3] = static_cast<std::uint8_t>(_state[i]);
+	}
+	return out;
+}
+
+std::string KpmSha256::hexdigest()
+{
+	static constexpr char hex[] = "0123456789abcdef";
+	std::string out;
+	out.reserve(64);
+	for(std::uint8_t byte : digest())
+	{
+		out.push_back(hex[byte >> 4]);
+		out.push_back(hex[byte & 0x0f]);
+	}
+	return out;
+}
+
+std::string KpmSha256Hex(std::string_view data)
+{
+	KpmSha256 sha;
+	sha.update(data.data(), data.size());
+	return sha.hexdigest();
+}
@@ -0,0 +1,796 @@
+#include "../kpm.h"
+#include "../kpm_cache.h"
+#include "../kpm_http.h"
+#include "logger.inl"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <optional>
+#include <random>
+#include <unordered_set>
+#include <utility>
+
+struct KpmHttpClient::Transfer
+{
+	KpmHttpRequest request;
+	CURL* easy = nullptr;
+	curl_slist* headers = nullptr;
+	std::promise<KpmHttpResult> promise;
+	bool paused = false;
+	char error[CURL_ERROR_SIZE] = {};
+};
+
+KpmHttpClient& KpmHttpClient::Get()
+{
+	static KpmHttpClient client;
+	return client;
+}
+
+KpmHttpClient::KpmHttpClient()
+{
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+
+	const auto lock_handle = +[](CURL*, curl_lock_data data, curl_lock_access, void* userptr) {
+		reinterpret_cast<KpmHttpClient*>(userptr)->_share_mutex[data].lock();
+	};
+
+	const auto unlock_handle = +[](CURL*, curl_lock_data data, void* userptr) {
+		reinterpret_cast<KpmHttpClient*>(userptr)->_share_mutex[data].unlock();
+	};
+
+	_share = curl_share_init();
+	curl_share_setopt(_share, CURLSHOPT_LOCKFUNC, lock_handle);
+	curl_share_setopt(_share, CURLSHOPT_UNLOCKFUNC, unlock_handle);
+	curl_share_setopt(_share, CURLSHOPT_USERDATA, this);
+	curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+
+	_multi = curl_multi_init();
+	curl_multi_setopt(_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+	_driver = std::thread(&KpmHttpClient::run, this);
+}
+
+KpmHttpClient::~KpmHttpClient()
+{
+	{
+		std::lock_guard lock(_mutex);
+		_stop = true;
+	}
+	curl_multi_wakeup(_multi);
+	_driver.join();
+
+	curl_multi_cleanup(_multi);
+	curl_share_cleanup(_share);
+	curl_global_cleanup();
+}
+
+std::future<KpmHttpResult> KpmHttpClient::submit(KpmHttpRequest request)
+{
+	auto transfer = std::make_unique<Transfer>();
+	transfer->request = std::move(request);
+	std::future<KpmHttpResult> result = transfer->promise.get_future();
+
+	transfer->easy = curl_easy_init();
+	if(!transfer->easy)
+	{
+		KpmLogError("Failed to init CURL.");
+		transfer->promise.set_value({ false, 0, CURLE_FAILED_INIT, "Failed to init CURL." });
+		return result;
+	}
+
+	const auto write_handle = +[](char* ptr, size_t size, size_t nmemb, void* userdata) -> std::size_t {
+		auto* transfer = reinterpret_cast<Transfer*>(userdata);
+		std::size_t total_size = size * nmemb;
+		if(!transfer->request.on_data)
+		{
+			return total_size;
+		}
+
+		switch(transfer->request.on_data(reinterpret_cast<std::uint8_t*>(ptr), total_size))
+		{
+			case KpmHttpWrite::OK:
+				return total_size;
+			case KpmHttpWrite::PAUSE:
+				transfer->paused = true;
+				return CURL_WRITEFUNC_PAUSE;
+			case KpmHttpWrite::ABORT:
+				break;
+		}
+		return 0;
+	};
+
+	const auto header_handle = +[](char* ptr, size_t size, size_t nmemb, void* userdata) -> std::size_t {
+		auto* transfer = reinterpret_cast<Transfer*>(userdata);
+		std::size_t total_size = size * nmemb;
+		if(transfer->request.on_header)
+		{
+			transfer->request.on_header(std::string_view(ptr, total_size));
+		}
+		return total_size;
+	};
+
+	for(const auto& header : transfer->request.headers)
+	{
+		transfer->headers = curl_slist_append(transfer->headers, header.c_str());
+	}
+
+	CURL* curl = transfer->easy;
+	curl_easy_setopt(curl, CURLOPT_URL, transfer->request.url.c_str());
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, transfer.get());
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, transfer->error);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_handle);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, transfer.get());
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_handle);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, transfer.get());
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, transfer->headers);
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl, CURLOPT_FAILONERROR, transfer->request.fail_on_error ? 1L : 0L);
+	curl_easy_setopt(curl, CURLOPT_NOBODY, transfer->request.head ? 1L : 0L);
+	curl_easy_setopt(curl, CURLOPT_RESUME_FROM_LARGE, static_cast<curl_off_t>(transfer->request.resume_from));
+	curl_easy_setopt(curl, CURLOPT_USERAGENT, "Kpm-Client-App");
+	curl_easy_setopt(curl, CURLOPT_SHARE, _share);
+	curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
+	curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	// curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
+
+	{
+		std::lock_guard lock(_mutex);
+		_pending.push(std::move(transfer));
+	}
+	curl_multi_wakeup(_multi);
+
+	return result;
+}
+
+KpmHttpResult KpmHttpClient::perform(KpmHttpRequest request)
+{
+	return submit(std::move(request)).get();
+}
+
+void KpmHttpClient::resume()
+{
+	{
+		std::lock_guard lock(_mutex);
+		_resume = true;
+	}
+	curl_multi_wakeup(_multi);
+}
+
+void KpmHttpClient::set_max_transfers(std::size_t max)
+{
+	{
+		std::lock_guard lock(_mutex);
+		_max_transfers = std::max<std::size_t>(max, 1);
+	}
+	curl_multi_wakeup(_multi);
+}
+
+void KpmHttpClient::finish(Transfer* transfer, CURLcode code)
+{
+	KpmHttpResult result;
+	result.code = code;
+	result.ok = (code == CURLE_OK);
+	curl_easy_getinfo(transfer->easy, CURLINFO_RESPONSE_CODE, &result.status);
+
+	if(code != CURLE_OK)
+	{
+		result.error = transfer->error[0] ? transfer->error : curl_easy_strerror(code);
+	}
+
+	char* effective_url = nullptr;
+	if(curl_easy_getinfo(transfer->easy, CURLINFO_EFFECTIVE_URL, &effective_url) == CURLE_OK && effective_url)
+	{
+		result.effective_url = effective_url;
+	}
+
+	long connects = 0;
+	curl_easy_getinfo(transfer->easy, CURLINFO_NUM_CONNECTS, &connects);
+	KpmLogTrace("Fetched {} (status {}, {}).", transfer->request.url, result.status, connects > 0 ? "new connection" : "reused connection");
+
+	curl_multi_remove_handle(_multi, transfer->easy);
+	curl_easy_cleanup(transfer->easy);
+	curl_slist_free_all(transfer->headers);
+	transfer->promise.set_value(std::move(result));
+
+	std::lock_guard lock(_mutex);
+	_running.remove_if([transfer](const auto& t) { return t.get() == transfer; });
+}
+
+void KpmHttpClient::run()
+{
+	while(true)
+	{
+		bool resume = false;
+		{
+			std::lock_guard lock(_mutex);
+			if(_stop && _pending.empty() && _running.empty())
+			{
+				break;
+			}
+
+			while(!_pending.empty() && _running.size() < _max_transfers)
+			{
+				curl_multi_add_handle(_multi, _pending.front()->easy);
+				_running.push_back(std::move(_pending.front()));
+				_pending.pop();
+			}
+
+			resume = std::exchange(_resume, false);
+		}
+
+		if(resume)
+		{
+			// _running is only modified on this thread
+			for(const auto& transfer : _running)
+			{
+				if(transfer->paused)
+				{
+					transfer->paused = false;
+					curl_easy_pause(transfer->easy, CURLPAUSE_CONT);
+				}
+			}
+		}
+
+		int running = 0;
+		curl_multi_perform(_multi, &running);
+
+		int left = 0;
+		while(CURLMsg* msg = curl_multi_info_read(_multi, &left))
+		{
+			if(msg->msg == CURLMSG_DONE)
+			{
+				Transfer* transfer = nullptr;
+				curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &transfer);
+				finish(transfer, msg->data.result);
+			}
+		}
+
+		curl_multi_poll(_multi, nullptr, 0, 1000, nullptr);
+	}
+}
+
+// Urls already fetched or revalidated by this process
+static std::unordered_set<std::string> _kpm_fresh_urls;
+static std::mutex _kpm_fresh_urls_mutex;
+
+static bool KpmIsUrlFresh(const std::string& url)
+{
+	std::lock_guard lock(_kpm_fresh_urls_mutex);
+	return _kpm_fresh_urls.contains(url);
+}
+
+static void KpmSetUrlFresh(const std::string& url)
+{
+	std::lock_guard lock(_kpm_fresh_urls_mutex);
+	_kpm_fresh_urls.insert(url);
+}
+
+// Feeds a cached blob to the sink, checking it still matches its content hash
+static bool KpmCacheReplay(const KpmCacheEntry& entry, const KpmHttpSink& sink)
+{
+	std::ifstream file(KpmCacheBlobPath(entry.blob), std::ios::binary);
+	if(!file.is_open())
+	{
+		KpmLogError("Failed to open cached file for {}.", entry.url);
+		return false;
+	}
+
+	KpmSha256 sha;
+	std::vector<char> block(64 * 1024);
+	while(file)
+	{
+		file.read(block.data(), block.size());
+		std::size_t count = static_cast<std::size_t>(file.gcount());
+		if(count == 0)
+		{
+			break;
+		}
+
+		sha.update(block.data(), count);
+		if(sink(reinterpret_cast<std::uint8_t*>(block.data()), count) != KpmHttpWrite::OK)
+		{
+			return false;
+		}
+	}
+
+	if(sha.hexdigest() != entry.blob)
+	{
+		KpmLogError("Cached file for {} is corrupt. Evicting it, please retry.", entry.url);
+		KpmCacheEvict(entry.url);
+		return false;
+	}
+
+	return true;
+}
+
+static KpmHttpResponse KpmFetchFromCache(const KpmCacheEntry& entry, const KpmHttpSink& sink, bool replay)
+{
+	KpmHttpResponse response;
+	response.status = 200;
+	response.cached = true;
+
+	if(replay)
+	{
+		response.ok = KpmCacheReplay(entry, sink);
+	}
+	else
+	{
+		response.ok = true;
+		response.blob_path = KpmCacheBlobPath(entry.blob);
+	}
+	return response;
+}
+
+// Status and validators of the last response of a (possibly redirected) transfer
+struct KpmHttpHeaders
+{
+	long status = 0;
+	std::string etag;
+	std::string last_modified;
+	std::string accept_ranges;
+	std::uint64_t content_length = 0;
+
+	void parse(std::string_view line)
+	{
+		auto value_of = [&line](std::string_view name) -> std::optional<std::string> {
+			if(line.size() <= name.size() || !std::equal(name.begin(), name.end(), line.begin(), [](char a, char b) { return a == std::tolower(b); }))
+			{
+				return std::nullopt;
+			}
+			std::string_view value = line.substr(name.size());
+			value.remove_prefix(std::min(value.find_first_not_of(" \t"), value.size()));
+			value = value.substr(0, value.find_last_not_of(" \t\r\n") + 1);
+			return std::string(value);
+		};
+
+		if(line.starts_with("HTTP/"))
+		{
+			// A new response (e.g. after a redirect) starts here
+			*this = {};
+			std::size_t space = line.find(' ');
+			status = space == std::string_view::npos ? 0 : std::strtol(line.data() + space + 1, nullptr, 10);
+		}
+		else if(auto value = value_of("etag:"))
+		{
+			etag = value.value();
+		}
+		else if(auto value = value_of("last-modified:"))
+		{
+			last_modified = value.value();
+		}
+		else if(auto value = value_of("accept-ranges:"))
+		{
+			accept_ranges = value.value();
+		}
+		else if(auto value = value_of("content-length:"))
+		{
+			content_length = std::strtoull(value->c_str(), nullptr, 10);
+		}
+	}
+};
+
+static std::size_t _kpm_download_segments = 1;
+static std::size_t _kpm_download_segment_size = 8 * 1024 * 1024;
+
+void KpmSetDownloadSegments(std::size_t segments, std::size_t segment_size)
+{
+	_kpm_download_segments = std::max<std::size_t>(segments, 1);
+	_kpm_download_segment_size = std::max<std::size_t>(segment_size, 64 * 1024);
+}
+
+std::size_t KpmGetDownloadSegments()
+{
+	return _kpm_download_segments;
+}
+
+static void KpmAddConditionalHeaders(KpmHttpRequest& request, const std::optional<KpmCacheEntry>& cached)
+{
+	if(!cached.has_value())
+	{
+		return;
+	}
+
+	if(!cached->etag.empty())
+	{
+		request.headers.push_back("If-None-Match: " + cached->etag);
+	}
+	if(!cached->last_modified.empty())
+	{
+		request.headers.push_back("If-Modified-Since: " + cached->last_modified);
+	}
+}
+
+static void KpmRevalidated(const std::string& url, KpmCacheEntry& cached, const std::string& etag)
+{
+	KpmLogTrace("Not modified, using cached {}.", url);
+	if(!etag.empty() && etag != cached.etag)
+	{
+		cached.etag = etag;
+		KpmCacheUpdate(cached);
+	}
+	KpmSetUrlFresh(url);
+}
+
+static constexpr int KPM_FETCH_ATTEMPTS = 5;
+
+// Failures that may go away by trying again
+static bool KpmIsTransientError(const KpmHttpResult& result)
+{
+	switch(result.code)
+	{
+		case CURLE_COULDNT_RESOLVE_HOST:
+		case CURLE_COULDNT_CONNECT:
+		case CURLE_OPERATION_TIMEDOUT:
+		case CURLE_SSL_CONNECT_ERROR:
+		case CURLE_PARTIAL_FILE:
+		case CURLE_GOT_NOTHING:
+		case CURLE_SEND_ERROR:
+		case CURLE_RECV_ERROR:
+		case CURLE_HTTP2:
+		case CURLE_HTTP2_STREAM:
+			return true;
+		case CURLE_HTTP_RETURNED_ERROR:
+			return result.status == 429 || result.status >= 500;
+		default:
+			return false;
+	}
+}
+
+// Weak ETags can't be used with If-Range
+static bool KpmIsStrongETag(const std::string& etag)
+{
+	return !etag.empty() && !etag.starts_with("W/");
+}
+
+static std::chrono::milliseconds KpmRetryDelay(int attempt)
+{
+	static thread_local std::mt19937 rng(std::random_device{}());
+	std::uniform_int_distribution<int> jitter(0, 250);
+	return std::chrono::milliseconds((500 << std::min(attempt, 4)) + jitter(rng));
+}
+
+// Downloads an url as concurrent byte ranges straight into the cache.
+// Returns std::nullopt when the server can't do it (or it is not worth it),
+// in which case the caller falls back to a single stream.
+static std::optional<KpmHttpResponse> KpmFetchUrlSegmented(const std::string& url, std::optional<KpmCacheEntry>& cached)
+{
+	KpmHttpHeaders head;
+	KpmHttpRequest request;
+	request.url = url;
+	request.head = true;
+	request.fail_on_error = true;
+	request.on_header = [&head](std::string_view line) { head.parse(line); };
+	KpmAddConditionalHeaders(request, cached);
+
+	KpmHttpResult result = KpmHttpClient::Get().perform(std::move(request));
+	if(!result.ok)
+	{
+		KpmLogTrace("HEAD {} failed ({}). Not using segments.", url, result.error);
+		return std::nullopt;
+	}
+
+	if(head.status == 304 && cached.has_value())
+	{
+		KpmRevalidated(url, cached.value(), head.etag);
+		return KpmFetchFromCache(cached.value(), {}, false);
+	}
+
+	const std::uint64_t length = head.content_length;
+	const std::uint64_t segment_size = _kpm_download_segment_size;
+	if(head.status != 200 || head.accept_ranges != "bytes" || length < 2 * segment_size)
+	{
+		KpmLogTrace("Not using segments for {} (status {}, ranges '{}', size {}).", url, head.status, head.accept_ranges, length);
+		return std::nullopt;
+	}
+
+	KpmCacheWriter writer(url);
+	if(!writer.reserve(length))
+	{
+		return std::nullopt;
+	}
+
+	// Ranges go straight to where redirects ended up
+	const std::string target = result.effective_url.empty() ? url : result.effective_url;
+	const std::uint64_t segments = (length + segment_size - 1) / segment_size;
+	std::atomic<std::uint64_t> next_segment = 0;
+	std::atomic<bool> failed = false;
+
+	KpmLogTrace("Downloading {} as {} segments of {} bytes.", url, segments, segment_size);
+
+	// Sinks run on the http client thread, so writer is only ever touched by one thread at a time
+	auto lane = [&]() {
+		for(std::uint64_t segment = next_segment++; segment < segments && !failed; segment = next_segment++)
+		{
+			const std::uint64_t begin = segment * segment_size;
+			const std::uint64_t end = std::min(begin + segment_size, length);
+			std::uint64_t offset = begin;
+			KpmHttpHeaders part;
+
+			KpmHttpRequest range;
+			range.url = target;
+			range.fail_on_error = true;
+			range.headers.push_back("Range: bytes=" + std::to_string(begin) + "-" + std::to_string(end - 1));
+			if(!head.etag.empty())
+			{
+				// Fail instead of mixing bytes from two versions of the file
+				range.headers.push_back("If-Range: " + head.etag);
+			}
+
+			range.on_header = [&part](std::string_view line) { part.parse(line); };
+			range.on_data = [&part, &offset, &writer, end](const std::uint8_t* data, std::size_t size) {
+				if(part.status != 206 || offset + size > end || !writer.write_at(offset, data, size))
+				{
+					return KpmHttpWrite::ABORT;
+				}
+				offset += size;
+				return KpmHttpWrite::OK;
+			};
+
+			KpmHttpResult range_result = KpmHttpClient::Get().perform(std::move(range));
+			if(!range_result.ok || part.status != 206 || offset != end)
+			{
+				KpmLogWarning("Segment {}-{} of {} failed (status {}).", begin, end, url, part.status);
+				failed = true;
+			}
+		}
+	};
+
+	std::vector<std::thread> lanes;
+	for(std::uint64_t i = 0; i < std::min<std::uint64_t>(_kpm_download_segments, segments); i++)
+	{
+		lanes.emplace_back(lane);
+	}
+
+	for(auto& thread : lanes)
+	{
+		thread.join();
+	}
+
+	if(failed)
+	{
+		KpmLogWarning("Segmented download failed. Retrying as a single stream.");
+		return std::nullopt;
+	}
+
+	std::optional<KpmCacheEntry> entry = writer.commit(head.etag, head.last_modified);
+	if(!entry.has_value())
+	{
+		return std::nullopt;
+	}
+
+	KpmSetUrlFresh(url);
+
+	KpmHttpResponse response;
+	response.ok = true;
+	response.status = 200;
+	response.blob_path = KpmCacheBlobPath(entry->blob);
+	return response;
+}
+
+KpmHttpResponse KpmFetchUrl(const std::string& url, const KpmHttpSink& sink, bool fail_on_error, bool replay)
+{
+	std::optional<KpmCacheEntry> cached = KpmCacheLookup(url);
+
+	if(KpmIsOffline() || KpmIsUrlFresh(url))
+	{
+		if(cached.has_value())
+		{
+			KpmLogTrace("Using cached {}.", url);
+			return KpmFetchFromCache(cached.value(), sink, replay);
+		}
+
+		if(KpmIsOffline())
+		{
+			KpmLogError("Offline mode: {} is not cached.", url);
+			return {};
+		}
+	}
+
+	struct KpmFetchState
+	{
+		const KpmHttpSink* sink;
+		KpmCacheWriter writer;
+		KpmHttpHeaders headers;
+		std::string etag;          // Validators of the content being downloaded
+		std::string last_modified;
+		std::uint64_t offset = 0;  // Content bytes received so far
+		std::uint64_t skip = 0;    // Bytes already received to drop from a response that starts over
+		bool stream = true;        // Content goes to the sink as it arrives instead of from the cache
+		bool started = false;      // First content of the current attempt was seen
+		bool changed = false;      // Content changed under an interrupted download
+	} state { &sink, KpmCacheWriter(url) };
+
+	std::optional<KpmCacheEntry> partial = state.writer.partial();
+
+	if(!partial.has_value() && !replay && _kpm_download_segments > 1)
+	{
+		if(auto response = KpmFetchUrlSegmented(url, cached))
+		{
+			return response.value();
+		}
+	}
+
+	if(partial.has_value())
+	{
+		if(std::optional<std::uint64_t> offset = state.writer.resume())
+		{
+			// The sink can't take the content halfway, complete it in the cache and serve it from there
+			state.offset = offset.value();
+			state.etag = partial->etag;
+			state.last_modified = partial->last_modified;
+			state.stream = false;
+		}
+	}
+
+	KpmHttpResult result;
+	bool use_range = true;
+	for(int attempt = 0;; attempt++)
+	{
+		if(state.offset > 0 && !state.stream && (!use_range || !KpmIsStrongETag(state.etag)))
+		{
+			KpmLogTrace("Restarting download of {}.", url);
+			state.writer.discard();
+			state.offset = 0;
+			use_range = true;
+		}
+
+		KpmHttpRequest request;
+		request.url = url;
+		request.fail_on_error = fail_on_error;
+		state.headers = {};
+		state.started = false;
+		state.skip = 0;
+
+		if(state.offset == 0 || !state.stream)
+		{
+			KpmAddConditionalHeaders(request, cached);
+		}
+
+		if(state.offset > 0 && use_range)
+		{
+			request.resume_from = state.offset;
+			request.headers.push_back("If-Range: " + state.etag);
+		}
+		else
+		{
+			// The sink already has these, drop them from a full response of the same content
+			state.skip = state.offset;
+		}
+
+		request.on_header = [&state](std::string_view line) { state.headers.parse(line); };
+
+		request.on_data = [&state](const std::uint8_t* data, std::size_t size) {
+			const long status = state.headers.status;
+			if(status != 200 && status != 206)
+			{
+				// Not content (e.g. an error page), nothing to keep
+				return state.stream ? (*state.sink)(data, size) : KpmHttpWrite::OK;
+			}
+
+			if(!state.started)
+			{
+				state.started = true;
+				if(state.offset == 0)
+				{
+					state.etag = state.headers.etag;
+					state.last_modified = state.headers.last_modified;
+				}
+				else if(status == 200 && state.headers.etag != state.etag)
+				{
+					state.changed = true;
+					return KpmHttpWrite::ABORT;
+				}
+			}
+
+			const std::size_t drop = static_cast<std::size_t>(std::min<std::uint64_t>(state.skip, size));
+			if(drop == size)
+			{
+				state.skip -= drop;
+				return KpmHttpWrite::OK;
+			}
+
+			if(state.stream)
+			{
+				KpmHttpWrite result = (*state.sink)(data + drop, size - drop);
+				if(result != KpmHttpWrite::OK)
+				{
+					return result;
+				}
+			}
+
+			if(!state.writer.write(data + drop, size - drop) && !state.stream)
+			{
+				return KpmHttpWrite::ABORT;
+			}
+
+			state.skip -= drop;
+			state.offset += size - drop;
+			return KpmHttpWrite::OK;
+		};
+
+		const bool ranged = request.resume_from > 0;
+		result = KpmHttpClient::Get().perform(std::move(request));
+
+		if(ranged && (result.code == CURLE_RANGE_ERROR || result.status == 416))
+		{
+			// Changed since, or the server can't do ranges
+			use_range = false;
+			if(attempt + 1 < KPM_FETCH_ATTEMPTS)
+			{
+				KpmLogWarning("Cannot resume {}, downloading it again.", url);
+				continue;
+			}
+			result.ok = false;
+			result.error = "Cannot resume download.";
+		}
+
+		if(result.ok || state.changed || !KpmIsTransientError(result) || attempt + 1 >= KPM_FETCH_ATTEMPTS)
+		{
+			break;
+		}
+
+		if(state.offset > 0 && state.stream && !KpmIsStrongETag(state.etag))
+		{
+			// Part of it went to the sink and there is no safe way to continue it
+			break;
+		}
+
+		std::chrono::milliseconds delay = KpmRetryDelay(attempt);
+		KpmLogWarning("Failed to fetch {}: {}. Retrying in {} ms ({}/{}).", url, result.error, delay.count(), attempt + 1, KPM_FETCH_ATTEMPTS - 1);
+		std::this_thread::sleep_for(delay);
+	}
+
+	if(!result.ok)
+	{
+		if(state.changed)
+		{
+			KpmLogError("{} changed while downloading it. Please retry.", url);
+		}
+		else if(result.code != CURLE_WRITE_ERROR)
+		{
+			KpmLogError("Failed to fetch {}: {}", url, result.error);
+		}
+
+		if(!state.changed && KpmIsStrongETag(state.etag))
+		{
+			state.writer.suspend(state.etag, state.last_modified);
+		}
+		return {};
+	}
+
+	if(state.headers.status == 304 && cached.has_value())
+	{
+		KpmRevalidated(url, cached.value(), state.headers.etag);
+		return KpmFetchFromCache(cached.value(), sink, replay);
+	}
+
+	KpmHttpResponse response;
+	response.ok = true;
+	response.status = state.headers.status == 206 ? 200 : state.headers.status;
+
+	if(response.status == 200)
+	{
+		std::optional<KpmCacheEntry> entry = state.writer.commit(state.etag, state.last_modified);
+		if(entry.has_value())
+		{
+			KpmSetUrlFresh(url);
+		}
+
+		if(!state.stream)
+		{
+			if(!entry.has_value())
+			{
+				KpmLogError("Failed to store {} in the cache.", url);
+				return {};
+			}
+			return KpmFetchFromCache(entry.value(), sink, replay);
+		}
+	}
+
+	return response;
+}
@@ -1,19 +1,42 @@
 #include "../kpm.h"
+#include "../kpm_cache.h"
+#include "../kpm_decode.h"
+#include "../kpm_hash.h"
+#include "../kpm_http.h"
+#include "../kpm_journal.h"
+#include "../kpm_manifest.h"
+#include "../kpm_objects.h"
+#include "../kpm_owners.h"
+#include "../kpm_shell.h"
+#include "../kpm_store.h"
+#include "../kpm_uring.h"
+#include "../kpm_mmap.h"
 #include "logger.inl"
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iterator>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <queue>
 #include <regex>
 #include <cstdio>
+#include <thread>
 
-#include <curl/curl.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 #include <yaml-cpp/exceptions.h>
@@ -24,6 +47,14 @@
 #include <nlohmann/json.hpp>
 #include <nlohmann/json_fwd.hpp>
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #ifndef _WIN32
 #include <sys/utsname.h>
 #else
@@ -33,16 +64,40 @@
 #ifndef S_ISDIR
 #define S_ISDIR(m)  (((m) & _S_IFMT) == _S_IFDIR)
 #endif
-
-#define popen _popen
-#define pclose _pclose
 #endif
 
 KPM_SET_LOG_PREFIX(KpmInstall);
 
-static std::stringstream _manifest_stream;
-static std::string _kpm_install_prefix;
+// Size of the ring buffer between the download and extraction threads
+constexpr std::size_t KPM_STREAM_BUFFER_SIZE = 8 * 1024 * 1024;
+
+// Extraction writer pool: thread count, file payloads in flight and largest file handed to it.
+// Writers mostly wait on syscalls, so there can be more of them than cores.
+constexpr unsigned KPM_EXTRACT_THREADS_MIN = 4;
+constexpr unsigned KPM_EXTRACT_THREADS_MAX = 8;
+constexpr std::size_t KPM_EXTRACT_BUFFER_SIZE = 32 * 1024 * 1024;
+constexpr std::size_t KPM_EXTRACT_POOL_FILE_SIZE = 1024 * 1024;
+
+// Files a writer takes at once when writing through io_uring
+constexpr std::size_t KPM_EXTRACT_URING_BATCH = 64;
+
+// Post install copies and moves: files a thread takes at once and most threads
+constexpr std::size_t KPM_COPY_BATCH = 16;
+constexpr unsigned KPM_COPY_THREADS_MAX = 8;
+
+// Threads running independent post install steps, mostly waiting on the processes exec steps start
+constexpr unsigned KPM_POST_INSTALL_THREADS_MIN = 4;
+constexpr unsigned KPM_POST_INSTALL_THREADS_MAX = 8;
+
+// Largest file an upgrade compares before writing, it is read and hashed in memory first
+constexpr std::size_t KPM_UPGRADE_COMPARE_SIZE = 64 * 1024 * 1024;
+
 static std::string _kpm_cache_path;
+static std::mutex _kpm_cache_path_mutex;
+
+static std::atomic<bool> _kpm_overwrite = false;
+static std::atomic<bool> _kpm_store = false;
+static std::atomic<bool> _kpm_dedup = false;
 
 enum class KpmMediaType
 {
@@ -65,6 +120,37 @@ enum class KpmArch
 	UNKNOWN
 };
 
+// Patch from dist.packages that rebuilds the archive of a platform from an older one
+struct KpmPatchAsset
+{
+	std::string url;
+	std::string from;   // SHA-256 of the archive it applies to
+	std::string sha256; // SHA-256 of the archive it produces
+};
+
+// State of a single package install
+struct KpmInstallContext
+{
+	std::string package;
+	std::string prefix;
+	YAML::Node config;
+	std::string dist;
+	bool dist_source = false;
+	bool dist_local = false;
+	std::optional<KpmPatchAsset> patch; // Applies to the archive installed last, tried before dist
+	std::string dist_blob; // Cache blob of the archive deployed, recorded once the install is done
+	KpmManifestWriter manifest;
+	std::optional<KpmOwners> owners; // Open (and locked shared) until the paths of the package are checked
+	std::unique_ptr<KpmJournal> journal; // Every path the deploy creates, until it is in the manifest
+	unsigned generation = 0; // Store generation being extracted, store mode only
+	std::string store; // Its directory, everything is installed there instead of the prefix
+	bool upgrade = false;
+	std::optional<KpmManifest> installed; // Upgrades only, the manifest being replaced
+	bool dedup = false; // Files are shared through the object store (not in store mode)
+	std::vector<std::string> objects; // Objects the extracted files share
+	std::unique_ptr<KpmShellPool> shells; // Run the exec post install steps, while they run
+};
+
 #ifdef WIN32
 #undef WIN32
 #endif
@@ -80,37 +166,18 @@ enum class KpmOs
 template<typename T> requires (std::is_same_v<T, nlohmann::json> || std::is_same_v<T, std::string> || std::is_same_v<T, YAML::Node>)
 static std::optional<T> KpmGet(const std::string& url)
 {
-	CURL* curl = curl_easy_init();
-
-	if(!curl)
-	{
-		KpmLogError("Failed to init CURL.");
-		return std::nullopt;
-	}
-
 	std::string buffer;
-	const auto write_handle = +[](void* ptr, size_t size, size_t nmemb, void* userdata) -> std::size_t {
-		auto* stream = reinterpret_cast<std::string*>(userdata);
-		std::size_t total_size = size * nmemb;
-		stream->append(static_cast<char*>(ptr), total_size);
-		return total_size;
-	};
+	KpmHttpResponse response = KpmFetchUrl(url, [&buffer](const std::uint8_t* data, std::size_t size) {
+		buffer.append(reinterpret_cast<const char*>(data), size);
+		return KpmHttpWrite::OK;
+	}, false);
 
-	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_handle);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
-	curl_easy_setopt(curl, CURLOPT_USERAGENT, "Kpm-Client-App");
-
-	CURLcode res = curl_easy_perform(curl);
-	if(res != CURLE_OK)
+	if(!response.ok)
 	{
 		KpmLogError("Failed to fetch github api info for given repository.");
-		curl_easy_cleanup(curl);
 		return std::nullopt;
 	}
 
-	curl_easy_cleanup(curl);
-
 	if constexpr (std::is_same_v<T, nlohmann::json>)
 	{
 		return nlohmann::json::parse(buffer);
@@ -127,13 +194,6 @@ static std::optional<T> KpmGet(const std::string& url)
 	}
 }
 
-template<typename T>
-static std::int32_t KpmJsonFindInArray(const nlohmann::json& json, const std::string& key, const T& value)
-{
-	auto it = std::find_if(json.begin(), json.end(), [&](const nlohmann::json& obj) { return obj.contains(key) && obj[key] == value; });
-	return it == json.end() ? -1 : std::distance(json.begin(), it);
-}
-
 static bool KpmCheckGithubRepo(const std::string& package)
 {
 	// The repository name can only contain ASCII letters, digits, and the characters ., -, and _
@@ -141,9 +201,44 @@ static bool KpmCheckGithubRepo(const std::string& package)
 	return std::regex_match(package, re);
 }
 
+// Path of a file:// url or of an existing local file or directory
+static std::optional<std::string> KpmLocalPath(const std::string& location)
+{
+	if(location.starts_with("file://"))
+	{
+		std::string path = location.substr(7);
+		if(path.starts_with("localhost/"))
+		{
+			path.erase(0, 9);
+		}
+
+		int length = 0;
+		if(char* decoded = curl_easy_unescape(nullptr, path.c_str(), static_cast<int>(path.size()), &length))
+		{
+			path.assign(decoded, length);
+			curl_free(decoded);
+		}
+
+#ifdef _WIN32
+		// file:///C:/dir
+		if(path.size() > 2 && path[0] == '/' && path[2] == ':')
+		{
+			path.erase(0, 1);
+		}
+#endif
+		return path;
+	}
+
+	if(location.find("://") == std::string::npos && std::filesystem::exists(std::filesystem::path(location)))
+	{
+		return location;
+	}
+	return std::nullopt;
+}
+
 static KpmMediaType KpmDetectMedia(const std::string& package)
 {
-	if(std::filesystem::exists(std::filesystem::path(package)))
+	if(KpmLocalPath(package).has_value())
 	{
 		KpmLogTrace("Media type = LOCAL");
 		return KpmMediaType::LOCAL;
@@ -164,34 +259,392 @@ static std::optional<std::vector<std::uint8_t>> KpmDownloadUrlFile(const std::st
 {
 	KpmLogTrace("Downloading file from url: {}", url);
 
-	CURL* curl = curl_easy_init();
-    if (!curl)
+	std::vector<std::uint8_t> data;
+	KpmHttpResponse response = KpmFetchUrl(url, [&data](const std::uint8_t* ptr, std::size_t size) {
+		data.insert(data.end(), ptr, ptr + size);
+		return KpmHttpWrite::OK;
+	}, true);
+
+	KpmLogTrace("KpmDownloadUrlFile() OK.");
+	return response.ok ? std::optional(data) : std::nullopt;
+}
+
+// Bounded byte ring between one producer (curl write callback)
+// and one consumer (libarchive read callback) living on different threads.
+// The producer runs on the http client thread so it pauses instead of blocking.
+// Memory use is capped at the ring capacity regardless of the payload size.
+class KpmStreamBuffer
+{
+public:
+	explicit KpmStreamBuffer(std::size_t capacity) : _ring(capacity)
 	{
-        return {};
 	}
 
-	std::vector<std::uint8_t> data;
-	const auto write_handle = +[](void* ptr, size_t size, size_t nmemb, void* userdata) -> std::size_t {
-		auto* stream = reinterpret_cast<std::vector<std::uint8_t>*>(userdata);
-		std::size_t total_size = size * nmemb;
-		stream->insert(stream->end(), reinterpret_cast<std::uint8_t*>(ptr), reinterpret_cast<std::uint8_t*>(ptr) + total_size);
-		return total_size;
-	};
+	// Producer side. Never blocks, a chunk is either taken whole or not at all.
+	// On PAUSE the producer is woken up through the drain callback once there is room.
+	KpmHttpWrite push(const std::uint8_t* data, std::size_t size)
+	{
+		std::lock_guard lock(_mutex);
+		if(_released)
+		{
+			// Consumer is done with the stream, drop any trailing bytes
+			return _consumer_failed ? KpmHttpWrite::ABORT : KpmHttpWrite::OK;
+		}
+
+		if(_used == 0 && size > _ring.size())
+		{
+			_ring.resize(size);
+			_head = 0;
+		}
+
+		if(_ring.size() - _used < size)
+		{
+			_wanted = size;
+			return KpmHttpWrite::PAUSE;
+		}
 
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_handle);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &data);
-    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-	// curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
-	// curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+		while(size > 0)
+		{
+			std::size_t tail = (_head + _used) % _ring.size();
+			std::size_t count = std::min(size, _ring.size() - tail);
+			std::copy_n(data, count, _ring.begin() + tail);
+			_used += count;
+			data += count;
+			size -= count;
+		}
+		_cv.notify_all();
+		return KpmHttpWrite::OK;
+	}
 
-    CURLcode res = curl_easy_perform(curl);
-    curl_easy_cleanup(curl);
+	void on_drain(std::function<void()> callback)
+	{
+		_on_drain = std::move(callback);
+	}
 
-	KpmLogTrace("KpmDownloadUrlFile() OK.");
-    return (res == CURLE_OK) ? std::optional(data) : std::nullopt;
+	// Producer side. Signals there is no more data.
+	void finish(bool ok)
+	{
+		std::lock_guard lock(_mutex);
+		_finished = true;
+		_producer_failed = !ok;
+		_cv.notify_all();
+	}
+
+	// Consumer side. Blocks while the ring is empty.
+	// Returns the number of bytes read, 0 on end of stream or -1 if the producer failed.
+	std::int64_t pull(std::uint8_t* out, std::size_t size)
+	{
+		bool drained = false;
+		std::size_t count = 0;
+		{
+			std::unique_lock lock(_mutex);
+			_cv.wait(lock, [this]() { return _used > 0 || _finished; });
+
+			if(_used == 0)
+			{
+				return _producer_failed ? -1 : 0;
+			}
+
+			count = std::min(size, std::min(_used, _ring.size() - _head));
+			std::copy_n(_ring.begin() + _head, count, out);
+			_head = (_head + count) % _ring.size();
+			_used -= count;
+
+			if(_wanted > 0 && _ring.size() - _used >= _wanted)
+			{
+				_wanted = 0;
+				drained = true;
+			}
+		}
+
+		if(drained && _on_drain)
+		{
+			_on_drain();
+		}
+		return static_cast<std::int64_t>(count);
+	}
+
+	// Consumer side. Stop reading from the stream.
+	void release(bool ok)
+	{
+		bool drained = false;
+		{
+			std::lock_guard lock(_mutex);
+			_released = true;
+			_consumer_failed = !ok;
+			drained = std::exchange(_wanted, 0) > 0;
+		}
+
+		if(drained && _on_drain)
+		{
+			_on_drain();
+		}
+	}
+
+private:
+	std::vector<std::uint8_t> _ring;
+	std::size_t _head = 0;
+	std::size_t _used = 0;
+	std::size_t _wanted = 0;
+	bool _finished = false;
+	bool _producer_failed = false;
+	bool _released = false;
+	bool _consumer_failed = false;
+	std::mutex _mutex;
+	std::condition_variable _cv;
+	std::function<void()> _on_drain;
+};
+
+// Plain files whose whole metadata is the content, mode and mtime
+static bool KpmIsPlainEntry(struct archive_entry* entry)
+{
+	unsigned long fflags_set = 0;
+	unsigned long fflags_clear = 0;
+	archive_entry_fflags(entry, &fflags_set, &fflags_clear);
+
+	return (archive_entry_perm(entry) & 07000) == 0 && fflags_set == 0
+		&& archive_entry_acl_count(entry, ARCHIVE_ENTRY_ACL_TYPE_ACCESS | ARCHIVE_ENTRY_ACL_TYPE_DEFAULT | ARCHIVE_ENTRY_ACL_TYPE_NFS4) == 0
+		&& archive_entry_xattr_count(entry) == 0
+		&& archive_entry_mtime_is_set(entry);
 }
 
+// Writes regular files of an archive to disk on several threads.
+// The reader hands over whole file payloads, bounded by max_bytes in flight.
+// Each writer has its own archive_write_disk, so creating, writing, chmod and
+// setting times of different files all happen in parallel.
+// With io_uring the writers take batches of files and submit them at once instead,
+// anything the ring can't reproduce (ACLs, special bits, ...) still goes through archive_write_disk.
+// With dedup, plain files already in the object store are linked from there instead of written,
+// the others become objects once written.
+class KpmExtractWriterPool
+{
+public:
+	KpmExtractWriterPool(unsigned threads, std::size_t max_bytes, int flags, bool dedup) : _max_bytes(max_bytes), _uring(KpmIsIoUring()), _dedup(dedup)
+	{
+		// archive_write_disk_new() swaps the process umask to read it, only do it from this thread
+		_umask = _uring ? KpmProcessUmask() : 0;
+		for(unsigned i = 0; i < threads; i++)
+		{
+			struct archive* disk = archive_write_disk_new();
+			archive_write_disk_set_options(disk, flags);
+			archive_write_disk_set_standard_lookup(disk);
+			_threads.emplace_back(&KpmExtractWriterPool::run, this, disk);
+		}
+	}
+
+	~KpmExtractWriterPool()
+	{
+		{
+			std::lock_guard lock(_mutex);
+			_stop = true;
+			while(!_jobs.empty())
+			{
+				archive_entry_free(_jobs.front().entry);
+				_jobs.pop();
+			}
+		}
+		_cv_jobs.notify_all();
+
+		for(auto& thread : _threads)
+		{
+			thread.join();
+		}
+	}
+
+	KpmExtractWriterPool(const KpmExtractWriterPool&) = delete;
+	KpmExtractWriterPool& operator=(const KpmExtractWriterPool&) = delete;
+
+	// Queues a file, takes ownership of entry. The content hash is stored into record once written.
+	// Blocks while the buffer is full or the same path is still being written.
+	bool submit(struct archive_entry* entry, std::vector<std::uint8_t> data, KpmManifestEntry& record)
+	{
+		Job job { entry, std::move(data), archive_entry_pathname(entry), &record };
+
+		std::unique_lock lock(_mutex);
+		_cv_done.wait(lock, [this, &job]() {
+			return _failed || (!_paths.contains(job.path) && (_bytes == 0 || _bytes + job.data.size() <= _max_bytes));
+		});
+
+		if(_failed)
+		{
+			archive_entry_free(entry);
+			return false;
+		}
+
+		_bytes += job.data.size();
+		_paths.insert(job.path);
+		_jobs.push(std::move(job));
+		_cv_jobs.notify_one();
+		return true;
+	}
+
+	// Waits for every queued file. Returns false if any of them failed.
+	bool wait()
+	{
+		std::unique_lock lock(_mutex);
+		_cv_done.wait(lock, [this]() { return _failed || _paths.empty(); });
+		return !_failed;
+	}
+
+	// Waits until path is not being written anymore
+	bool wait(const std::string& path)
+	{
+		std::unique_lock lock(_mutex);
+		_cv_done.wait(lock, [this, &path]() { return _failed || !_paths.contains(path); });
+		return !_failed;
+	}
+
+	// Objects the written files share, complete after wait()
+	std::vector<std::string> objects()
+	{
+		std::lock_guard lock(_mutex);
+		return _objects;
+	}
+
+private:
+	struct Job
+	{
+		struct archive_entry* entry;
+		std::vector<std::uint8_t> data;
+		std::string path;
+		KpmManifestEntry* record = nullptr;
+	};
+
+	bool uring_eligible(const Job& job) const
+	{
+		return KpmIsPlainEntry(job.entry) && (archive_entry_perm(job.entry) & _umask) == 0;
+	}
+
+	void run(struct archive* disk)
+	{
+		std::unique_ptr<KpmUring> ring = _uring ? KpmUring::Create() : nullptr;
+		const std::size_t batch_size = ring ? KPM_EXTRACT_URING_BATCH : 1;
+
+		while(true)
+		{
+			std::vector<Job> batch;
+			{
+				std::unique_lock lock(_mutex);
+				_cv_jobs.wait(lock, [this]() { return _stop || !_jobs.empty(); });
+				if(_jobs.empty())
+				{
+					break;
+				}
+				while(!_jobs.empty() && batch.size() < batch_size)
+				{
+					batch.push_back(std::move(_jobs.front()));
+					_jobs.pop();
+				}
+			}
+
+			std::vector<bool> written(batch.size(), false);
+			std::vector<std::string> objects(batch.size());
+			std::vector<bool> linked(batch.size(), false);
+			for(std::size_t i = 0; i < batch.size(); i++)
+			{
+				Job& job = batch[i];
+				KpmSha256 sha;
+				sha.update(job.data.data(), job.data.size());
+				job.record->hash = sha.digest();
+
+				if(_dedup && KpmIsPlainEntry(job.entry))
+				{
+					objects[i] = KpmObjectName(job.record->hash, archive_entry_perm(job.entry), archive_entry_mtime(job.entry));
+					linked[i] = written[i] = KpmObjectLink(objects[i], job.path);
+				}
+			}
+
+			if(ring)
+			{
+				std::vector<KpmUring::File> files;
+				std::vector<std::size_t> indices;
+				for(std::size_t i = 0; i < batch.size(); i++)
+				{
+					const Job& job = batch[i];
+					if(!written[i] && uring_eligible(job))
+					{
+						files.push_back({ job.path.c_str(), job.data.data(), static_cast<std::uint32_t>(job.data.size()),
+							static_cast<std::uint32_t>(archive_entry_perm(job.entry)), archive_entry_mtime(job.entry), archive_entry_mtime_nsec(job.entry), 0 });
+						indices.push_back(i);
+					}
+				}
+
+				ring->write_files(files);
+				for(std::size_t i = 0; i < files.size(); i++)
+				{
+					written[indices[i]] = files[i].result == 0;
+				}
+			}
+
+			std::size_t bytes = 0;
+			bool ok = true;
+			for(std::size_t i = 0; i < batch.size(); i++)
+			{
+				Job& job = batch[i];
+
+				// Files the ring did not write (e.g. their directory is missing) take the regular path
+				bool job_ok = written[i] || (archive_write_header(disk, job.entry) >= ARCHIVE_WARN
+					&& (job.data.empty() || archive_write_data_block(disk, job.data.data(), job.data.size(), 0) >= ARCHIVE_WARN)
+					&& archive_write_finish_entry(disk) >= ARCHIVE_WARN);
+
+				if(!job_ok)
+				{
+					KpmLogError("Failed to write {}: {}", job.path, archive_error_string(disk));
+				}
+				else
+				{
+					job.record->hashed = true;
+				}
+
+				// A file that could not be shared is simply not an object
+				if(job_ok && !objects[i].empty() && !linked[i] && !KpmObjectAdopt(job.path, objects[i]))
+				{
+					objects[i].clear();
+				}
+				archive_entry_free(job.entry);
+				bytes += job.data.size();
+				ok = ok && job_ok;
+			}
+
+			{
+				std::lock_guard lock(_mutex);
+				for(auto& object : objects)
+				{
+					if(!object.empty())
+					{
+						_objects.push_back(std::move(object));
+					}
+				}
+				_bytes -= bytes;
+				for(const auto& job : batch)
+				{
+					_paths.erase(job.path);
+				}
+				_failed = _failed || !ok;
+			}
+			_cv_done.notify_all();
+		}
+
+		archive_write_close(disk);
+		archive_write_free(disk);
+	}
+
+	std::vector<std::thread> _threads;
+	std::queue<Job> _jobs;
+	std::unordered_set<std::string> _paths; // Queued or being written
+	std::size_t _bytes = 0;
+	std::size_t _max_bytes;
+	bool _failed = false;
+	bool _stop = false;
+	bool _uring;
+	bool _dedup;
+	std::vector<std::string> _objects;
+	std::uint32_t _umask = 0;
+	std::mutex _mutex;
+	std::condition_variable _cv_jobs;
+	std::condition_variable _cv_done;
+};
+
 static std::optional<std::string> KpmLoadYamlLocal(const std::string& file)
 {
 	std::ifstream handle(file);
@@ -378,13 +831,14 @@ static bool KpmValidateConfig(const YAML::Node& config)
 	return true;
 }
 
-static bool KpmDeploySource(const std::string& package, const YAML::Node& config)
+static bool KpmDeploySource(const std::string& package, KpmInstallContext& ctx)
 {
 	return false;
 }
 
 std::string KpmGetCachePath()
 {
+	std::lock_guard lock(_kpm_cache_path_mutex);
 	if(!_kpm_cache_path.empty())
 	{
 		return _kpm_cache_path;
@@ -410,11 +864,16 @@ std::string KpmGetCachePath()
 	return _kpm_cache_path;
 }
 
-static std::string KpmGetInstallPath(const YAML::Node& config)
+static std::string KpmGetInstallPath(KpmInstallContext& ctx)
 {
-	if(!_kpm_install_prefix.empty())
+	if(!ctx.store.empty())
 	{
-		return _kpm_install_prefix;
+		return ctx.store;
+	}
+
+	if(!ctx.prefix.empty())
+	{
+		return ctx.prefix;
 	}
 
 	switch (KpmDetectOs())
@@ -422,28 +881,122 @@ static std::string KpmGetInstallPath(const YAML::Node& config)
 		case KpmOs::WIN32:
 		{
 			const char* home = std::getenv("PROGRAMFILES");
-			_kpm_install_prefix = std::string(home) + "\\" + config["metadata"]["name"].as<std::string>() + "\\";
+			ctx.prefix = std::string(home) + "\\" + ctx.config["metadata"]["name"].as<std::string>() + "\\";
 			break;
 		}
 		case KpmOs::LINUX:
 		case KpmOs::DARWIN:
 		{
 			const char* home = std::getenv("HOME");
-			_kpm_install_prefix = std::string(home) + "/.local/";
+			ctx.prefix = std::string(home) + "/.local/";
 			break;
 		}
 	}
 
-	return _kpm_install_prefix;
+	return ctx.prefix;
 }
 
-static void KpmInstallManifestAddPath(const std::string& path)
+static KpmManifestEntry& KpmInstallManifestAddEntry(KpmInstallContext& ctx, const std::string& path, struct archive_entry* entry)
 {
 	KpmLogTrace("Adding file to manifest: {}", path);
-	_manifest_stream << path << '\n';
+
+	KpmManifestType type = KpmManifestType::OTHER;
+	if(archive_entry_hardlink(entry))
+	{
+		type = KpmManifestType::HARDLINK;
+	}
+	else
+	{
+		switch(archive_entry_filetype(entry))
+		{
+			case AE_IFREG: type = KpmManifestType::FILE; break;
+			case AE_IFDIR: type = KpmManifestType::DIRECTORY; break;
+			case AE_IFLNK: type = KpmManifestType::SYMLINK; break;
+		}
+	}
+
+	KpmManifestEntry& record = ctx.manifest.add(path, type);
+	record.mode = archive_entry_perm(entry);
+	record.mtime = archive_entry_mtime(entry);
+	if(type == KpmManifestType::FILE)
+	{
+		record.size = archive_entry_size(entry);
+	}
+	else if(type == KpmManifestType::SYMLINK)
+	{
+		const char* target = archive_entry_symlink(entry);
+		record.size = target ? std::strlen(target) : 0;
+	}
+	return record;
+}
+
+void KpmSetOverwrite(bool overwrite)
+{
+	_kpm_overwrite = overwrite;
+}
+
+bool KpmIsOverwrite()
+{
+	return _kpm_overwrite;
+}
+
+void KpmSetStore(bool store)
+{
+	_kpm_store = store;
+}
+
+void KpmSetDedup(bool dedup)
+{
+	_kpm_dedup = dedup;
+}
+
+// The installed file has the new content already, only its mode and mtime are brought up to date.
+// Files changed on disk since they were installed are written again.
+static bool KpmUpgradeKeep(const std::string& path, const KpmManifestEntry& installed, struct archive_entry* entry)
+{
+	std::error_code ec;
+	const std::filesystem::directory_entry current(path, ec);
+	if(ec || current.is_symlink(ec) || !current.is_regular_file(ec) || current.file_size(ec) != installed.size)
+	{
+		return false;
+	}
+
+	auto mtime = std::chrono::file_clock::to_sys(current.last_write_time(ec));
+	if(ec || std::chrono::system_clock::to_time_t(mtime) != installed.mtime)
+	{
+		return false;
+	}
+
+	if(archive_entry_perm(entry) != installed.mode)
+	{
+		std::filesystem::permissions(path, static_cast<std::filesystem::perms>(archive_entry_perm(entry)), ec);
+	}
+
+	if(!ec && archive_entry_mtime(entry) != installed.mtime)
+	{
+		auto updated = std::chrono::system_clock::from_time_t(archive_entry_mtime(entry))
+			+ std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(archive_entry_mtime_nsec(entry)));
+		std::filesystem::last_write_time(path, std::chrono::file_clock::from_sys(updated), ec);
+	}
+	return !ec;
+}
+
+// libarchive read callback over a KpmDecoder
+static la_ssize_t KpmArchiveRead(struct archive* archive, void* userdata, const void** buffer)
+{
+	auto* decoder = reinterpret_cast<KpmDecoder*>(userdata);
+	const std::uint8_t* data = nullptr;
+	std::int64_t count = decoder->read(&data);
+	if(count < 0)
+	{
+		archive_set_error(archive, EIO, "%s", decoder->error().c_str());
+		return -1;
+	}
+	*buffer = data;
+	return count;
 }
 
-static bool KpmExtractPackageData(const std::vector<std::uint8_t>& payload, const YAML::Node& config)
+static bool KpmExtractPackageData(KpmDecoder& decoder, KpmInstallContext& ctx)
 {
 	int r;
 	auto archive_check_ok = [&r](struct archive* archive) -> bool {
@@ -459,18 +1012,29 @@ static bool KpmExtractPackageData(const std::vector<std::uint8_t>& payload, cons
 		return true;
 	};
 
-	auto copy_data = [](struct archive* ar, struct archive* aw)
+	// Also hashes the content (length bytes, holes of sparse files as zeros)
+	auto copy_data = [](struct archive* ar, struct archive* aw, KpmSha256& sha, int64_t length)
 	{
 		int r;
 		const void* buff;
 		size_t size;
 		int64_t offset;
+		int64_t hashed = 0;
+		static const std::uint8_t zeros[4096] = {};
+
+		auto hash_zeros = [&sha, &hashed](int64_t end) {
+			for(; hashed < end; hashed += std::min<int64_t>(end - hashed, sizeof(zeros)))
+			{
+				sha.update(zeros, std::min<int64_t>(end - hashed, sizeof(zeros)));
+			}
+		};
 
 		while(true)
 		{
 			r = archive_read_data_block(ar, &buff, &size, &offset);
 			if (r == ARCHIVE_EOF)
 			{
+				hash_zeros(length);
 				return true;
 			}
 			if(r < ARCHIVE_OK && r > ARCHIVE_WARN)
@@ -484,6 +1048,10 @@ static bool KpmExtractPackageData(const std::vector<std::uint8_t>& payload, cons
 				KpmLogError(error);
 				return false;
 			}
+			hash_zeros(offset);
+			sha.update(buff, size);
+			hashed = offset + size;
+
 			r = archive_write_data_block(aw, buff, size, offset);
 			if(r < ARCHIVE_OK && r > ARCHIVE_WARN)
 			{
@@ -499,25 +1067,65 @@ static bool KpmExtractPackageData(const std::vector<std::uint8_t>& payload, cons
 		}
 	};
 
-	auto archive_prepend_path = [](struct archive_entry* entry, const std::string& path) -> std::string {
-		if(!path.ends_with('/') && !path.ends_with('\\'))
-		{
+	auto read_data = [](struct archive* ar, std::vector<std::uint8_t>& data)
+	{
+		const void* buff;
+		size_t size;
+		int64_t offset;
+
+		while(true)
+		{
+			int r = archive_read_data_block(ar, &buff, &size, &offset);
+			if(r == ARCHIVE_EOF)
+			{
+				return true;
+			}
+			if(r < ARCHIVE_OK && r > ARCHIVE_WARN)
+			{
+				KpmLogWarning(archive_error_string(ar));
+			}
+			else if(r < ARCHIVE_WARN)
+			{
+				KpmLogError(archive_error_string(ar));
+				return false;
+			}
+
+			// Holes of sparse files just stay zero
+			if(offset + size > data.size())
+			{
+				data.resize(offset + size);
+			}
+			std::copy_n(static_cast<const std::uint8_t*>(buff), size, data.begin() + offset);
+		}
+	};
+
+	auto archive_prepend_path = [](struct archive_entry* entry, const std::string& path) -> std::string {
+		if(!path.ends_with('/') && !path.ends_with('\\'))
+		{
 			KpmLogError("Parent path for extraction must end with separator.");
 			return "";
 		}
 		const char* entry_path = archive_entry_pathname(entry);
 		std::string new_path = (path + entry_path);
 		archive_entry_set_pathname(entry, new_path.c_str());
+
+		// Hardlink targets are archive paths as well
+		if(const char* hardlink = archive_entry_hardlink(entry))
+		{
+			archive_entry_set_hardlink(entry, (path + hardlink).c_str());
+		}
 		return new_path;
 	};
 
+	// xz and zstd are decoded (multithreaded) before libarchive, gzip by libarchive itself
 	struct archive* archive = archive_read_new();
 	archive_read_support_filter_gzip(archive);
 	archive_read_support_format_tar(archive);
-	r = archive_read_open_memory(archive, payload.data(), payload.size());
+	r = archive_read_open(archive, &decoder, nullptr, KpmArchiveRead, nullptr);
 
 	if(!archive_check_ok(archive))
 	{
+		archive_read_free(archive);
 		return false;
 	}
 
@@ -538,6 +1146,13 @@ static bool KpmExtractPackageData(const std::vector<std::uint8_t>& payload, cons
 		return false;
 	}
 
+	const std::string name = ctx.config["metadata"]["name"].as<std::string>();
+
+	std::size_t kept = 0;
+
+	// Regular files are written by the pool, everything else right here in archive order
+	KpmExtractWriterPool writers(std::clamp(std::thread::hardware_concurrency(), KPM_EXTRACT_THREADS_MIN, KPM_EXTRACT_THREADS_MAX), KPM_EXTRACT_BUFFER_SIZE, flags, ctx.dedup);
+
 	while(true)
 	{
 		r = archive_read_next_header(archive, &entry);
@@ -553,15 +1168,105 @@ static bool KpmExtractPackageData(const std::vector<std::uint8_t>& payload, cons
 			break;
 		}
 
-		std::string parent = KpmGetInstallPath(config);
+		std::string parent = KpmGetInstallPath(ctx);
 		std::string filepath = archive_prepend_path(entry, parent);
 
+		// Checked before anything is written over the path
+		const bool directory = archive_entry_filetype(entry) == AE_IFDIR;
+		if((!directory && ctx.owners.has_value() && !ctx.owners->claim(filepath, name))
+			|| !ctx.journal->create(filepath, directory ? KpmJournal::Type::DIRECTORY : KpmJournal::Type::FILE))
+		{
+			archive_read_close(archive);
+			archive_read_free(archive);
+			archive_write_close(ext);
+			archive_write_free(ext);
+			return false;
+		}
+
 		// We don't write directories to the manifest file
 		// if(!S_ISDIR(archive_entry_filetype(entry)))
 		// {
-		KpmInstallManifestAddPath(filepath);
+		KpmManifestEntry& record = KpmInstallManifestAddEntry(ctx, filepath, entry);
 		// }
 
+		const bool regular = archive_entry_filetype(entry) == AE_IFREG && archive_entry_hardlink(entry) == nullptr;
+
+		// Upgrades hash files of the same size as they come out of the archive, unchanged ones are not written
+		std::optional<KpmManifestEntry> installed;
+		if(regular && ctx.installed.has_value() && record.size <= KPM_UPGRADE_COMPARE_SIZE)
+		{
+			installed = ctx.installed->find(filepath);
+		}
+
+		if(installed.has_value() && installed->type == KpmManifestType::FILE && installed->hashed && installed->size == record.size)
+		{
+			std::vector<std::uint8_t> data;
+			data.reserve(record.size);
+			if(!read_data(archive, data))
+			{
+				archive_read_close(archive);
+				archive_read_free(archive);
+				archive_write_close(ext);
+				archive_write_free(ext);
+				return false;
+			}
+			data.resize(record.size);
+
+			KpmSha256 sha;
+			sha.update(data.data(), data.size());
+			record.hash = sha.digest();
+			record.hashed = true;
+
+			// A file linked to an object shares its inode, its mode and mtime can't change in place
+			const bool same = !ctx.dedup || (record.mode == installed->mode && record.mtime == installed->mtime);
+			if(record.hash == installed->hash && same && writers.wait(filepath) && KpmUpgradeKeep(filepath, installed.value(), entry))
+			{
+				const std::string object = KpmObjectName(record.hash, record.mode, record.mtime);
+				if(ctx.dedup && KpmIsPlainEntry(entry) && KpmObjectExists(object))
+				{
+					ctx.objects.push_back(object);
+				}
+				kept++;
+				continue;
+			}
+
+			if(!writers.submit(archive_entry_clone(entry), std::move(data), record))
+			{
+				archive_read_close(archive);
+				archive_read_free(archive);
+				archive_write_close(ext);
+				archive_write_free(ext);
+				return false;
+			}
+			continue;
+		}
+
+		if(regular && archive_entry_size(entry) <= static_cast<la_int64_t>(KPM_EXTRACT_POOL_FILE_SIZE))
+		{
+			std::vector<std::uint8_t> data;
+			data.reserve(archive_entry_size(entry));
+			if(!read_data(archive, data) || !writers.submit(archive_entry_clone(entry), std::move(data), record))
+			{
+				archive_read_close(archive);
+				archive_read_free(archive);
+				archive_write_close(ext);
+				archive_write_free(ext);
+				return false;
+			}
+			continue;
+		}
+
+		// Links may point at files still in the pool, let those land first
+		const bool ordered = regular || directory;
+		if(!(ordered ? writers.wait(filepath) : writers.wait()))
+		{
+			archive_read_close(archive);
+			archive_read_free(archive);
+			archive_write_close(ext);
+			archive_write_free(ext);
+			return false;
+		}
+
 		r = archive_write_header(ext, entry);
 		if(!archive_check_ok(ext))
 		{
@@ -572,7 +1277,8 @@ static bool KpmExtractPackageData(const std::vector<std::uint8_t>& payload, cons
 			return false;
 		}
 
-		if(!copy_data(archive, ext))
+		KpmSha256 sha;
+		if(!copy_data(archive, ext, sha, archive_entry_size(entry)))
 		{
 			archive_read_close(archive);
 			archive_read_free(archive);
@@ -589,6 +1295,32 @@ static bool KpmExtractPackageData(const std::vector<std::uint8_t>& payload, cons
 			archive_write_free(ext);
 			return false;
 		}
+
+		if(regular)
+		{
+			record.hash = sha.digest();
+			record.hashed = true;
+
+			// Written in full first, the hash is only known at the end
+			const std::string object = KpmObjectName(record.hash, record.mode, record.mtime);
+			if(ctx.dedup && KpmIsPlainEntry(entry) && (KpmObjectLink(object, filepath) || KpmObjectAdopt(filepath, object)))
+			{
+				ctx.objects.push_back(object);
+			}
+		}
+	}
+
+	// Directory permissions and times are fixed up on close, after all the files are in
+	bool written = writers.wait();
+	if(ctx.dedup)
+	{
+		std::vector<std::string> objects = writers.objects();
+		ctx.objects.insert(ctx.objects.end(), objects.begin(), objects.end());
+	}
+
+	if(ctx.installed.has_value())
+	{
+		KpmLogInfo("Kept {} unchanged files.", kept);
 	}
 
 	archive_read_close(archive);
@@ -596,358 +1328,1028 @@ static bool KpmExtractPackageData(const std::vector<std::uint8_t>& payload, cons
 	archive_write_close(ext);
 	archive_write_free(ext);
 
-	return true;
+	return written;
+}
+
+static bool KpmExtractPackageStream(KpmStreamBuffer& stream, KpmInstallContext& ctx)
+{
+	KpmDecoder decoder([&stream](std::uint8_t* data, std::size_t size) {
+		return stream.pull(data, size);
+	}, std::thread::hardware_concurrency());
+
+	return KpmExtractPackageData(decoder, ctx);
+}
+
+// Hashes the bytes of the mapped archive as the decoder gets through them
+struct KpmArchiveHashed
+{
+	KpmDecoder decoder;
+	const std::uint8_t* data;
+	std::size_t hashed = 0;
+	KpmSha256 sha;
+};
+
+static la_ssize_t KpmArchiveReadHashed(struct archive* archive, void* userdata, const void** buffer)
+{
+	auto* hashed = reinterpret_cast<KpmArchiveHashed*>(userdata);
+	la_ssize_t count = KpmArchiveRead(archive, &hashed->decoder, buffer);
+	const std::size_t consumed = hashed->decoder.consumed();
+	hashed->sha.update(hashed->data + hashed->hashed, consumed - hashed->hashed);
+	hashed->hashed = consumed;
+	return count;
 }
 
-static bool KpmDeployPrebuild(const std::string& package, const YAML::Node& config)
+// Whether every path the archive in data would write is free to take, before anything is written.
+// Only the headers are looked at, the content is still decoded to get past it.
+// sha gets the SHA-256 (hex) of data, also when the archive turns out to be broken.
+static bool KpmCheckPackage(const std::uint8_t* data, std::size_t size, KpmInstallContext& ctx, std::string& sha)
 {
-	auto payload = KpmDownloadUrlFile(package);
+	KpmArchiveHashed hashed { KpmDecoder(data, size, std::thread::hardware_concurrency()), data };
+	struct archive* archive = archive_read_new();
+	archive_read_support_filter_gzip(archive);
+	archive_read_support_format_tar(archive);
+
+	const std::string name = ctx.config["metadata"]["name"].as<std::string>();
+	const std::string parent = KpmGetInstallPath(ctx);
+	bool ok = archive_read_open(archive, &hashed, nullptr, KpmArchiveReadHashed, nullptr) == ARCHIVE_OK;
 
-	if(!payload.has_value() || payload.value().empty())
+	struct archive_entry* entry;
+	int r = ARCHIVE_OK;
+	while(ok && (r = archive_read_next_header(archive, &entry)) >= ARCHIVE_WARN && r != ARCHIVE_EOF)
 	{
-		return false;
+		// A damaged header may come without a path
+		const char* pathname = archive_entry_pathname(entry);
+		ok = pathname && (archive_entry_filetype(entry) == AE_IFDIR || !ctx.owners.has_value() || ctx.owners->claim(parent + pathname, name));
 	}
 
-	if(!KpmExtractPackageData(payload.value(), config))
+	if(r < ARCHIVE_WARN)
 	{
-		KpmLogError("Failed to extract payload data.");
-		return false;
+		KpmLogError(archive_error_string(archive));
+		ok = false;
 	}
 
-	return true;
+	archive_read_close(archive);
+	archive_read_free(archive);
+
+	// Padding after the end of the archive, or what was not read before it failed
+	hashed.sha.update(data + hashed.hashed, size - hashed.hashed);
+	sha = hashed.sha.hexdigest();
+	return ok;
 }
 
-static bool KpmWriteManifest(const YAML::Node& config)
+enum class KpmExtract
 {
-	std::string package_manifest_file = KpmGetCachePath() + config["metadata"]["name"].as<std::string>() + ".manifest";
-	std::ofstream file(package_manifest_file);
-
-	KpmLogTrace("Writing manifest file: {}", package_manifest_file);
+	OK,
+	FAILED,
+	CORRUPT // The file does not hash to the blob it was expected to be
+};
 
+// Local packages and cached downloads are mapped and read in place, without copies.
+// Their paths are checked for conflicts before extraction starts, streamed downloads are checked entry by entry.
+// Cache blobs (blob set) are checked against their name in the same pass, nothing is written if they changed.
+static KpmExtract KpmExtractPackageFile(const std::string& path, KpmInstallContext& ctx, const std::string& blob = "")
+{
+	KpmMappedFile file(path);
 	if(!file.is_open())
 	{
-		KpmLogError("Failed to write manifest file.");
-		return false;
+		KpmLogError("Failed to open package file {}.", path);
+		return KpmExtract::FAILED;
 	}
 
-	file << _manifest_stream.str();
-	_manifest_stream.clear();
+	if(ctx.owners.has_value() || !blob.empty())
+	{
+		std::string sha;
+		const bool ok = KpmCheckPackage(file.data(), file.size(), ctx, sha);
+		if(!blob.empty() && sha != blob)
+		{
+			KpmLogWarning("Cached file {} is corrupt.", path);
+			return KpmExtract::CORRUPT;
+		}
 
-	return true;
+		if(!ok)
+		{
+			return KpmExtract::FAILED;
+		}
+
+		// Nothing to check while extracting anymore, other kpm processes may update the database meanwhile
+		ctx.owners.reset();
+	}
+
+	KpmDecoder decoder(file.data(), file.size(), std::thread::hardware_concurrency());
+	return KpmExtractPackageData(decoder, ctx) ? KpmExtract::OK : KpmExtract::FAILED;
 }
 
-static std::optional<YAML::Node> KpmReadConfigFile(const std::string& file)
+// Downloads the package into the kpm cache so that deploying it later needs no network
+static bool KpmPrefetchPrebuild(const std::string& package)
 {
-	try
-	{
-		return YAML::Load(file);
-	}
-	catch (const YAML::ParserException& e)
-	{
-		KpmLogError("YAML parsing error: {}", e.what());
-		return std::nullopt;
-    }
-	catch (const YAML::Exception& e)
-	{
-		KpmLogError("YAML error: {}", e.what());
-		return std::nullopt;
-    }
+	KpmLogTrace("Prefetching file from url: {}", package);
+	KpmHttpResponse response = KpmFetchUrl(package, [](const std::uint8_t*, std::size_t) { return KpmHttpWrite::OK; }, true, false);
+	return response.ok;
 }
 
-static std::optional<std::string> KpmGithubFetchEndpoint(const std::string& repo, const YAML::Node& config)
+// Rebuilds the archive a patch produces from the cached one it applies to, verified by its hash.
+// The result is kept as a cache blob, a second call finds it there.
+static std::optional<std::string> KpmPatchPrebuild(const KpmPatchAsset& patch)
 {
-	auto info = KpmGet<nlohmann::json>("https://api.github.com/repos/" + repo + "/releases");
-	if(!info.has_value())
+	const std::string target = KpmCacheBlobPath(patch.sha256);
+	std::error_code ec;
+	if(std::filesystem::exists(target, ec))
 	{
-		return std::nullopt;
+		return target;
 	}
 
-	auto json = info.value();
-
-	if(json.is_object() && json.contains("message") && json["message"] == "Not Found")
+	std::optional<KpmCacheEntry> diff = KpmPrefetchPrebuild(patch.url) ? KpmCacheLookup(patch.url) : std::nullopt;
+	if(!diff.has_value())
 	{
-		KpmLogError("Failed to find the github repo: {}", repo);
+		KpmLogWarning("Failed to download patch {}.", patch.url);
 		return std::nullopt;
 	}
 
-	if(json.is_array() && json.empty())
+	KpmMappedFile base(KpmCacheBlobPath(patch.from));
+	KpmMappedFile data(KpmCacheBlobPath(diff->blob));
+	if(!base.is_open() || !data.is_open())
 	{
-		KpmLogError("Found repo {}, but no release is available.", repo);
+		KpmLogWarning("Failed to open the files of patch {}.", patch.url);
 		return std::nullopt;
 	}
 
-	std::int32_t index = 0; // latest release by default
-	std::string tag = config["dist"]["tag"].as<std::string>();
+	KpmLogTrace("Patching {} into {}.", patch.from, patch.sha256);
+	const std::string temp = target + ".patch";
+
+	// The base is checked against its name while patching, a changed one would only show as a wrong result
+	std::future<std::string> base_sha = std::async(std::launch::async, [&base]() {
+		return KpmSha256Hex(std::string_view(reinterpret_cast<const char*>(base.data()), base.size()));
+	});
+	std::optional<std::string> sha = KpmZstdPatch(base.data(), base.size(), data.data(), data.size(), temp);
+	if(base_sha.get() != patch.from)
+	{
+		// Cache entries of the base see it missing and go away on their own
+		KpmLogWarning("Cached file {} is corrupt. Evicting it.", patch.from);
+		base = KpmMappedFile();
+		std::filesystem::remove(KpmCacheBlobPath(patch.from), ec);
+		std::filesystem::remove(temp, ec);
+		return std::nullopt;
+	}
 
-	if(tag != "latest")
+	if(sha != patch.sha256)
 	{
-		std::int32_t candidate = KpmJsonFindInArray(json, "tag_name", tag);
-
-		if(candidate < 0)
+		if(sha.has_value())
 		{
-			KpmLogError("Could not find candidate tag {}.", tag);
-			KpmLogWarning("Defaulting to latest tag available ('latest').");
+			KpmLogWarning("Patch {} produced {} instead of {}.", patch.url, sha.value(), patch.sha256);
 		}
-
-		index = candidate > 0 ? candidate : 0;
+		std::filesystem::remove(temp, ec);
+		return std::nullopt;
 	}
 
-	std::string endpoint = json[index]["assets"][0]["browser_download_url"];
-	return endpoint.substr(0, endpoint.rfind('/'));
-}
-
-static void KpmPopulateManifestUserFile(const std::vector<std::string>& files)
-{
-	for(const auto& file : files)
+	std::filesystem::rename(temp, target, ec);
+	if(ec)
 	{
-		// Check if file is in fact there
-		const auto filepath = std::filesystem::path(file);
-		if(!std::filesystem::exists(filepath))
-		{
-			KpmLogWarning("Additional file <{}> not found. Ignoring...", filepath.string());
-			continue;
-		}
-
-		KpmInstallManifestAddPath(filepath.string());
+		KpmLogWarning("Failed to store patched file {}: {}", target, ec.message());
+		std::filesystem::remove(temp, ec);
+		return std::nullopt;
 	}
+	return target;
 }
 
-static std::string KpmRunCommand(const std::string& type, const std::vector<std::string>& commands, const YAML::Node& config)
+static bool KpmDeployPrebuild(const std::string& package, KpmInstallContext& ctx)
 {
-	auto fetch_and_copy_files_recursive = [&config](const std::string& dir, const std::string& other, bool delete_original = false) -> std::vector<std::string> {
-		std::vector<std::string> output;
-
-		std::string it_dir = dir;
-		if(std::filesystem::path(dir).is_relative())
-		{
-			it_dir = KpmGetInstallPath(config) + dir;
-		}
-		else
-		{
-			KpmLogError("copy or move operations can only have install relative source files.");
-			return {};
-		}
-
-		std::string it_other = other;
-		if(std::filesystem::path(other).is_relative())
-		{
-			it_other = KpmGetInstallPath(config) + other;
-		}
-
-		if(std::filesystem::is_regular_file(std::filesystem::absolute(it_dir)))
+	if(ctx.patch.has_value())
+	{
+		// Nothing is extracted yet when patching fails, the full archive still can be
+		std::optional<std::string> patched = KpmPatchPrebuild(ctx.patch.value());
+		if(patched.has_value())
 		{
-			if(std::filesystem::is_regular_file(it_other))
-			{
-				std::filesystem::copy_file(std::filesystem::absolute(it_dir), std::filesystem::absolute(it_other), std::filesystem::copy_options::overwrite_existing);
-			}
-			else
+			KpmLogInfo("Installing from a patch against the installed version.");
+			KpmExtract extracted = KpmExtractPackageFile(patched.value(), ctx, ctx.patch->sha256);
+			if(extracted == KpmExtract::FAILED)
 			{
-				std::filesystem::copy_file(std::filesystem::absolute(it_dir), std::filesystem::absolute(it_other) / std::filesystem::path(it_dir).filename(), std::filesystem::copy_options::overwrite_existing);
+				KpmLogError("Failed to extract payload data.");
+				return false;
 			}
 
-			if(delete_original)
+			if(extracted == KpmExtract::OK)
 			{
-				std::filesystem::remove(std::filesystem::absolute(it_dir));
+				ctx.dist_blob = ctx.patch->sha256;
+				return true;
 			}
-		}
-
-		std::filesystem::copy(it_dir, it_other, std::filesystem::copy_options::recursive | std::filesystem::copy_options::overwrite_existing);
 
-		for(const auto& file : std::filesystem::recursive_directory_iterator(std::filesystem::absolute(it_dir)))
-		{
-			output.push_back((std::filesystem::absolute(it_other) / std::filesystem::path(file).filename()).string());
+			std::error_code ec;
+			std::filesystem::remove(patched.value(), ec);
 		}
+		KpmLogWarning("Failed to apply patch, downloading the full package.");
+	}
 
-		if(delete_original)
+	if(ctx.dist_local)
+	{
+		KpmLogTrace("Extracting local file: {}", package);
+		if(KpmExtractPackageFile(package, ctx) != KpmExtract::OK)
 		{
-			std::filesystem::remove_all(it_dir);
+			KpmLogError("Failed to extract payload data.");
+			return false;
 		}
+		return true;
+	}
 
-		output.push_back(std::filesystem::absolute(it_other).string());
+	// A cached copy that changed on disk is evicted and downloaded once more
+	for(int attempt = 0; ; attempt++)
+	{
+		// Extraction consumes the archive while it is still downloading
+		KpmStreamBuffer stream(KPM_STREAM_BUFFER_SIZE);
+		stream.on_drain([]() { KpmHttpClient::Get().resume(); });
 
-		return output;
-	};
+		bool extracted = false;
+		std::thread extractor;
 
-	if(type == "copy")
-	{
-		if(commands.size() < 2) return "";
+		KpmLogTrace("Streaming file from url: {}", package);
+		KpmHttpResponse response = KpmFetchUrl(package, [&stream, &extracted, &extractor, &ctx](const std::uint8_t* data, std::size_t size) {
+			if(!extractor.joinable())
+			{
+				extractor = std::thread([&stream, &extracted, &ctx]() {
+					extracted = KpmExtractPackageStream(stream, ctx);
+					stream.release(extracted);
+				});
+			}
+			return stream.push(data, size);
+		}, true, false);
 
-		auto files = fetch_and_copy_files_recursive(commands[0], commands[1], false);
-		KpmPopulateManifestUserFile(files);
-	}
-	else if(type == "mkdir")
-	{
-		if(commands.size() < 1) return "";
+		stream.finish(response.ok);
 
-		auto path = std::filesystem::path(commands[0]);
-		if(path.is_relative())
+		if(extractor.joinable())
 		{
-			path = std::filesystem::absolute(std::filesystem::path(KpmGetInstallPath(config)) / path);
+			extractor.join();
 		}
-
-		std::filesystem::create_directories(path);
-		KpmPopulateManifestUserFile({ path.string() });
-	}
-	else if(type == "rmdir")
-	{
-		if(commands.size() < 1) return "";
-
-		auto path = std::filesystem::path(commands[0]);
-		if(path.is_relative())
+		else if(response.ok && !response.blob_path.empty())
 		{
-			path = std::filesystem::absolute(std::filesystem::path(KpmGetInstallPath(config)) / path);
-			if(std::filesystem::is_directory(path))
-			{
-				std::filesystem::remove_all(path);
-			}
-			else
+			// Already in the kpm cache, read it from there
+			const std::string blob = std::filesystem::path(response.blob_path).filename().string();
+			KpmExtract result = KpmExtractPackageFile(response.blob_path, ctx, blob);
+			if(result == KpmExtract::CORRUPT && attempt == 0)
 			{
-				KpmLogError("rmdir can only remove directories.");
+				KpmLogWarning("Evicting the cached copy of {} and downloading it again.", package);
+				KpmCacheEvict(package);
+				continue;
 			}
+			extracted = result == KpmExtract::OK;
 		}
-		else
-		{
-			KpmLogError("rmdir can only remove installation relative directories.");
-		}
-	}
-	else if(type == "rmfile")
-	{
-		if(commands.size() < 1) return "";
 
-		auto path = std::filesystem::path(commands[0]);
-		if(path.is_relative())
+		if(!response.ok)
 		{
-			path = std::filesystem::absolute(std::filesystem::path(KpmGetInstallPath(config)) / path);
-			if(std::filesystem::is_regular_file(path))
-			{
-				std::filesystem::remove(path);
-			}
-			else
-			{
-				KpmLogError("rmfile can only remove files.");
-			}
+			KpmLogError("Failed to download package data.");
+			return false;
 		}
-		else
+
+		if(!extracted)
 		{
-			KpmLogError("rmfile can only remove installation relative files.");
+			KpmLogError("Failed to extract payload data.");
+			return false;
 		}
+		break;
 	}
-	else if(type == "move")
-	{
-		if(commands.size() < 2) return "";
 
-		auto files = fetch_and_copy_files_recursive(commands[0], commands[1], true);
-		KpmPopulateManifestUserFile(files);
-	}
-	else if(type == "exec")
-	{
-#ifdef __linux__
-		std::string command_full = "bash -c '";
-#else
-		std::string command_full = "cmd.exe /C ";
-#endif
+	std::optional<KpmCacheEntry> entry = KpmCacheLookup(package);
+	ctx.dist_blob = entry.has_value() ? entry->blob : "";
+	return true;
+}
 
-		for(const auto& cmd : commands)
-		{
-			command_full += (" " + cmd);
-		}
+static bool KpmWriteManifest(KpmInstallContext& ctx)
+{
+	std::string package_manifest_file = KpmGetCachePath() + ctx.config["metadata"]["name"].as<std::string>() + ".manifest";
 
-#ifdef __linux__
-		command_full += "'";
-#endif
+	KpmLogTrace("Writing manifest file: {}", package_manifest_file);
 
-		std::unique_ptr<FILE, decltype(&pclose)> pipe(popen(command_full.c_str(), "r"), pclose);
+	if(!ctx.manifest.write(package_manifest_file))
+	{
+		KpmLogError("Failed to write manifest file.");
+		return false;
+	}
 
-		if(!pipe)
-		{
-			KpmLogError("Failed to create pipe for command: {}", command_full);
-			return {};
-		}
+	// From here on a crash completes the install instead of rolling it back
+	if(!ctx.journal->commit())
+	{
+		return false;
+	}
 
-		std::string output;
-		char buffer[1024];
-		while(fgets(buffer, 128, pipe.get()))
+	// Directories are shared between packages, only the rest is owned
+	std::vector<std::string> owned;
+	for(const auto& entry : ctx.manifest.entries())
+	{
+		if(entry.type != KpmManifestType::DIRECTORY)
 		{
-			output += buffer;
+			owned.push_back(entry.path);
 		}
-		output.pop_back(); // Remove trailing '\n'
+	}
 
-		return output;
+	ctx.owners.reset();
+	if(!KpmOwners::Update(KpmGetOwnersPath(), ctx.config["metadata"]["name"].as<std::string>(), owned))
+	{
+		KpmLogError("Failed to update the ownership database.");
+		return false;
 	}
 
-	return {};
+	return true;
 }
 
-class KpmPICommand
+static std::optional<YAML::Node> KpmReadConfigFile(const std::string& file)
 {
-public:
-	KpmPICommand(const std::string& type, const std::vector<std::string>& commands, const std::string& output)
-		: _type(type), _commands(commands), _output_var(output)
+	try
+	{
+		return YAML::Load(file);
+	}
+	catch (const YAML::ParserException& e)
+	{
+		KpmLogError("YAML parsing error: {}", e.what());
+		return std::nullopt;
+    }
+	catch (const YAML::Exception& e)
+	{
+		KpmLogError("YAML error: {}", e.what());
+		return std::nullopt;
+    }
+}
+
+static std::optional<nlohmann::json> KpmGithubFetchRelease(const std::string& repo, const std::string& release)
+{
+	// Cached and revalidated with If-None-Match by KpmFetchUrl, 304s are free on the github rate limit
+	auto json = KpmGet<nlohmann::json>("https://api.github.com/repos/" + repo + "/releases/" + release);
+	if(!json.has_value() || !json->is_object() || json->contains("message"))
+	{
+		return std::nullopt;
+	}
+	return json;
+}
+
+static std::optional<std::string> KpmGithubFetchEndpoint(const std::string& repo, const YAML::Node& config)
+{
+	std::optional<nlohmann::json> release;
+	std::string tag = config["dist"]["tag"].as<std::string>();
+
+	if(tag != "latest")
 	{
+		char* escaped = curl_easy_escape(nullptr, tag.c_str(), static_cast<int>(tag.size()));
+		release = KpmGithubFetchRelease(repo, "tags/" + std::string(escaped ? escaped : tag.c_str()));
+		curl_free(escaped);
+
+		if(!release.has_value())
+		{
+			KpmLogError("Could not find candidate tag {}.", tag);
+			KpmLogWarning("Defaulting to latest tag available ('latest').");
+		}
+	}
+
+	if(!release.has_value())
+	{
+		release = KpmGithubFetchRelease(repo, "latest");
 	}
 
-	inline bool run(std::unordered_map<std::string, std::string>& variables, const YAML::Node& config)
+	if(!release.has_value())
+	{
+		KpmLogError("Failed to find a release for the github repo: {}", repo);
+		return std::nullopt;
+	}
+
+	const nlohmann::json& assets = release.value()["assets"];
+	if(!assets.is_array() || assets.empty())
+	{
+		KpmLogError("Release {} of {} has no assets.", release->value("tag_name", tag), repo);
+		return std::nullopt;
+	}
+
+	std::string endpoint = assets[0]["browser_download_url"];
+	return endpoint.substr(0, endpoint.rfind('/'));
+}
+
+static void KpmPopulateManifestUserFile(std::vector<KpmManifestEntry>& entries, const std::vector<std::string>& files)
+{
+	for(const auto& file : files)
 	{
-		bool error = false;
-		std::for_each(_commands.begin(), _commands.end(), [&variables, this, &error](std::string& cmd){
-			std::for_each(variables.cbegin(), variables.cend(), [&cmd, &variables, this, &error](const auto& var) { 
-				size_t pos = cmd.find(var.first);
-				if(pos != std::string::npos && pos != 0 && cmd[pos - 1] == '!')
+		// Check if file is in fact there
+		const auto filepath = std::filesystem::path(file);
+		std::error_code ec;
+		if(!std::filesystem::exists(filepath, ec))
+		{
+			KpmLogWarning("Additional file <{}> not found. Ignoring...", filepath.string());
+			continue;
+		}
+
+		KpmLogTrace("Adding file to manifest: {}", filepath.string());
+		entries.push_back(KpmManifestStatPath(filepath.string(), true));
+	}
+}
+
+// Copies the content and mode of source to destination without passing the data through user space where possible:
+// a reflink (FICLONE) where the filesystem shares extents, copy_file_range otherwise (Linux).
+// Destination is replaced with a rename, never written into, it may be a hard link of a shared object.
+static bool KpmCopyFile(const std::filesystem::path& source, const std::filesystem::path& destination)
+{
+	std::error_code ec;
+#ifdef __linux__
+	int in = ::open(source.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if(in < 0 || fstat(in, &st) != 0)
+	{
+		if(in >= 0)
+		{
+			::close(in);
+		}
+		return false;
+	}
+
+	const std::string temp = destination.string() + ".kpm-copy";
+	::unlink(temp.c_str());
+	int out = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+	bool ok = out >= 0;
+	bool fallback = false;
+	if(ok && ioctl(out, FICLONE, in) != 0)
+	{
+		for(off_t remaining = st.st_size; ok && remaining > 0;)
+		{
+			const ssize_t copied = copy_file_range(in, nullptr, out, nullptr, static_cast<std::size_t>(remaining), 0);
+			if(copied < 0)
+			{
+				// Older kernels and some filesystems, plain read/write below
+				fallback = errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL;
+				ok = false;
+			}
+			else if(copied == 0)
+			{
+				break;
+			}
+			remaining -= copied;
+		}
+	}
+
+	// The umask applied on open
+	ok = ok && fchmod(out, st.st_mode & 07777) == 0;
+	if(out >= 0)
+	{
+		::close(out);
+	}
+	::close(in);
+
+	if(fallback)
+	{
+		ok = std::filesystem::copy_file(source, temp, std::filesystem::copy_options::overwrite_existing, ec);
+	}
+
+	if(ok)
+	{
+		std::filesystem::rename(temp, destination, ec);
+		ok = !ec;
+	}
+
+	if(!ok)
+	{
+		std::filesystem::remove(temp, ec);
+	}
+	return ok;
+#else
+	return std::filesystem::copy_file(source, destination, std::filesystem::copy_options::overwrite_existing, ec);
+#endif
+}
+
+// Copies (or moves) source to destination like std::filesystem::copy does: a file into a directory or over a file,
+// the contents of a directory into destination. Moves rename the whole tree when they can and each file otherwise,
+// only copying across filesystems. Copies of large trees run on several threads.
+// Every path is journaled right before it is created and gets its manifest entry in the same pass,
+// files keep the hash extraction recorded for their source.
+static bool KpmCopyTree(KpmInstallContext& ctx, const std::filesystem::path& source, const std::filesystem::path& destination, bool move, std::vector<KpmManifestEntry>& entries)
+{
+	struct Item
+	{
+		std::filesystem::path from;
+		std::filesystem::path to;
+		std::filesystem::file_type type;
+	};
+
+	std::error_code ec;
+	const std::filesystem::file_status status = std::filesystem::symlink_status(source, ec);
+	if(ec || !std::filesystem::exists(status))
+	{
+		KpmLogError("Failed to {} {}, it does not exist.", move ? "move" : "copy", source.string());
+		return false;
+	}
+
+	std::vector<Item> items;
+	if(std::filesystem::is_directory(status))
+	{
+		items.push_back({ source, destination, std::filesystem::file_type::directory });
+		for(auto it = std::filesystem::recursive_directory_iterator(source, ec); !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec))
+		{
+			items.push_back({ it->path(), destination / it->path().lexically_relative(source), it->symlink_status(ec).type() });
+		}
+	}
+	else
+	{
+		std::error_code missing;
+		const bool into = std::filesystem::is_directory(destination, missing);
+		items.push_back({ source, into ? destination / source.filename() : destination, status.type() });
+	}
+
+	if(ec)
+	{
+		KpmLogError("Failed to list {}: {}", source.string(), ec.message());
+		return false;
+	}
+
+	for(const auto& item : items)
+	{
+		const bool directory = item.type == std::filesystem::file_type::directory;
+		if(!ctx.journal->create(item.to.string(), directory ? KpmJournal::Type::DIRECTORY : KpmJournal::Type::FILE))
+		{
+			return false;
+		}
+	}
+
+	// Hashes extraction already computed, copies and moves have the same content
+	std::unordered_map<std::string, const KpmManifestEntry*> hashes;
+	for(const auto& entry : ctx.manifest.entries())
+	{
+		if(entry.hashed && entry.type == KpmManifestType::FILE)
+		{
+			hashes.emplace(std::filesystem::path(entry.path).lexically_normal().string(), &entry);
+		}
+	}
+
+	entries.resize(items.size());
+	auto record = [&items, &entries, &hashes](std::size_t i) {
+		const auto known = hashes.find(items[i].from.lexically_normal().string());
+		entries[i] = KpmManifestStatPath(items[i].to.string(), known == hashes.end());
+		if(known != hashes.end() && entries[i].type == KpmManifestType::FILE && entries[i].size == known->second->size)
+		{
+			entries[i].hash = known->second->hash;
+			entries[i].hashed = true;
+		}
+	};
+
+	// A single rename when nothing is in the way and both ends are on the same filesystem
+	std::filesystem::create_directories(items[0].to.parent_path(), ec);
+	if(move && !std::filesystem::exists(items[0].to, ec))
+	{
+		std::filesystem::rename(source, items[0].to, ec);
+		if(!ec)
+		{
+			for(std::size_t i = 0; i < items.size(); i++)
+			{
+				record(i);
+			}
+			return true;
+		}
+		KpmLogTrace("Moving {} file by file: {}", source.string(), ec.message());
+	}
+
+	// Directories in walk order, parents first
+	std::vector<std::size_t> files;
+	for(std::size_t i = 0; i < items.size(); i++)
+	{
+		if(items[i].type != std::filesystem::file_type::directory)
+		{
+			files.push_back(i);
+			continue;
+		}
+
+		std::filesystem::create_directories(items[i].to, ec);
+		if(ec)
+		{
+			KpmLogError("Failed to create directory {}: {}", items[i].to.string(), ec.message());
+			return false;
+		}
+		record(i);
+	}
+
+	std::atomic<std::size_t> next = 0;
+	std::atomic<bool> ok = true;
+	auto worker = [&items, &files, &next, &ok, &record, move]() {
+		for(std::size_t begin = next.fetch_add(KPM_COPY_BATCH); begin < files.size(); begin = next.fetch_add(KPM_COPY_BATCH))
+		{
+			for(std::size_t f = begin; f < std::min(begin + KPM_COPY_BATCH, files.size()); f++)
+			{
+				const Item& item = items[files[f]];
+				std::error_code ec;
+				if(move)
+				{
+					std::filesystem::rename(item.from, item.to, ec);
+				}
+
+				if(!move || ec)
 				{
-					auto vname = var.first;
-					auto end_pos = cmd.find(" ");
-					auto var = variables.find(vname);
-					if(var == variables.end())
+					ec.clear();
+					if(item.type == std::filesystem::file_type::symlink)
 					{
-						KpmLogError("Command {}:", _type);
-						KpmLogError("Variable '{}' not found.", vname);
-						error = true;
+						std::filesystem::remove(item.to, ec);
+						std::filesystem::copy_symlink(item.from, item.to, ec);
 					}
-					else
+					else if(!KpmCopyFile(item.from, item.to))
 					{
-						if(var->second.empty())
-						{
-							KpmLogWarning("Command {}:", _type);
-							KpmLogWarning("Variable '{}' found but is empty.", vname);
-						}
-
-						KpmLogTrace("Var   : {}.", vname);
-						KpmLogTrace("Value : {}.", var->second);
-
-						std::string cmd_pre = cmd;
-						cmd.erase(pos - 1, vname.size() + 1);
-						cmd.insert(pos - 1, var->second);
-						KpmLogTrace("CMD Trace:\ncmd:\n\t\"{}\"\ncmd replaced:\n\t\"{}\"", cmd_pre, cmd);
+						ec = std::make_error_code(std::errc::io_error);
 					}
 				}
-			});
-		});
 
-		if(error)
+				if(ec)
+				{
+					KpmLogError("Failed to {} {} to {}.", move ? "move" : "copy", item.from.string(), item.to.string());
+					ok = false;
+					continue;
+				}
+				record(files[f]);
+			}
+		}
+	};
+
+	const std::size_t batches = (files.size() + KPM_COPY_BATCH - 1) / KPM_COPY_BATCH;
+	const std::size_t threads = std::min<std::size_t>(std::clamp(std::thread::hardware_concurrency(), 1u, KPM_COPY_THREADS_MAX), batches);
+
+	std::vector<std::thread> workers;
+	for(std::size_t i = 1; i < threads; i++)
+	{
+		workers.emplace_back(worker);
+	}
+	worker();
+
+	for(auto& thread : workers)
+	{
+		thread.join();
+	}
+
+	// Whatever was left of the source are its directories (and files that failed to move)
+	if(move && ok)
+	{
+		std::filesystem::remove_all(source, ec);
+	}
+	return ok;
+}
+
+// Options of exec post install steps
+struct KpmPIOptions
+{
+	bool fresh = false; // Run in a process of its own instead of one of the install's shells
+	bool cache = false; // Reuse the output of an earlier install while the fingerprint of the command is the same
+};
+
+// Runs one post install step, the manifest entries of the paths it creates are added to entries.
+// The output of exec steps, nullopt if the step failed (the install is rolled back then).
+static std::optional<std::string> KpmRunCommand(const std::string& type, const std::vector<std::string>& commands, const KpmPIOptions& options, KpmInstallContext& ctx, std::vector<KpmManifestEntry>& entries)
+{
+	// False if anything wasn't copied, the paths that were are still added to entries
+	auto copy_tree = [&ctx, &entries](const std::string& source, const std::string& destination, bool move) {
+		if(!std::filesystem::path(source).is_relative())
+		{
+			KpmLogError("copy or move operations can only have install relative source files.");
+			return false;
+		}
+
+		std::filesystem::path to = destination;
+		if(to.is_relative())
+		{
+			to = KpmGetInstallPath(ctx) + destination;
+		}
+
+		// Without trailing separators, "pymx/" is the directory pymx
+		std::error_code ec;
+		auto normal = [&ec](const std::filesystem::path& path) {
+			const std::filesystem::path absolute = std::filesystem::absolute(path, ec).lexically_normal();
+			return absolute.has_filename() ? absolute : absolute.parent_path();
+		};
+
+		const std::filesystem::path from = normal(KpmGetInstallPath(ctx) + source);
+		to = normal(to);
+		if(ec)
+		{
+			KpmLogError("Failed to resolve {} or {}: {}", source, destination, ec.message());
+			return false;
+		}
+
+		std::vector<KpmManifestEntry> created;
+		const bool ok = KpmCopyTree(ctx, from, to, move, created);
+		for(auto& entry : created)
+		{
+			// Left empty for the paths that failed
+			if(!entry.path.empty())
+			{
+				KpmLogTrace("Adding file to manifest: {}", entry.path);
+				entries.push_back(std::move(entry));
+			}
+		}
+		return ok;
+	};
+
+	if(type == "copy" || type == "move")
+	{
+		if(commands.size() < 2)
+		{
+			KpmLogError("{} needs a source and a destination.", type);
+			return std::nullopt;
+		}
+
+		if(!copy_tree(commands[0], commands[1], type == "move"))
+		{
+			return std::nullopt;
+		}
+	}
+	else if(type == "mkdir")
+	{
+		if(commands.size() < 1)
+		{
+			KpmLogError("mkdir needs a directory.");
+			return std::nullopt;
+		}
+
+		std::error_code ec;
+		auto path = std::filesystem::path(commands[0]);
+		if(path.is_relative())
+		{
+			path = std::filesystem::absolute(std::filesystem::path(KpmGetInstallPath(ctx)) / path, ec);
+		}
+
+		if(ec || !ctx.journal->create(path.string(), KpmJournal::Type::DIRECTORY))
+		{
+			return std::nullopt;
+		}
+
+		std::filesystem::create_directories(path, ec);
+		if(ec)
+		{
+			KpmLogError("Failed to create directory {}: {}", path.string(), ec.message());
+			return std::nullopt;
+		}
+		KpmPopulateManifestUserFile(entries, { path.string() });
+	}
+	else if(type == "rmdir" || type == "rmfile")
+	{
+		const bool directory = type == "rmdir";
+		if(commands.size() < 1)
+		{
+			KpmLogError("{} needs a path.", type);
+			return std::nullopt;
+		}
+
+		auto path = std::filesystem::path(commands[0]);
+		if(!path.is_relative())
+		{
+			KpmLogError("{} can only remove installation relative {}.", type, directory ? "directories" : "files");
+			return std::nullopt;
+		}
+
+		std::error_code ec;
+		path = std::filesystem::absolute(std::filesystem::path(KpmGetInstallPath(ctx)) / path, ec);
+		if(!ec && (directory ? !std::filesystem::is_directory(path, ec) : !std::filesystem::is_regular_file(path, ec)))
+		{
+			KpmLogError("{} can only remove {}.", type, directory ? "directories" : "files");
+			return std::nullopt;
+		}
+
+		if(!ec)
+		{
+			if(directory)
+			{
+				std::filesystem::remove_all(path, ec);
+			}
+			else
+			{
+				std::filesystem::remove(path, ec);
+			}
+		}
+
+		if(ec)
+		{
+			KpmLogError("Failed to remove {}: {}", path.string(), ec.message());
+			return std::nullopt;
+		}
+	}
+	else if(type == "exec")
+	{
+		std::string command;
+		for(const auto& cmd : commands)
+		{
+			command += (" " + cmd);
+		}
+
+		std::string key;
+		if(options.cache)
+		{
+			key = command + '\0' + KpmShellFingerprint(command);
+			std::optional<std::string> output = KpmCacheProbeLookup(key);
+			if(output.has_value())
+			{
+				KpmLogTrace("Using the cached output of: {}", command);
+				return output.value();
+			}
+		}
+
+		std::optional<KpmShellResult> result = options.fresh || !ctx.shells ? KpmShellRunFresh(command) : ctx.shells->run(command);
+		if(!result.has_value())
 		{
+			KpmLogError("Failed to run command: {}", command);
+			return std::nullopt;
+		}
+
+		if(result->status != 0)
+		{
+			KpmLogWarning("Command exited with status {}: {}", result->status, command);
+		}
+
+		if(result->output.ends_with('\n'))
+		{
+			result->output.pop_back();
+		}
+
+		// Failures are tried again next time
+		if(options.cache && result->status == 0)
+		{
+			KpmCacheProbeUpdate(key, result->output);
+		}
+		return std::move(result->output);
+	}
+
+	return std::string();
+}
+
+// A post install argument split once into literal text and !VAR references.
+// A reference is the longest variable name following '!', anything else stays literal.
+class KpmPITemplate
+{
+public:
+	KpmPITemplate(const std::string& text, const std::unordered_map<std::string, std::string>& variables, const std::string& type)
+	{
+		auto name_char = [](char c) { return std::isalnum(static_cast<unsigned char>(c)) || c == '_'; };
+
+		std::string literal;
+		for(std::size_t i = 0; i < text.size();)
+		{
+			std::size_t end = i + 1;
+			while(text[i] == '!' && end < text.size() && name_char(text[end]))
+			{
+				end++;
+			}
+
+			// Names ending early (e.g. !PY_USITEx) still match the longest known prefix
+			std::size_t length = end - i - 1;
+			while(length > 0 && !variables.contains(text.substr(i + 1, length)))
+			{
+				length--;
+			}
+
+			if(length == 0)
+			{
+				if(end > i + 1)
+				{
+					KpmLogWarning("Command {}: unknown variable '{}' kept as is.", type, text.substr(i + 1, end - i - 1));
+				}
+				literal.append(text, i, end - i);
+				i = end;
+				continue;
+			}
+
+			if(!literal.empty())
+			{
+				_segments.push_back({ std::move(literal), false });
+				literal.clear();
+			}
+			_segments.push_back({ text.substr(i + 1, length), true });
+			i += length + 1;
+		}
+
+		if(!literal.empty())
+		{
+			_segments.push_back({ std::move(literal), false });
+		}
+	}
+
+	std::string render(const std::unordered_map<std::string, std::string>& variables, const std::string& type) const
+	{
+		std::vector<const std::string*> parts;
+		parts.reserve(_segments.size());
+		std::size_t size = 0;
+		for(const auto& segment : _segments)
+		{
+			const std::string* part = &segment.text;
+			if(segment.variable)
+			{
+				part = &variables.find(segment.text)->second;
+				if(part->empty())
+				{
+					KpmLogWarning("Command {}: variable '{}' found but is empty.", type, segment.text);
+				}
+			}
+			parts.push_back(part);
+			size += part->size();
+		}
+
+		std::string value;
+		value.reserve(size);
+		for(const std::string* part : parts)
+		{
+			value += *part;
+		}
+		return value;
+	}
+
+	// Names of the variables referenced, in order and possibly repeated
+	std::vector<std::string> variables() const
+	{
+		std::vector<std::string> names;
+		for(const auto& segment : _segments)
+		{
+			if(segment.variable)
+			{
+				names.push_back(segment.text);
+			}
+		}
+		return names;
+	}
+
+private:
+	struct Segment
+	{
+		std::string text; // Variable name for references
+		bool variable;
+	};
+
+	std::vector<Segment> _segments;
+};
+
+class KpmPICommand
+{
+public:
+	KpmPICommand(const std::string& type, const std::vector<std::string>& commands, const std::string& output, const KpmPIOptions& options = {})
+		: _type(type), _output_var(output), _commands(commands), _options(options)
+	{
+	}
+
+	// Splits the arguments into templates, once every variable of the package is known
+	void compile(const std::unordered_map<std::string, std::string>& variables)
+	{
+		_templates.clear();
+		_templates.reserve(_commands.size());
+		for(const auto& command : _commands)
+		{
+			_templates.emplace_back(command, variables, _type);
+		}
+	}
+
+	// Variables are only ever looked up, steps running concurrently never touch the same one.
+	// False if the step failed.
+	inline bool run(std::unordered_map<std::string, std::string>& variables, KpmInstallContext& ctx, std::vector<KpmManifestEntry>& entries)
+	{
+		std::vector<std::string> args;
+		args.reserve(_templates.size());
+		for(const auto& arg : _templates)
+		{
+			args.push_back(arg.render(variables, _type));
+		}
+
+		std::optional<std::string> output = KpmRunCommand(_type, args, _options, ctx, entries);
+		if(!output.has_value())
+		{
+			KpmLogError("Post install step {} failed.", _type);
 			return false;
 		}
 
-		std::string output = KpmRunCommand(_type, _commands, config);
 		if(!_output_var.empty())
 		{
 			if(_output_var.rfind(":APPEND") != std::string::npos)
 			{
-				variables[_output_var.substr(0, _output_var.rfind(":"))] += output;
+				variables.find(output_name())->second += output.value();
 			}
 			else
 			{
-				variables[_output_var] = output;
+				variables.find(output_name())->second = std::move(output.value());
 			}
 		}
 
 		return true;
 	}
 
+	const std::string& type() const { return _type; }
+	const std::vector<std::string>& commands() const { return _commands; }
+
+	// Variables the arguments reference, each once
+	std::vector<std::string> reads() const
+	{
+		std::vector<std::string> names;
+		for(const auto& arg : _templates)
+		{
+			for(auto& name : arg.variables())
+			{
+				if(std::find(names.begin(), names.end(), name) == names.end())
+				{
+					names.push_back(std::move(name));
+				}
+			}
+		}
+		return names;
+	}
+
+	// The variable the output goes to, without :APPEND (empty if none)
+	std::string output_name() const { return _output_var.substr(0, _output_var.rfind(":")); }
+
+	const KpmPIOptions& options() const { return _options; }
+
 private:
 	std::string _type;
 	std::string _output_var;
 	std::vector<std::string> _commands;
+	std::vector<KpmPITemplate> _templates;
+	KpmPIOptions _options;
 };
 
 static std::vector<std::string> KpmSplitStringIgnoreQuote(const std::string& value, char sep = ' ')
@@ -961,34 +2363,143 @@ static std::vector<std::string> KpmSplitStringIgnoreQuote(const std::string& val
 	{
 		char c = value[i];
 
-		if(c == '"')
-		{
-			inside_quotes = !inside_quotes;
-			cvalue.push_back(c);
-		}
-		else if(c == sep && !inside_quotes)
+		if(c == '"')
+		{
+			inside_quotes = !inside_quotes;
+			cvalue.push_back(c);
+		}
+		else if(c == sep && !inside_quotes)
+		{
+			args.push_back(cvalue);
+			cvalue.clear();
+		}
+		else
+	 	{
+			cvalue.push_back(c);
+		}
+	}
+
+	if(!cvalue.empty())
+	{
+		args.push_back(cvalue);
+	}
+
+	return args;
+}
+
+// Post install steps with the order they have to keep. A step waits for the earlier steps it conflicts with:
+// the ones writing a variable it reads, reading or writing one it writes, or touching the same paths.
+// exec steps may do anything and run alone, in order. Only cached ones with an output are probes,
+// declared to only read the machine, and run next to each other.
+struct KpmPISteps
+{
+	std::vector<KpmPICommand> commands;
+	std::vector<std::vector<std::size_t>> dependents; // Steps waiting on each step
+	std::vector<std::size_t> dependencies; // Steps each step waits on
+};
+
+// What a step reads and writes, variables in paths stand for any path
+struct KpmPIAccess
+{
+	bool probe = false;
+	bool barrier = false;
+	std::vector<std::filesystem::path> reads;
+	std::vector<std::filesystem::path> writes;
+	std::vector<std::string> variables_read;
+	std::string variable_written;
+};
+
+// Whether one path is inside the other (or the same), as far as can be told before variables are known
+static bool KpmPIAccessOverlap(const std::filesystem::path& a, const std::filesystem::path& b)
+{
+	for(auto ia = a.begin(), ib = b.begin(); ia != a.end() && ib != b.end(); ia++, ib++)
+	{
+		if(*ia != *ib)
+		{
+			return ia->string().find('!') != std::string::npos || ib->string().find('!') != std::string::npos;
+		}
+	}
+	return true;
+}
+
+static bool KpmPIConflict(const KpmPIAccess& a, const KpmPIAccess& b)
+{
+	auto reads = [](const KpmPIAccess& reader, const std::string& variable) {
+		return !variable.empty() && std::find(reader.variables_read.begin(), reader.variables_read.end(), variable) != reader.variables_read.end();
+	};
+
+	if(reads(a, b.variable_written) || reads(b, a.variable_written) || (!a.variable_written.empty() && a.variable_written == b.variable_written))
+	{
+		return true;
+	}
+
+	if(a.barrier || b.barrier)
+	{
+		return true;
+	}
+
+	if(a.probe || b.probe)
+	{
+		// Probes might look at what file steps changed
+		return a.probe != b.probe;
+	}
+
+	auto overlap = [](const std::vector<std::filesystem::path>& x, const std::vector<std::filesystem::path>& y) {
+		return std::any_of(x.begin(), x.end(), [&y](const auto& p) {
+			return std::any_of(y.begin(), y.end(), [&p](const auto& q) { return KpmPIAccessOverlap(p, q); });
+		});
+	};
+	return overlap(a.writes, b.writes) || overlap(a.writes, b.reads) || overlap(a.reads, b.writes);
+}
+
+static KpmPIAccess KpmPIStepAccess(const KpmPICommand& command, const std::string& install_path)
+{
+	KpmPIAccess access;
+	const auto& args = command.commands();
+	access.variables_read = command.reads();
+
+	// Install relative unless absolute or starting with a variable
+	auto resolve = [&install_path](const std::string& arg) {
+		std::filesystem::path path = arg;
+		if(!arg.starts_with('!') && path.is_relative())
 		{
-			args.push_back(cvalue);
-			cvalue.clear();
-		}
-		else
-	 	{
-			cvalue.push_back(c);
+			path = std::filesystem::path(install_path) / path;
 		}
-	}
+		path = path.lexically_normal();
+		return path.has_filename() ? path : path.parent_path();
+	};
 
-	if(!cvalue.empty())
+	const std::string& type = command.type();
+	if(type == "exec")
 	{
-		args.push_back(cvalue);
+		access.variable_written = command.output_name();
+		access.probe = !access.variable_written.empty() && command.options().cache;
+		access.barrier = !access.probe;
 	}
-
-	return args;
+	else if(type == "copy" && args.size() >= 2)
+	{
+		access.reads = { resolve(args[0]) };
+		access.writes = { resolve(args[1]) };
+	}
+	else if(type == "move" && args.size() >= 2)
+	{
+		access.writes = { resolve(args[0]), resolve(args[1]) };
+	}
+	else if((type == "mkdir" || type == "rmdir" || type == "rmfile") && !args.empty())
+	{
+		access.writes = { resolve(args[0]) };
+	}
+	else
+	{
+		access.barrier = true;
+	}
+	return access;
 }
 
-static auto KpmParseUserPostInstallSteps(const YAML::Node& config)
+static auto KpmParseUserPostInstallSteps(const YAML::Node& config, const std::string& install_path)
 {
 	std::unordered_map<std::string, std::string> variables;
-	std::queue<KpmPICommand> command_queue;
+	KpmPISteps steps;
 
 	for(const auto& cmd : config)
 	{
@@ -996,6 +2507,7 @@ static auto KpmParseUserPostInstallSteps(const YAML::Node& config)
 		const auto key = item->first.as<std::string>();
 		auto vitem = item->second;
 		std::string output_var;
+		KpmPIOptions options;
 
 		if(key == "exec")
 		{
@@ -1027,6 +2539,15 @@ static auto KpmParseUserPostInstallSteps(const YAML::Node& config)
 				output_var = vitem["output"].as<std::string>();
 				variables.emplace(output_var.substr(0, output_var.rfind(":")), std::string{});
 			}
+			// Commands that need a process of their own, e.g. to not share the environment of the shell
+			if(vitem["fresh"])
+			{
+				options.fresh = vitem["fresh"].as<bool>();
+			}
+			if(vitem["cache"])
+			{
+				options.cache = vitem["cache"].as<bool>();
+			}
 			if(vitem["cmd"])
 			{
 				vitem = item->second["cmd"];
@@ -1035,37 +2556,215 @@ static auto KpmParseUserPostInstallSteps(const YAML::Node& config)
 
 		const auto value = vitem.as<std::string>();
 		const auto args = KpmSplitStringIgnoreQuote(value);
-		command_queue.push({ key, args, output_var });
+		steps.commands.push_back({ key, args, output_var, options });
 	}
 
-	return std::make_tuple(variables, command_queue);
+	// Every variable is known by now, a step can read one a later step writes
+	std::vector<KpmPIAccess> access;
+	for(auto& command : steps.commands)
+	{
+		command.compile(variables);
+		access.push_back(KpmPIStepAccess(command, install_path));
+	}
+
+	steps.dependents.resize(steps.commands.size());
+	steps.dependencies.resize(steps.commands.size());
+	for(std::size_t i = 0; i < access.size(); i++)
+	{
+		for(std::size_t j = 0; j < i; j++)
+		{
+			if(KpmPIConflict(access[j], access[i]))
+			{
+				steps.dependents[j].push_back(i);
+				steps.dependencies[i]++;
+			}
+		}
+	}
+
+	return std::make_tuple(variables, steps);
 }
 
-static void KpmRunUserPostInstallSteps(const YAML::Node& config)
+// False if a step failed, no step that wasn't running yet is started after that
+static bool KpmRunUserPostInstallSteps(KpmInstallContext& ctx)
 {
+	const YAML::Node& config = ctx.config;
 	if(!config["dist"]["post_install"])
 	{
 		// There is no user post_install commands
 		// Silently ignore
-		return;
+		return true;
+	}
+
+	auto [variables, steps] = KpmParseUserPostInstallSteps(config["dist"]["post_install"], KpmGetInstallPath(ctx));
+	const std::size_t count = steps.commands.size();
+
+	// Collected per step and added in step order, the manifest is the same as when running them one by one
+	std::vector<std::vector<KpmManifestEntry>> entries(count);
+
+	ctx.shells = std::make_unique<KpmShellPool>();
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::queue<std::size_t> ready;
+	std::size_t done = 0;
+	bool failed = false;
+	for(std::size_t i = 0; i < count; i++)
+	{
+		if(steps.dependencies[i] == 0)
+		{
+			ready.push(i);
+		}
+	}
+
+	auto worker = [&]() {
+		std::unique_lock lock(mutex);
+		while(true)
+		{
+			cv.wait(lock, [&]() { return !ready.empty() || done == count || failed; });
+			if(ready.empty() || failed)
+			{
+				return;
+			}
+
+			const std::size_t step = ready.front();
+			ready.pop();
+			lock.unlock();
+			const bool ok = steps.commands[step].run(variables, ctx, entries[step]);
+			lock.lock();
+
+			if(!ok)
+			{
+				failed = true;
+				cv.notify_all();
+				return;
+			}
+
+			done++;
+			for(std::size_t next : steps.dependents[step])
+			{
+				if(--steps.dependencies[next] == 0)
+				{
+					ready.push(next);
+				}
+			}
+			cv.notify_all();
+		}
+	};
+
+	const std::size_t threads = std::min<std::size_t>(std::clamp(std::thread::hardware_concurrency(), KPM_POST_INSTALL_THREADS_MIN, KPM_POST_INSTALL_THREADS_MAX), count);
+	std::vector<std::thread> workers;
+	for(std::size_t i = 1; i < threads; i++)
+	{
+		workers.emplace_back(worker);
+	}
+	worker();
+
+	for(auto& thread : workers)
+	{
+		thread.join();
 	}
+	ctx.shells.reset();
 
-	auto [variables, steps] = KpmParseUserPostInstallSteps(config["dist"]["post_install"]);
+	if(failed)
+	{
+		return false;
+	}
 
-	while(!steps.empty())
+	for(auto& step : entries)
 	{
-		steps.front().run(variables, config);
-		steps.pop();
+		for(auto& entry : step)
+		{
+			ctx.manifest.add(std::move(entry));
+		}
 	}
 
 	if(variables.contains("KPM_USER_MANIFEST_FILES"))
 	{
 		auto additional_files = KpmSplitStringIgnoreQuote(variables["KPM_USER_MANIFEST_FILES"], '\n');
-		KpmPopulateManifestUserFile(additional_files);
+		std::vector<KpmManifestEntry> additional;
+		KpmPopulateManifestUserFile(additional, additional_files);
+		for(auto& entry : additional)
+		{
+			ctx.manifest.add(std::move(entry));
+		}
+	}
+	return true;
+}
+
+// Network stage of an install: read the config and find the package to deploy
+static bool KpmIsSha256Hex(const std::string& value)
+{
+	return value.size() == 64 && std::all_of(value.begin(), value.end(), [](char c) { return std::isdigit(c) || (c >= 'a' && c <= 'f'); });
+}
+
+// A patch entry of dist.packages, e.g. `linux_amd64: { patch: <file>, from: <sha256>, sha256: <sha256> }`
+static std::optional<KpmPatchAsset> KpmParsePatch(const YAML::Node& node, const std::string& endpoint)
+{
+	if(!node["patch"] || !node["from"] || !node["sha256"])
+	{
+		KpmLogWarning("Ignoring patch entry, <patch>, <from> and <sha256> fields required.");
+		return std::nullopt;
+	}
+
+	KpmPatchAsset patch;
+	patch.url = endpoint + node["patch"].as<std::string>();
+	patch.from = node["from"].as<std::string>();
+	patch.sha256 = node["sha256"].as<std::string>();
+	std::transform(patch.from.begin(), patch.from.end(), patch.from.begin(), [](char c) { return std::tolower(c); });
+	std::transform(patch.sha256.begin(), patch.sha256.end(), patch.sha256.begin(), [](char c) { return std::tolower(c); });
+
+	// Both name cache blobs
+	if(!KpmIsSha256Hex(patch.from) || !KpmIsSha256Hex(patch.sha256))
+	{
+		KpmLogWarning("Ignoring patch {}, <from> and <sha256> must be SHA-256 hashes.", patch.url);
+		return std::nullopt;
+	}
+	return patch;
+}
+
+// The patch that applies to the archive the package was installed from, if it is still cached
+static std::optional<KpmPatchAsset> KpmSelectPatch(const std::string& name, const std::vector<KpmPatchAsset>& patches)
+{
+	if(patches.empty())
+	{
+		return std::nullopt;
+	}
+
+	std::ifstream handle(KpmGetCachePath() + name + ".dist");
+	std::string installed;
+	handle >> installed;
+
+	std::error_code ec;
+	for(const auto& patch : patches)
+	{
+		if(patch.from == installed && std::filesystem::exists(KpmCacheBlobPath(installed), ec))
+		{
+			return patch;
+		}
+	}
+
+	KpmLogTrace("No patch applies to the installed version of {}.", name);
+	return std::nullopt;
+}
+
+// Remembers which archive the package was installed from, patches are matched against it
+static void KpmWriteDist(const std::string& name, const std::string& blob)
+{
+	const std::string file = KpmGetCachePath() + name + ".dist";
+	std::error_code ec;
+	if(blob.empty())
+	{
+		std::filesystem::remove(file, ec);
+		return;
+	}
+
+	std::ofstream handle(file, std::ios::trunc);
+	if(!handle.is_open() || !(handle << blob << '\n'))
+	{
+		KpmLogWarning("Failed to write {}.", file);
 	}
 }
 
-static bool KpmInstallFromMemory(const std::string& data) noexcept
+static bool KpmInstallFromMemory(KpmInstallContext& ctx, const std::string& data, bool prefetch) noexcept
 {
 	std::optional<std::string> plat_tag = KpmGetPackagePlatformTag();
 	if(!plat_tag.has_value())
@@ -1074,7 +2773,8 @@ static bool KpmInstallFromMemory(const std::string& data) noexcept
 		return false;
 	}
 
-	YAML::Node config = KpmReadConfigFile(data).value_or(YAML::Node{});
+	ctx.config = KpmReadConfigFile(data).value_or(YAML::Node{});
+	const YAML::Node& config = ctx.config;
 
 	if(!KpmValidateConfig(config))
 	{
@@ -1085,8 +2785,14 @@ static bool KpmInstallFromMemory(const std::string& data) noexcept
 	std::unordered_map<std::string, std::string> platform_map;
 	std::string endpoint = config["dist"]["endpoint"].as<std::string>();
 
+	// Local directories and file:// endpoints are read in place, no download or cache involved
+	std::optional<std::string> local = KpmLocalPath(endpoint);
+	if(local.has_value())
+	{
+		endpoint = local.value();
+	}
 	// Resolve the endpoint if this is a github repo
-	if(KpmCheckGithubRepo(endpoint))
+	else if(KpmCheckGithubRepo(endpoint))
 	{
 		auto candidate = KpmGithubFetchEndpoint(endpoint, config);
 		if(!candidate.has_value())
@@ -1103,11 +2809,24 @@ static bool KpmInstallFromMemory(const std::string& data) noexcept
 		endpoint += '/';
 	}
 
+	std::vector<KpmPatchAsset> patches;
 	for (const auto& item : config["dist"]["packages"])
 	{
 		if (item.IsMap() && item.size() == 1)
 		{
 			auto it = item.begin();
+			if (it->second.IsMap())
+			{
+				if (it->first.as<std::string>() == plat_tag.value())
+				{
+					std::optional<KpmPatchAsset> patch = KpmParsePatch(it->second, endpoint);
+					if (patch.has_value())
+					{
+						patches.push_back(std::move(patch.value()));
+					}
+				}
+				continue;
+			}
 			platform_map[it->first.as<std::string>()] = endpoint + it->second.as<std::string>();
 		}
 	}
@@ -1125,63 +2844,216 @@ static bool KpmInstallFromMemory(const std::string& data) noexcept
 		}
 
 		KpmLogInfo("Binary distribution for platform <{}> not found. Falling back to source distribution.", plat_tag.value());
-		if(!KpmDeploySource(src_package->second, config))
+		ctx.dist = src_package->second;
+		ctx.dist_source = true;
+		ctx.dist_local = local.has_value();
+		return true;
+	}
+
+	KpmLogInfo("Found binary distribution for platform <{}>.", plat_tag.value());
+	ctx.dist = package->second;
+	ctx.dist_source = false;
+	ctx.dist_local = local.has_value();
+	ctx.patch = ctx.dist_local ? std::nullopt : KpmSelectPatch(config["metadata"]["name"].as<std::string>(), patches);
+
+	// Only the full archive is downloaded if the patch turns out not to work
+	if(prefetch && ctx.patch.has_value() && KpmPatchPrebuild(ctx.patch.value()).has_value())
+	{
+		return true;
+	}
+
+	if(prefetch && !ctx.dist_local && !KpmPrefetchPrebuild(ctx.dist))
+	{
+		KpmLogError("Failed to download pre-built files.");
+		return false;
+	}
+
+	return true;
+}
+
+// Disk stage of an install: write the package files and the manifest
+static bool KpmInstallDeploy(KpmInstallContext& ctx) noexcept
+{
+	const std::string name = ctx.config["metadata"]["name"].as<std::string>();
+	ctx.journal = KpmJournal::Begin(name);
+	if(!ctx.journal)
+	{
+		return false;
+	}
+
+	if(_kpm_store || (ctx.upgrade && KpmStoreCurrent(name).has_value()))
+	{
+		// The prefix is only linked to once the new generation is complete
+		KpmGetInstallPath(ctx);
+		ctx.generation = KpmStoreNextGeneration(name);
+		ctx.store = KpmStoreGenerationPath(name, ctx.generation);
+		KpmLogTrace("Installing into store generation {}.", ctx.generation);
+	}
+	else if(KpmStoreCurrent(name).has_value())
+	{
+		// Extracting over the links would write into the active generation
+		KpmLogError("Package {} is installed from the store, use --store to upgrade it.", name);
+		ctx.journal->close();
+		return false;
+	}
+	else if(ctx.upgrade)
+	{
+		const std::string package_manifest_file = KpmGetCachePath() + name + ".manifest";
+		std::error_code ec;
+		if(!std::filesystem::exists(package_manifest_file, ec))
 		{
-			KpmLogError("Failed to deploy source distribution.");
+			KpmLogInfo("Package {} is not installed yet.", name);
+		}
+		else if(ctx.installed = KpmManifest::Open(package_manifest_file); !ctx.installed.has_value())
+		{
+			KpmLogError("Failed to read manifest file.");
+			ctx.journal->close();
 			return false;
 		}
 	}
+
+	// Generations are never written again, their files are left out
+	ctx.dedup = _kpm_dedup && ctx.store.empty();
+	if(_kpm_dedup && !ctx.dedup)
+	{
+		KpmLogInfo("Files of store installs are not deduplicated.");
+	}
+
+	ctx.owners = KpmOwners::Open(KpmGetOwnersPath());
+	if(!ctx.owners.has_value())
+	{
+		KpmLogError("Failed to read the ownership database.");
+		ctx.journal->close();
+		return false;
+	}
+
+	// Whatever was created so far goes again, the owners are not updated yet
+	auto rollback = [&ctx]() {
+		ctx.owners.reset();
+		ctx.installed.reset();
+		if(ctx.journal->rollback())
+		{
+			ctx.journal->close();
+		}
+		ctx.journal.reset();
+		return false;
+	};
+
+	if(ctx.dist_source)
+	{
+		if(!KpmDeploySource(ctx.dist, ctx))
+		{
+			KpmLogError("Failed to deploy source distribution.");
+			return rollback();
+		}
+	}
 	else
 	{
-		KpmLogInfo("Found binary distribution for platform <{}>.", plat_tag.value());
-		if(!KpmDeployPrebuild(package->second, config))
+		if(!KpmDeployPrebuild(ctx.dist, ctx))
 		{
 			KpmLogError("Failed to deploy pre-built files.");
-			return false;
+			return rollback();
 		}
 	}
 
-	// TODO: (César) If prebuild or source fails during copying files
-	// 				 check if there are some dangling files that we need to remove
-	
-	KpmRunUserPostInstallSteps(config);
+	// Held shared, it keeps other kpm processes from updating the database
+	ctx.owners.reset();
 
-	return KpmWriteManifest(config);
-}
+	if(!KpmRunUserPostInstallSteps(ctx))
+	{
+		KpmLogError("Failed to run the post install steps.");
+		return rollback();
+	}
 
-static std::tuple<bool, std::string> KpmGithubSupportsKpm(const std::string& repo)
-{
-	auto json_info_c = KpmGet<nlohmann::json>("https://api.github.com/repos/" + repo + "/contents");
-	if(json_info_c && !json_info_c.value().empty())
+	if(!ctx.store.empty())
+	{
+		if(!KpmStoreSeal(name, ctx.generation, ctx.manifest, ctx.prefix, *ctx.journal) || !KpmStoreActivate(name, ctx.generation, *ctx.journal))
+		{
+			return rollback();
+		}
+	}
+	else
 	{
-		std::int32_t index = KpmJsonFindInArray(json_info_c.value(), "path", "kpm.yaml");
-		if(index == -1)
+		// Whatever the new version doesn't have anymore goes once its manifest is in place
+		std::vector<std::string> dropped_files;
+		std::vector<std::string> dropped_dirs;
+		std::vector<KpmManifestEntry> dropped = ctx.installed.has_value() ? ctx.installed->dropped(ctx.manifest) : std::vector<KpmManifestEntry>();
+		if(!dropped.empty())
 		{
-			// Try yml
-			index = KpmJsonFindInArray(json_info_c.value(), "path", "kpm.yml");
-			if(index == -1)
+			// Released again before the manifest is written, that updates the database
+			std::optional<KpmOwners> owners = KpmOwners::Open(KpmGetOwnersPath());
+			if(!owners.has_value())
+			{
+				KpmLogError("Failed to read the ownership database.");
+				return rollback();
+			}
+
+			for(const auto& entry : dropped)
 			{
-				return {false, ""};
+				if(entry.type == KpmManifestType::DIRECTORY)
+				{
+					dropped_dirs.push_back(entry.path);
+				}
+				else if(owners->find(entry.path).value_or(name) == name)
+				{
+					dropped_files.push_back(entry.path);
+				}
 			}
 		}
-		return {true, json_info_c.value()[index]["download_url"]};
+
+		// Unmapped first, Windows can't replace a mapped file
+		ctx.installed.reset();
+		if(!KpmWriteManifest(ctx))
+		{
+			return rollback();
+		}
+
+		if(!dropped_files.empty() || !dropped_dirs.empty())
+		{
+			KpmLogInfo("Removing {} files dropped by the new version.", dropped_files.size());
+			KpmRemovePaths(dropped_files, std::move(dropped_dirs), true);
+		}
+
+		// Objects only the previous version used go now
+		if(ctx.dedup)
+		{
+			KpmLogTrace("{} files share objects.", ctx.objects.size());
+		}
+		KpmObjectsReference(name, ctx.objects);
 	}
-	return {false, ""};
+
+	ctx.journal->close();
+	ctx.journal.reset();
+	KpmWriteDist(name, ctx.dist_blob);
+	return true;
 }
 
-static std::string KpmGithubProcessPackage(const std::string& repo)
+static std::optional<std::string> KpmGithubLoadYaml(const std::string& repo)
 {
-	// Check if repo is valid
-	auto [gh_support, gh_yaml_url] = KpmGithubSupportsKpm(repo);
-	if(!gh_support)
-	{
-		return "";
-	}
+	auto fetch = [&repo](const std::string& name) -> std::optional<std::string> {
+		std::string buffer;
+		KpmHttpResponse response = KpmFetchUrl("https://raw.githubusercontent.com/" + repo + "/HEAD/" + name, [&buffer](const std::uint8_t* data, std::size_t size) {
+			buffer.append(reinterpret_cast<const char*>(data), size);
+			return KpmHttpWrite::OK;
+		}, false);
+
+		if(!response.ok || response.status != 200)
+		{
+			return std::nullopt;
+		}
+		return buffer;
+	};
+
+	// Race both names, kpm.yaml wins if a repo has both
+	auto yaml = std::async(std::launch::async, fetch, "kpm.yaml");
+	auto yml = std::async(std::launch::async, fetch, "kpm.yml");
 
-	return gh_yaml_url;
+	std::optional<std::string> data = yaml.get();
+	std::optional<std::string> fallback = yml.get();
+	return data.has_value() ? data : fallback;
 }
 
-static bool KpmInstallFromUrl(const std::string& url)
+static bool KpmInstallFromUrl(KpmInstallContext& ctx, const std::string& url, bool prefetch)
 {
 	std::optional<std::string> data = KpmLoadYamlRemote(url);
 	if(!data.has_value())
@@ -1189,10 +3061,10 @@ static bool KpmInstallFromUrl(const std::string& url)
 		KpmLogError("Failed to install from url: {}", url);
 		return false;
 	}
-	return KpmInstallFromMemory(data.value());
+	return KpmInstallFromMemory(ctx, data.value(), prefetch);
 }
 
-static bool KpmInstallFromFile(const std::string& file)
+static bool KpmInstallFromFile(KpmInstallContext& ctx, const std::string& file, bool prefetch)
 {
 	std::optional<std::string> data = KpmLoadYamlLocal(file);
 	if(!data.has_value())
@@ -1200,33 +3072,112 @@ static bool KpmInstallFromFile(const std::string& file)
 		KpmLogError("Failed to install from file: {}", file);
 		return false;
 	}
-	return KpmInstallFromMemory(data.value());
+	return KpmInstallFromMemory(ctx, data.value(), prefetch);
 }
 
-static void KpmInstallSetPath(const std::string& path)
+static bool KpmInstallResolve(KpmInstallContext& ctx, bool prefetch)
 {
-	_kpm_install_prefix = path;
+	switch (KpmDetectMedia(ctx.package))
+	{
+		case KpmMediaType::LOCAL:
+			return KpmInstallFromFile(ctx, KpmLocalPath(ctx.package).value(), prefetch);
+			break;
+		case KpmMediaType::GITHUB:
+		{
+			std::optional<std::string> data = KpmGithubLoadYaml(ctx.package);
+			if(!data.has_value())
+			{
+				KpmLogError("No kpm.yaml or kpm.yml found in github repo: {}", ctx.package);
+				return false;
+			}
+			return KpmInstallFromMemory(ctx, data.value(), prefetch);
+		}
+		case KpmMediaType::REMOTE:
+			return KpmInstallFromUrl(ctx, ctx.package, prefetch);
+	}
+	return false;
 }
 
-bool KpmInstall(const std::string& package, const std::string& path)
+static bool KpmInstallPackages(const std::vector<std::string>& packages, const std::string& path, std::size_t jobs, bool upgrade)
 {
-	if(!path.empty())
+	// Leftovers of installs that crashed
+	KpmJournal::Recover();
+
+	jobs = std::max<std::size_t>(jobs, 1);
+	KpmHttpClient::Get().set_max_transfers(std::max(jobs, KpmGetDownloadSegments()));
+
+	std::vector<std::unique_ptr<KpmInstallContext>> installs;
+	for(const auto& package : packages)
+	{
+		auto ctx = std::make_unique<KpmInstallContext>();
+		ctx->package = package;
+		ctx->prefix = path;
+		ctx->upgrade = upgrade;
+
+		if(!path.empty() && !path.ends_with('/') && !path.ends_with('\\'))
+		{
+			ctx->prefix += std::filesystem::path::preferred_separator;
+		}
+
+		installs.push_back(std::move(ctx));
+	}
+
+	// With more than one package, downloads run ahead into the kpm cache
+	// while earlier packages are being deployed
+	const bool prefetch = installs.size() > 1;
+
+	std::vector<std::promise<bool>> resolved(installs.size());
+	std::vector<std::future<bool>> resolved_futures;
+	for(auto& promise : resolved)
 	{
-		KpmInstallSetPath(path);
+		resolved_futures.push_back(promise.get_future());
 	}
 
-	std::string url = package;
+	// Network stages run concurrently
+	std::atomic<std::size_t> next = 0;
+	std::vector<std::thread> workers;
+	for(std::size_t i = 0; i < std::min(jobs, installs.size()); i++)
+	{
+		workers.emplace_back([&installs, &resolved, &next, prefetch]() {
+			for(std::size_t j = next++; j < installs.size(); j = next++)
+			{
+				resolved[j].set_value(KpmInstallResolve(*installs[j], prefetch));
+			}
+		});
+	}
 
-	switch (KpmDetectMedia(package))
+	// Disk stages run one at a time, in the order given
+	bool ok = true;
+	for(std::size_t i = 0; i < installs.size(); i++)
 	{
-		case KpmMediaType::LOCAL:
-			return KpmInstallFromFile(package);
-			break;
-		case KpmMediaType::GITHUB:
-			url = KpmGithubProcessPackage(package);
-			[[fallthrough]];
-		case KpmMediaType::REMOTE:
-			return KpmInstallFromUrl(url);
+		const std::string& package = installs[i]->package;
+		if(!resolved_futures[i].get() || !KpmInstallDeploy(*installs[i]))
+		{
+			KpmLogError("Failed to install package {}.", package);
+			ok = false;
+			continue;
+		}
+
+		if(installs.size() > 1)
+		{
+			KpmLogInfo("Installed package {}.", package);
+		}
 	}
-	return false;
+
+	for(auto& worker : workers)
+	{
+		worker.join();
+	}
+
+	return ok;
+}
+
+bool KpmInstall(const std::vector<std::string>& packages, const std::string& path, std::size_t jobs)
+{
+	return KpmInstallPackages(packages, path, jobs, false);
+}
+
+bool KpmUpgrade(const std::vector<std::string>& packages, const std::string& path, std::size_t jobs)
+{
+	return KpmInstallPackages(packages, path, jobs, true);
 }
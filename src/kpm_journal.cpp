@@ -0,0 +1,467 @@
+#include "../kpm.h"
+#include "../kpm_journal.h"
+#include "../kpm_manifest.h"
+#include "../kpm_owners.h"
+#include "logger.inl"
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <share.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static constexpr char KPM_JOURNAL_MAGIC[8] = { 'K', 'P', 'M', 'J', 'R', 'N', 'L', '1' };
+
+// Records between two fsync calls, a power loss may drop up to this many
+static constexpr std::size_t KPM_JOURNAL_SYNC_BATCH = 4096;
+
+struct KpmJournal::Handle
+{
+	int fd = -1;
+
+	~Handle()
+	{
+#ifdef _WIN32
+		_close(fd);
+#else
+		::close(fd);
+#endif
+	}
+};
+
+// Exclusive for the whole install, busy is set if someone else holds it
+static int KpmJournalLock(const std::string& file, bool& busy)
+{
+	busy = false;
+#ifdef _WIN32
+	// Others can still read it, but nobody else can open it for writing
+	int fd = -1;
+	errno_t error = _sopen_s(&fd, file.c_str(), _O_RDWR | _O_CREAT | _O_APPEND | _O_BINARY, _SH_DENYWR, _S_IREAD | _S_IWRITE);
+	busy = error == EACCES;
+	return error == 0 ? fd : -1;
+#else
+	while(true)
+	{
+		int fd = ::open(file.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+		if(fd < 0)
+		{
+			return -1;
+		}
+
+		if(flock(fd, LOCK_EX | LOCK_NB) != 0)
+		{
+			busy = errno == EWOULDBLOCK;
+			::close(fd);
+			return -1;
+		}
+
+		// The previous holder may have deleted it in the meantime, lock the new one then
+		struct stat st;
+		if(fstat(fd, &st) == 0 && st.st_nlink > 0)
+		{
+			return fd;
+		}
+		::close(fd);
+	}
+#endif
+}
+
+static bool KpmJournalWrite(int fd, const char* data, std::size_t size)
+{
+	while(size > 0)
+	{
+#ifdef _WIN32
+		int written = _write(fd, data, static_cast<unsigned>(size));
+#else
+		ssize_t written = ::write(fd, data, size);
+		if(written < 0 && errno == EINTR)
+		{
+			continue;
+		}
+#endif
+		if(written <= 0)
+		{
+			return false;
+		}
+		data += written;
+		size -= written;
+	}
+	return true;
+}
+
+static bool KpmJournalSync(int fd)
+{
+#ifdef _WIN32
+	return _commit(fd) == 0;
+#else
+	return fsync(fd) == 0;
+#endif
+}
+
+static bool KpmJournalTruncate(int fd)
+{
+#ifdef _WIN32
+	return _chsize_s(fd, 0) == 0;
+#else
+	return ftruncate(fd, 0) == 0;
+#endif
+}
+
+static void KpmJournalRecord(std::string& out, KpmJournal::Type type, std::string_view path)
+{
+	out.push_back(static_cast<char>(type));
+	for(int i = 0; i < 4; i++)
+	{
+		out.push_back(static_cast<char>(path.size() >> (i * 8)));
+	}
+	out.append(path);
+}
+
+// Symlink and rename over path, readers see either the old or the new target
+static bool KpmJournalSwapLink(const std::string& path, const std::string& target)
+{
+	std::error_code ec;
+	const std::string temp = path + ".tmp";
+	std::filesystem::remove(temp, ec);
+	std::filesystem::create_symlink(target, temp, ec);
+	if(!ec)
+	{
+		std::filesystem::rename(temp, path, ec);
+	}
+
+	if(ec)
+	{
+		KpmLogError("Failed to point {} at {}: {}", path, target, ec.message());
+		std::filesystem::remove(temp, ec);
+		return false;
+	}
+	return true;
+}
+
+// Puts back the state from before the install the journal belongs to, or completes it if it was committed
+static bool KpmJournalReplay(const std::string& package, const std::string& file, bool interrupted)
+{
+	std::ifstream handle(file, std::ios::binary);
+	std::string data((std::istreambuf_iterator<char>(handle)), std::istreambuf_iterator<char>());
+
+	// Torn while the header was written, nothing was created yet
+	if(data.size() < sizeof(KPM_JOURNAL_MAGIC))
+	{
+		return true;
+	}
+
+	if(std::memcmp(data.data(), KPM_JOURNAL_MAGIC, sizeof(KPM_JOURNAL_MAGIC)) != 0)
+	{
+		KpmLogError("Install journal {} is corrupted, remove it to continue.", file);
+		return false;
+	}
+
+	std::vector<std::string> files;
+	std::vector<std::string> dirs;
+	std::vector<std::pair<std::string, std::string>> links;
+	bool committed = false;
+
+	// A record torn by the crash ends the journal, its path was never created
+	for(std::size_t offset = sizeof(KPM_JOURNAL_MAGIC); data.size() - offset >= 5;)
+	{
+		const auto type = static_cast<KpmJournal::Type>(data[offset]);
+		std::size_t length = 0;
+		for(int i = 0; i < 4; i++)
+		{
+			length |= std::size_t(static_cast<std::uint8_t>(data[offset + 1 + i])) << (i * 8);
+		}
+		offset += 5;
+		if(length > data.size() - offset)
+		{
+			break;
+		}
+
+		std::string path = data.substr(offset, length);
+		offset += length;
+
+		if(type == KpmJournal::Type::FILE)
+		{
+			files.push_back(std::move(path));
+		}
+		else if(type == KpmJournal::Type::DIRECTORY)
+		{
+			dirs.push_back(std::move(path));
+		}
+		else if(type == KpmJournal::Type::LINK)
+		{
+			const std::size_t separator = path.find('\0');
+			if(separator == std::string::npos)
+			{
+				break;
+			}
+			links.emplace_back(path.substr(0, separator), path.substr(separator + 1));
+		}
+		else if(type == KpmJournal::Type::COMMIT)
+		{
+			committed = true;
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	if(committed)
+	{
+		// Crashed between the manifest and the ownership database, the manifest is the truth
+		KpmLogWarning("Completing the interrupted install of {}.", package);
+		std::optional<KpmManifest> manifest = KpmManifest::Open(KpmGetCachePath() + package + ".manifest");
+		if(!manifest.has_value())
+		{
+			KpmLogError("Failed to read manifest of package {}.", package);
+			return false;
+		}
+
+		std::vector<std::string> owned;
+		manifest->for_each([&owned](const KpmManifestEntry& entry) {
+			if(entry.type != KpmManifestType::DIRECTORY)
+			{
+				owned.push_back(entry.path);
+			}
+			return true;
+		});
+		manifest.reset();
+
+		return KpmOwners::Update(KpmGetOwnersPath(), package, owned);
+	}
+
+	if(files.empty() && dirs.empty() && links.empty())
+	{
+		return true;
+	}
+
+	if(interrupted)
+	{
+		KpmLogWarning("Rolling back the interrupted install of {}.", package);
+	}
+	else
+	{
+		KpmLogInfo("Rolling back the install of {}.", package);
+	}
+	KpmLogTrace("Removing {} files and {} directories.", files.size(), dirs.size());
+
+	// Links go back first, nothing they pointed to before is removed
+	bool ok = true;
+	for(auto it = links.rbegin(); it != links.rend(); it++)
+	{
+		ok = KpmJournalSwapLink(it->first, it->second) && ok;
+	}
+
+	return KpmRemovePaths(files, std::move(dirs), true) && ok;
+}
+
+KpmJournal::KpmJournal(const std::string& package, const std::string& file, std::unique_ptr<Handle> handle)
+	: _package(package), _file(file), _handle(std::move(handle))
+{
+}
+
+KpmJournal::~KpmJournal() = default;
+
+std::unique_ptr<KpmJournal> KpmJournal::Begin(const std::string& package)
+{
+	const std::string file = KpmGetCachePath() + package + ".journal";
+
+	bool busy = false;
+	int fd = KpmJournalLock(file, busy);
+	if(fd < 0)
+	{
+		if(busy)
+		{
+			KpmLogError("Another install of {} is in progress.", package);
+		}
+		else
+		{
+			KpmLogError("Failed to open install journal {}.", file);
+		}
+		return nullptr;
+	}
+
+	auto handle = std::make_unique<Handle>();
+	handle->fd = fd;
+	std::unique_ptr<KpmJournal> journal(new KpmJournal(package, file, std::move(handle)));
+
+	if(!KpmJournalReplay(package, file, true))
+	{
+		return nullptr;
+	}
+
+	if(!KpmJournalTruncate(fd) || !KpmJournalWrite(fd, KPM_JOURNAL_MAGIC, sizeof(KPM_JOURNAL_MAGIC)) || !KpmJournalSync(fd))
+	{
+		KpmLogError("Failed to write install journal {}.", file);
+		return nullptr;
+	}
+
+	return journal;
+}
+
+bool KpmJournal::append(const std::string& records, std::size_t count)
+{
+	if(!KpmJournalWrite(_handle->fd, records.data(), records.size()))
+	{
+		KpmLogError("Failed to write install journal {}.", _file);
+		return false;
+	}
+
+	_unsynced += count;
+	if(_unsynced >= KPM_JOURNAL_SYNC_BATCH)
+	{
+		_unsynced = 0;
+		if(!KpmJournalSync(_handle->fd))
+		{
+			KpmLogError("Failed to sync install journal {}.", _file);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool KpmJournal::create(const std::string& path, Type type)
+{
+	std::string_view clean = path;
+	while(clean.size() > 1 && (clean.back() == '/' || clean.back() == '\\'))
+	{
+		clean.remove_suffix(1);
+	}
+
+	std::lock_guard lock(_mutex);
+	std::error_code ec;
+	const std::filesystem::path target(clean);
+	const std::string parent_dir = target.parent_path().string();
+
+	// Nothing can be in a directory this install just created, that saves the stat of most paths
+	const bool fresh = _known_created && parent_dir == _known_dir;
+	if(!fresh && std::filesystem::exists(std::filesystem::symlink_status(target, ec)))
+	{
+		_known_dir = type == Type::DIRECTORY ? target.string() : parent_dir;
+		_known_created = false;
+		return true;
+	}
+
+	// Archives are mostly in directory order, the last parent seen saves the walk up
+	std::vector<std::filesystem::path> parents;
+	for(std::filesystem::path parent = target.parent_path();
+		!parent.empty() && parent != parent.parent_path() && parent.string() != _known_dir
+			&& !std::filesystem::exists(std::filesystem::symlink_status(parent, ec));
+		parent = parent.parent_path())
+	{
+		parents.push_back(parent);
+	}
+
+	std::string records;
+	for(auto it = parents.rbegin(); it != parents.rend(); it++)
+	{
+		KpmJournalRecord(records, Type::DIRECTORY, it->string());
+	}
+	KpmJournalRecord(records, type, clean);
+
+	_known_dir = type == Type::DIRECTORY ? target.string() : parent_dir;
+	_known_created = type == Type::DIRECTORY || fresh || !parents.empty();
+	return append(records, parents.size() + 1);
+}
+
+bool KpmJournal::relink(const std::string& path, const std::string& target)
+{
+	std::error_code ec;
+	std::filesystem::path previous = std::filesystem::read_symlink(path, ec);
+	if(ec)
+	{
+		if(!create(path, Type::FILE))
+		{
+			return false;
+		}
+	}
+	else
+	{
+		// Synced right away, the rename below must not be undone by a lost record
+		std::string records;
+		KpmJournalRecord(records, Type::LINK, path + '\0' + previous.string());
+		std::lock_guard lock(_mutex);
+		if(!KpmJournalWrite(_handle->fd, records.data(), records.size()) || !KpmJournalSync(_handle->fd))
+		{
+			KpmLogError("Failed to write install journal {}.", _file);
+			return false;
+		}
+	}
+
+	return KpmJournalSwapLink(path, target);
+}
+
+bool KpmJournal::commit()
+{
+	std::string records;
+	KpmJournalRecord(records, Type::COMMIT, "");
+	if(!KpmJournalWrite(_handle->fd, records.data(), records.size()) || !KpmJournalSync(_handle->fd))
+	{
+		KpmLogError("Failed to commit install journal {}.", _file);
+		return false;
+	}
+	return true;
+}
+
+bool KpmJournal::rollback()
+{
+	return KpmJournalReplay(_package, _file, false);
+}
+
+void KpmJournal::close()
+{
+	// Emptied first, whoever opens it before it is gone finds nothing to replay
+	KpmJournalTruncate(_handle->fd);
+	std::error_code ec;
+#ifdef _WIN32
+	_handle.reset();
+	std::filesystem::remove(_file, ec);
+#else
+	std::filesystem::remove(_file, ec);
+	_handle.reset();
+#endif
+}
+
+void KpmJournal::Recover()
+{
+	std::error_code ec;
+	for(const auto& item : std::filesystem::directory_iterator(KpmGetCachePath(), ec))
+	{
+		if(item.path().extension() != ".journal")
+		{
+			continue;
+		}
+
+		const std::string file = item.path().string();
+		const std::string package = item.path().stem().string();
+
+		bool busy = false;
+		int fd = KpmJournalLock(file, busy);
+		if(fd < 0)
+		{
+			KpmLogTrace("Skipping install journal {}, {}.", file, busy ? "in use" : "can't be opened");
+			continue;
+		}
+
+		auto handle = std::make_unique<Handle>();
+		handle->fd = fd;
+		KpmJournal journal(package, file, std::move(handle));
+		if(KpmJournalReplay(package, file, true))
+		{
+			journal.close();
+		}
+	}
+}
@@ -0,0 +1,460 @@
+#include "../kpm_manifest.h"
+#include "../kpm_hash.h"
+#include "logger.inl"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <unordered_set>
+#include <vector>
+
+static constexpr char KPM_MANIFEST_MAGIC[8] = { 'K', 'P', 'M', 'M', 'A', 'N', 'I', 'F' };
+static constexpr std::uint32_t KPM_MANIFEST_VERSION = 1;
+static constexpr std::size_t KPM_MANIFEST_HEADER_SIZE = 32;
+static constexpr std::uint32_t KPM_MANIFEST_RESTART_INTERVAL = 16;
+
+static constexpr std::uint8_t KPM_MANIFEST_FLAG_HASHED = 0x01;
+
+static void KpmPutU32(std::string& out, std::uint32_t value)
+{
+	for(int i = 0; i < 4; i++)
+	{
+		out.push_back(static_cast<char>(value >> (i * 8)));
+	}
+}
+
+static void KpmPutU64(std::string& out, std::uint64_t value)
+{
+	for(int i = 0; i < 8; i++)
+	{
+		out.push_back(static_cast<char>(value >> (i * 8)));
+	}
+}
+
+static void KpmPutVarint(std::string& out, std::uint64_t value)
+{
+	while(value >= 0x80)
+	{
+		out.push_back(static_cast<char>((value & 0x7f) | 0x80));
+		value >>= 7;
+	}
+	out.push_back(static_cast<char>(value));
+}
+
+static std::uint64_t KpmGetLE(const std::uint8_t* data, int bytes)
+{
+	std::uint64_t value = 0;
+	for(int i = 0; i < bytes; i++)
+	{
+		value |= std::uint64_t(data[i]) << (i * 8);
+	}
+	return value;
+}
+
+static bool KpmGetVarint(const std::uint8_t* data, std::size_t end, std::size_t& offset, std::uint64_t& value)
+{
+	value = 0;
+	for(int shift = 0; shift < 64 && offset < end; shift += 7)
+	{
+		std::uint8_t byte = data[offset++];
+		value |= std::uint64_t(byte & 0x7f) << shift;
+		if(!(byte & 0x80))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+KpmManifestEntry& KpmManifestWriter::add(std::string path, KpmManifestType type)
+{
+	KpmManifestEntry& entry = _entries.emplace_back();
+	entry.path = std::move(path);
+	entry.type = type;
+	return entry;
+}
+
+KpmManifestEntry& KpmManifestWriter::add(KpmManifestEntry entry)
+{
+	return _entries.emplace_back(std::move(entry));
+}
+
+bool KpmManifestWriter::write(const std::string& file)
+{
+	std::vector<const KpmManifestEntry*> sorted;
+	sorted.reserve(_entries.size());
+	for(const auto& entry : _entries)
+	{
+		sorted.push_back(&entry);
+	}
+
+	// Stable, so that of repeated paths the last one written wins
+	std::stable_sort(sorted.begin(), sorted.end(), [](const KpmManifestEntry* a, const KpmManifestEntry* b) {
+		return a->path < b->path;
+	});
+	auto last = std::unique(sorted.rbegin(), sorted.rend(), [](const KpmManifestEntry* a, const KpmManifestEntry* b) {
+		return a->path == b->path;
+	});
+	sorted.erase(sorted.begin(), last.base());
+
+	std::string out(KPM_MANIFEST_HEADER_SIZE, '\0');
+	std::vector<std::uint32_t> restarts;
+	std::string_view previous;
+
+	for(std::size_t i = 0; i < sorted.size(); i++)
+	{
+		const KpmManifestEntry& entry = *sorted[i];
+
+		std::size_t shared = 0;
+		if(i % KPM_MANIFEST_RESTART_INTERVAL == 0)
+		{
+			restarts.push_back(static_cast<std::uint32_t>(out.size()));
+		}
+		else
+		{
+			std::size_t limit = std::min(previous.size(), entry.path.size());
+			while(shared < limit && previous[shared] == entry.path[shared])
+			{
+				shared++;
+			}
+		}
+
+		KpmPutVarint(out, shared);
+		KpmPutVarint(out, entry.path.size() - shared);
+		out.append(entry.path, shared);
+		out.push_back(static_cast<char>(entry.type));
+		out.push_back(static_cast<char>(entry.hashed ? KPM_MANIFEST_FLAG_HASHED : 0));
+		KpmPutVarint(out, entry.mode);
+		KpmPutVarint(out, entry.size);
+		KpmPutVarint(out, (static_cast<std::uint64_t>(entry.mtime) << 1) ^ static_cast<std::uint64_t>(entry.mtime >> 63));
+		if(entry.hashed)
+		{
+			out.append(reinterpret_cast<const char*>(entry.hash.data()), entry.hash.size());
+		}
+
+		previous = entry.path;
+	}
+
+	std::uint64_t restart_table = out.size();
+	for(std::uint32_t offset : restarts)
+	{
+		KpmPutU32(out, offset);
+	}
+
+	if(out.size() > UINT32_MAX)
+	{
+		KpmLogError("Manifest file {} is too large.", file);
+		return false;
+	}
+
+	std::string header(KPM_MANIFEST_MAGIC, sizeof(KPM_MANIFEST_MAGIC));
+	KpmPutU32(header, KPM_MANIFEST_VERSION);
+	KpmPutU32(header, static_cast<std::uint32_t>(sorted.size()));
+	KpmPutU32(header, KPM_MANIFEST_RESTART_INTERVAL);
+	KpmPutU32(header, static_cast<std::uint32_t>(restarts.size()));
+	KpmPutU64(header, restart_table);
+	out.replace(0, KPM_MANIFEST_HEADER_SIZE, header);
+
+	// Written next to the old manifest and renamed over it, a crash leaves either one intact
+	std::string temp = file + ".tmp";
+	{
+		std::ofstream handle(temp, std::ios::binary | std::ios::trunc);
+		if(!handle.is_open() || !handle.write(out.data(), out.size()))
+		{
+			KpmLogError("Failed to write manifest file {}.", file);
+			return false;
+		}
+	}
+
+	std::error_code ec;
+	std::filesystem::rename(temp, file, ec);
+	if(ec)
+	{
+		KpmLogError("Failed to write manifest file {}: {}", file, ec.message());
+		std::filesystem::remove(temp, ec);
+		return false;
+	}
+	return true;
+}
+
+KpmManifestEntry KpmManifestStatPath(const std::string& path, bool hash)
+{
+	KpmManifestEntry entry;
+	entry.path = path;
+
+	std::error_code ec;
+	std::filesystem::file_status status = std::filesystem::symlink_status(path, ec);
+	if(ec)
+	{
+		return entry;
+	}
+
+	switch(status.type())
+	{
+		case std::filesystem::file_type::regular:   entry.type = KpmManifestType::FILE; break;
+		case std::filesystem::file_type::directory: entry.type = KpmManifestType::DIRECTORY; break;
+		case std::filesystem::file_type::symlink:   entry.type = KpmManifestType::SYMLINK; break;
+		default: break;
+	}
+
+	entry.mode = static_cast<std::uint32_t>(status.permissions()) & 07777;
+	if(entry.type == KpmManifestType::FILE)
+	{
+		entry.size = std::filesystem::file_size(path, ec);
+	}
+	else if(entry.type == KpmManifestType::SYMLINK)
+	{
+		entry.size = std::filesystem::read_symlink(path, ec).string().size();
+	}
+
+	if(entry.type != KpmManifestType::SYMLINK)
+	{
+		auto time = std::filesystem::last_write_time(path, ec);
+		if(!ec)
+		{
+			entry.mtime = std::chrono::duration_cast<std::chrono::seconds>(
+				std::chrono::file_clock::to_sys(time).time_since_epoch()).count();
+		}
+	}
+
+	if(hash && entry.type == KpmManifestType::FILE)
+	{
+		KpmMappedFile file(path);
+		if(file.is_open())
+		{
+			KpmSha256 sha;
+			sha.update(file.data(), file.size());
+			entry.hash = sha.digest();
+			entry.hashed = true;
+		}
+	}
+	return entry;
+}
+
+// Older kpm versions wrote one path per line. The metadata is recovered from the disk as it is now,
+// without hashes since the files may have changed since they were installed.
+static bool KpmManifestMigrateText(const std::string& file)
+{
+	std::ifstream handle(file);
+	if(!handle.is_open())
+	{
+		return false;
+	}
+
+	KpmLogInfo("Migrating manifest file {} to the binary format.", file);
+
+	KpmManifestWriter writer;
+	std::string line;
+	while(std::getline(handle, line))
+	{
+		if(!line.empty())
+		{
+			writer.add(KpmManifestStatPath(line, false));
+		}
+	}
+	handle.close();
+
+	return writer.write(file);
+}
+
+std::optional<KpmManifest> KpmManifest::Open(const std::string& file)
+{
+	KpmManifest manifest;
+	manifest._file = KpmMappedFile(file);
+	if(!manifest._file.is_open())
+	{
+		return std::nullopt;
+	}
+
+	const bool binary = manifest._file.size() >= sizeof(KPM_MANIFEST_MAGIC)
+		&& std::memcmp(manifest._file.data(), KPM_MANIFEST_MAGIC, sizeof(KPM_MANIFEST_MAGIC)) == 0;
+
+	if(!binary)
+	{
+		manifest._file = KpmMappedFile();
+		if(!KpmManifestMigrateText(file))
+		{
+			return std::nullopt;
+		}
+		manifest._file = KpmMappedFile(file);
+	}
+
+	if(!manifest.load())
+	{
+		KpmLogError("Manifest file {} is corrupt.", file);
+		return std::nullopt;
+	}
+	return manifest;
+}
+
+bool KpmManifest::load()
+{
+	const std::uint8_t* data = _file.data();
+	const std::size_t size = _file.size();
+	if(!data || size < KPM_MANIFEST_HEADER_SIZE || std::memcmp(data, KPM_MANIFEST_MAGIC, sizeof(KPM_MANIFEST_MAGIC)) != 0)
+	{
+		return false;
+	}
+
+	if(KpmGetLE(data + 8, 4) != KPM_MANIFEST_VERSION)
+	{
+		KpmLogError("Unsupported manifest version {}.", KpmGetLE(data + 8, 4));
+		return false;
+	}
+
+	_count = KpmGetLE(data + 12, 4);
+	_interval = KpmGetLE(data + 16, 4);
+	_restarts = KpmGetLE(data + 20, 4);
+	_restart_table = KpmGetLE(data + 24, 8);
+
+	return _interval > 0
+		&& _restarts == (_count + _interval - 1) / _interval
+		&& _restart_table >= KPM_MANIFEST_HEADER_SIZE
+		&& _restart_table <= size
+		&& (size - _restart_table) / 4 >= _restarts;
+}
+
+std::size_t KpmManifest::restart(std::size_t index) const
+{
+	return KpmGetLE(_file.data() + _restart_table + index * 4, 4);
+}
+
+// Decodes the record at offset on top of the previous entry (its path is the prefix base)
+bool KpmManifest::decode(std::size_t& offset, KpmManifestEntry& entry) const
+{
+	const std::uint8_t* data = _file.data();
+	const std::size_t end = _restart_table;
+
+	std::uint64_t shared, suffix, mode, size, mtime;
+	if(!KpmGetVarint(data, end, offset, shared) || !KpmGetVarint(data, end, offset, suffix)
+		|| shared > entry.path.size() || suffix > end - offset)
+	{
+		return false;
+	}
+
+	entry.path.resize(shared);
+	entry.path.append(reinterpret_cast<const char*>(data + offset), suffix);
+	offset += suffix;
+
+	if(end - offset < 2)
+	{
+		return false;
+	}
+	entry.type = static_cast<KpmManifestType>(data[offset]);
+	entry.hashed = data[offset + 1] & KPM_MANIFEST_FLAG_HASHED;
+	offset += 2;
+
+	if(!KpmGetVarint(data, end, offset, mode) || !KpmGetVarint(data, end, offset, size) || !KpmGetVarint(data, end, offset, mtime))
+	{
+		return false;
+	}
+	entry.mode = static_cast<std::uint32_t>(mode);
+	entry.size = size;
+	entry.mtime = static_cast<std::int64_t>(mtime >> 1) ^ -static_cast<std::int64_t>(mtime & 1);
+
+	entry.hash = {};
+	if(entry.hashed)
+	{
+		if(end - offset < entry.hash.size())
+		{
+			return false;
+		}
+		std::memcpy(entry.hash.data(), data + offset, entry.hash.size());
+		offset += entry.hash.size();
+	}
+	return true;
+}
+
+std::optional<KpmManifestEntry> KpmManifest::find(std::string_view path) const
+{
+	if(_count == 0)
+	{
+		return std::nullopt;
+	}
+
+	// Restart records hold their full path, binary search the last one not after path
+	std::size_t low = 0;
+	std::size_t high = _restarts;
+	KpmManifestEntry entry;
+	while(high - low > 1)
+	{
+		std::size_t mid = low + (high - low) / 2;
+		std::size_t offset = restart(mid);
+		entry.path.clear();
+		if(!decode(offset, entry))
+		{
+			return std::nullopt;
+		}
+
+		if(std::string_view(entry.path) <= path)
+		{
+			low = mid;
+		}
+		else
+		{
+			high = mid;
+		}
+	}
+
+	std::size_t offset = restart(low);
+	std::size_t remaining = std::min(_interval, _count - low * _interval);
+	entry.path.clear();
+	for(std::size_t i = 0; i < remaining; i++)
+	{
+		if(!decode(offset, entry))
+		{
+			return std::nullopt;
+		}
+
+		int order = std::string_view(entry.path).compare(path);
+		if(order == 0)
+		{
+			return entry;
+		}
+		if(order > 0)
+		{
+			break;
+		}
+	}
+	return std::nullopt;
+}
+
+bool KpmManifest::for_each(const std::function<bool(const KpmManifestEntry&)>& fn) const
+{
+	std::size_t offset = KPM_MANIFEST_HEADER_SIZE;
+	KpmManifestEntry entry;
+	for(std::size_t i = 0; i < _count; i++)
+	{
+		if(!decode(offset, entry))
+		{
+			return false;
+		}
+
+		if(!fn(entry))
+		{
+			break;
+		}
+	}
+	return true;
+}
+
+std::vector<KpmManifestEntry> KpmManifest::dropped(const KpmManifestWriter& current) const
+{
+	std::unordered_set<std::string_view> paths;
+	for(const auto& entry : current.entries())
+	{
+		paths.insert(entry.path);
+	}
+
+	std::vector<KpmManifestEntry> entries;
+	for_each([&paths, &entries](const KpmManifestEntry& entry) {
+		if(!paths.contains(entry.path))
+		{
+			entries.push_back(entry);
+		}
+		return true;
+	});
+	return entries;
+}
@@ -0,0 +1,193 @@
+#include "../kpm_mmap.h"
+
+#include <algorithm>
+#include <utility>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+KpmMappedFile::KpmMappedFile(const std::string& path)
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if(file == INVALID_HANDLE_VALUE)
+	{
+		return;
+	}
+
+	LARGE_INTEGER size;
+	if(GetFileSizeEx(file, &size))
+	{
+		_size = static_cast<std::size_t>(size.QuadPart);
+		_open = true;
+
+		// Empty files can't be mapped, there is nothing to read anyway
+		if(_size > 0)
+		{
+			_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			_data = _mapping ? static_cast<const std::uint8_t*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+			_open = _data != nullptr;
+		}
+	}
+	CloseHandle(file);
+
+	if(!_open)
+	{
+		close();
+	}
+#else
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+	{
+		return;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) == 0)
+	{
+		_size = static_cast<std::size_t>(st.st_size);
+		_open = true;
+
+		// Empty files can't be mapped, there is nothing to read anyway
+		if(_size > 0)
+		{
+			void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(data != MAP_FAILED)
+			{
+				madvise(data, _size, MADV_SEQUENTIAL);
+				_data = static_cast<const std::uint8_t*>(data);
+			}
+			_open = _data != nullptr;
+		}
+	}
+	::close(fd);
+
+	if(!_open)
+	{
+		_size = 0;
+	}
+#endif
+}
+
+KpmMappedFile KpmMappedFile::Writable(const std::string& path, std::size_t size)
+{
+	KpmMappedFile mapped;
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if(file == INVALID_HANDLE_VALUE)
+	{
+		return mapped;
+	}
+
+	LARGE_INTEGER current;
+	if(GetFileSizeEx(file, &current))
+	{
+		// Mappings larger than the file grow it
+		const std::uint64_t length = std::max<std::uint64_t>(static_cast<std::uint64_t>(current.QuadPart), size);
+		if(length > 0)
+		{
+			mapped._mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(length >> 32), static_cast<DWORD>(length), nullptr);
+			mapped._data = mapped._mapping ? static_cast<const std::uint8_t*>(MapViewOfFile(mapped._mapping, FILE_MAP_WRITE, 0, 0, 0)) : nullptr;
+		}
+		mapped._size = static_cast<std::size_t>(length);
+		mapped._open = mapped._data != nullptr;
+	}
+	CloseHandle(file);
+#else
+	int fd = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+	if(fd < 0)
+	{
+		return mapped;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) == 0 && (static_cast<std::size_t>(st.st_size) >= size || ftruncate(fd, static_cast<off_t>(size)) == 0))
+	{
+		const std::size_t length = std::max(static_cast<std::size_t>(st.st_size), size);
+		void* data = length > 0 ? mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+		if(data != MAP_FAILED)
+		{
+			mapped._data = static_cast<const std::uint8_t*>(data);
+			mapped._size = length;
+			mapped._open = true;
+		}
+	}
+	::close(fd);
+#endif
+
+	if(!mapped._open)
+	{
+		mapped.close();
+	}
+	mapped._writable = mapped._open;
+	return mapped;
+}
+
+bool KpmMappedFile::flush() const
+{
+	if(!_writable)
+	{
+		return true;
+	}
+#ifdef _WIN32
+	return FlushViewOfFile(_data, 0) != 0;
+#else
+	return msync(const_cast<std::uint8_t*>(_data), _size, MS_SYNC) == 0;
+#endif
+}
+
+KpmMappedFile::~KpmMappedFile()
+{
+	close();
+}
+
+KpmMappedFile::KpmMappedFile(KpmMappedFile&& other) noexcept
+{
+	*this = std::move(other);
+}
+
+KpmMappedFile& KpmMappedFile::operator=(KpmMappedFile&& other) noexcept
+{
+	if(this != &other)
+	{
+		close();
+		_data = std::exchange(other._data, nullptr);
+		_size = std::exchange(other._size, 0);
+		_open = std::exchange(other._open, false);
+		_writable = std::exchange(other._writable, false);
+#ifdef _WIN32
+		_mapping = std::exchange(other._mapping, nullptr);
+#endif
+	}
+	return *this;
+}
+
+void KpmMappedFile::close()
+{
+#ifdef _WIN32
+	if(_data)
+	{
+		UnmapViewOfFile(_data);
+	}
+	if(_mapping)
+	{
+		CloseHandle(_mapping);
+	}
+	_mapping = nullptr;
+#else
+	if(_data)
+	{
+		munmap(const_cast<std::uint8_t*>(_data), _size);
+	}
+#endif
+	_data = nullptr;
+	_size = 0;
+	_open = false;
+	_writable = false;
+}
@@ -0,0 +1,337 @@
+#include "../kpm.h"
+#include "../kpm_objects.h"
+#include "logger.inl"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const char KPM_OBJECTS_SEPARATOR = static_cast<char>(std::filesystem::path::preferred_separator);
+
+// Cleared once a reflink is refused, the filesystems of the cache and the prefix don't change during a run
+static std::atomic<bool> _kpm_objects_reflink = true;
+
+static std::string KpmObjectsPath()
+{
+	return KpmGetCachePath() + "objects" + KPM_OBJECTS_SEPARATOR;
+}
+
+static std::string KpmObjectsRefsPath()
+{
+	return KpmObjectsPath() + "refs" + KPM_OBJECTS_SEPARATOR;
+}
+
+static std::string KpmObjectPath(const std::string& name)
+{
+	return KpmObjectsPath() + name;
+}
+
+static std::string KpmObjectsTempName()
+{
+	static thread_local std::mt19937_64 rng(std::random_device{}());
+	return "tmp-" + std::to_string(rng());
+}
+
+std::string KpmObjectName(const std::array<std::uint8_t, 32>& hash, std::uint32_t mode, std::int64_t mtime)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string name;
+	name.reserve(64 + 24);
+	for(std::uint8_t byte : hash)
+	{
+		name.push_back(digits[byte >> 4]);
+		name.push_back(digits[byte & 0xF]);
+	}
+
+	char suffix[32];
+	std::snprintf(suffix, sizeof(suffix), "-%o-%lld", static_cast<unsigned>(mode & 07777), static_cast<long long>(mtime));
+	return name + suffix;
+}
+
+// Reflink of source with its mode and times at destination, which must not exist yet
+static bool KpmObjectReflink(const std::string& source, const std::string& destination)
+{
+#ifdef __linux__
+	if(!_kpm_objects_reflink)
+	{
+		return false;
+	}
+
+	int in = ::open(source.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if(in < 0)
+	{
+		return false;
+	}
+
+	struct stat st;
+	int out = fstat(in, &st) == 0 ? ::open(destination.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600) : -1;
+	bool ok = false;
+	if(out >= 0)
+	{
+		if(ioctl(out, FICLONE, in) == 0)
+		{
+			const struct timespec times[2] = { st.st_atim, st.st_mtim };
+			ok = fchmod(out, st.st_mode & 07777) == 0 && futimens(out, times) == 0;
+		}
+		else if(errno == EOPNOTSUPP || errno == EXDEV || errno == EINVAL || errno == ENOTTY)
+		{
+			KpmLogTrace("Reflinks are not supported here, using hard links.");
+			_kpm_objects_reflink = false;
+		}
+
+		::close(out);
+		if(!ok)
+		{
+			::unlink(destination.c_str());
+		}
+	}
+	::close(in);
+	return ok;
+#else
+	return false;
+#endif
+}
+
+// Whether object still has the mode and mtime its name was made from.
+// Hard linked files share the inode of their object, a chmod or a write through one of them
+// (post install steps, the user) changes the object and every other file linked to it.
+static bool KpmObjectIntact(const std::string& object, const std::string& name)
+{
+#ifdef __linux__
+	struct stat st;
+	if(::lstat(object.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		return false;
+	}
+
+	// <sha256>-<mode>-<mtime>
+	const std::size_t dash = name.find('-');
+	const std::size_t second = name.find('-', dash + 1);
+	if(dash == std::string::npos || second == std::string::npos)
+	{
+		return false;
+	}
+
+	const unsigned long mode = std::strtoul(name.c_str() + dash + 1, nullptr, 8);
+	const long long mtime = std::strtoll(name.c_str() + second + 1, nullptr, 10);
+	if((st.st_mode & 07777) == mode && st.st_mtim.tv_sec == mtime)
+	{
+		return true;
+	}
+
+	KpmLogWarning("Object {} was changed through one of its {} links, adding it again.", name, st.st_nlink);
+	return false;
+#else
+	return true;
+#endif
+}
+
+bool KpmObjectLink(const std::string& name, const std::string& path)
+{
+	const std::string object = KpmObjectPath(name);
+	const std::string temp = path + ".kpm-object";
+
+	std::error_code ec;
+	if(!KpmObjectIntact(object, name))
+	{
+		// Files still linked to it keep their (changed) content, the caller writes path and adopts it again
+		std::filesystem::remove(object, ec);
+		return false;
+	}
+
+	if(!KpmObjectReflink(object, temp))
+	{
+		std::filesystem::create_hard_link(object, temp, ec);
+		if(ec)
+		{
+			return false;
+		}
+	}
+
+	// Whatever was at path (an older version, a link to another object) is replaced in one step
+	std::filesystem::rename(temp, path, ec);
+	if(ec)
+	{
+		KpmLogWarning("Failed to link {}: {}", path, ec.message());
+		std::filesystem::remove(temp, ec);
+		return false;
+	}
+	return true;
+}
+
+bool KpmObjectAdopt(const std::string& path, const std::string& name)
+{
+	static std::atomic<bool> created = false;
+	std::error_code ec;
+	if(!created)
+	{
+		std::filesystem::create_directories(KpmObjectsRefsPath(), ec);
+		created = !ec;
+	}
+
+	const std::string object = KpmObjectPath(name);
+	const std::string temp = KpmObjectsPath() + KpmObjectsTempName();
+	if(KpmObjectReflink(path, temp))
+	{
+		std::filesystem::rename(temp, object, ec);
+		if(ec)
+		{
+			std::filesystem::remove(temp, ec);
+			return false;
+		}
+		return true;
+	}
+
+	// Another install may have added the same object meanwhile, either one will do
+	std::filesystem::create_hard_link(path, object, ec);
+	return !ec || ec == std::errc::file_exists;
+}
+
+bool KpmObjectExists(const std::string& name)
+{
+	std::error_code ec;
+	return std::filesystem::is_regular_file(KpmObjectPath(name), ec);
+}
+
+static std::vector<std::string> KpmObjectsReadRefs(const std::string& file)
+{
+	std::vector<std::string> names;
+	std::ifstream handle(file);
+	for(std::string line; std::getline(handle, line);)
+	{
+		// Only ever names written by KpmObjectsReference, nothing that leaves the objects directory
+		if(!line.empty() && line.find_first_of("/\\") == std::string::npos && !line.starts_with('.'))
+		{
+			names.push_back(std::move(line));
+		}
+	}
+	return names;
+}
+
+// Number of packages referring to each object
+static std::unordered_map<std::string, std::size_t> KpmObjectsCount()
+{
+	std::unordered_map<std::string, std::size_t> counts;
+	std::error_code ec;
+	for(const auto& item : std::filesystem::directory_iterator(KpmObjectsRefsPath(), ec))
+	{
+		if(item.path().filename().string().starts_with("tmp-"))
+		{
+			continue;
+		}
+
+		for(auto& name : KpmObjectsReadRefs(item.path().string()))
+		{
+			counts[std::move(name)]++;
+		}
+	}
+	return counts;
+}
+
+bool KpmObjectsReference(const std::string& package, const std::vector<std::string>& names)
+{
+	const std::string file = KpmObjectsRefsPath() + package;
+	std::error_code ec;
+	if(names.empty() && !std::filesystem::exists(file, ec))
+	{
+		return true;
+	}
+
+	const std::unordered_set<std::string> current(names.begin(), names.end());
+	std::vector<std::string> released;
+	for(auto& name : KpmObjectsReadRefs(file))
+	{
+		if(!current.contains(name))
+		{
+			released.push_back(std::move(name));
+		}
+	}
+
+	if(current.empty())
+	{
+		std::filesystem::remove(file, ec);
+	}
+	else
+	{
+		std::filesystem::create_directories(KpmObjectsRefsPath(), ec);
+		const std::string temp = KpmObjectsRefsPath() + KpmObjectsTempName();
+		{
+			std::ofstream handle(temp, std::ios::trunc);
+			for(const auto& name : current)
+			{
+				handle << name << '\n';
+			}
+
+			if(!handle.flush())
+			{
+				KpmLogError("Failed to write object references of package {}.", package);
+				handle.close();
+				std::filesystem::remove(temp, ec);
+				return false;
+			}
+		}
+		std::filesystem::rename(temp, file, ec);
+	}
+
+	if(ec)
+	{
+		KpmLogError("Failed to update object references of package {}: {}", package, ec.message());
+		return false;
+	}
+
+	if(released.empty())
+	{
+		return true;
+	}
+
+	// Counted after this package's list changed, so only what nobody else refers to goes
+	const std::unordered_map<std::string, std::size_t> counts = KpmObjectsCount();
+	std::size_t removed = 0;
+	for(const auto& name : released)
+	{
+		if(!counts.contains(name) && std::filesystem::remove(KpmObjectPath(name), ec))
+		{
+			removed++;
+		}
+	}
+
+	KpmLogTrace("Released {} objects of package {}, {} deleted.", released.size(), package, removed);
+	return true;
+}
+
+std::size_t KpmObjectsPrune()
+{
+	const std::unordered_map<std::string, std::size_t> counts = KpmObjectsCount();
+
+	// Collected first, removing while iterating is unspecified
+	std::vector<std::filesystem::path> unused;
+	std::error_code ec;
+	for(const auto& item : std::filesystem::directory_iterator(KpmObjectsPath(), ec))
+	{
+		if(item.is_regular_file(ec) && !counts.contains(item.path().filename().string()))
+		{
+			unused.push_back(item.path());
+		}
+	}
+
+	std::size_t removed = 0;
+	for(const auto& path : unused)
+	{
+		removed += std::filesystem::remove(path, ec) ? 1 : 0;
+	}
+	return removed;
+}
@@ -0,0 +1,673 @@
+#include "../kpm.h"
+#include "../kpm_owners.h"
+#include "logger.inl"
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <share.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <unistd.h>
+#endif
+
+static constexpr char KPM_OWNERS_MAGIC[8] = { 'K', 'P', 'M', 'O', 'W', 'N', 'R', 'S' };
+static constexpr std::uint32_t KPM_OWNERS_VERSION = 2;
+static constexpr std::size_t KPM_OWNERS_HEADER_SIZE = 64;
+static constexpr std::size_t KPM_OWNERS_SLOT_SIZE = 24;
+static constexpr std::size_t KPM_OWNERS_PACKAGE_SIZE = 8;
+static constexpr std::size_t KPM_OWNERS_SLOTS_MIN = 64;
+static constexpr std::size_t KPM_OWNERS_PACKAGES_MIN = 16;
+
+// Package of a slot whose path was owned once, probes go on past it and the path can be owned again in place
+static constexpr std::uint32_t KPM_OWNERS_TOMBSTONE = UINT32_MAX;
+
+static std::uint64_t KpmOwnersHash(std::string_view path)
+{
+	// FNV-1a
+	std::uint64_t hash = 0xcbf29ce484222325ull;
+	for(char c : path)
+	{
+		hash ^= static_cast<std::uint8_t>(c);
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+static std::uint64_t KpmOwnersGet(const std::uint8_t* data, int bytes)
+{
+	std::uint64_t value = 0;
+	for(int i = 0; i < bytes; i++)
+	{
+		value |= std::uint64_t(data[i]) << (i * 8);
+	}
+	return value;
+}
+
+static void KpmOwnersSet(std::uint8_t* data, std::uint64_t value, int bytes)
+{
+	for(int i = 0; i < bytes; i++)
+	{
+		data[i] = static_cast<std::uint8_t>(value >> (i * 8));
+	}
+}
+
+static void KpmOwnersPut(std::string& out, std::size_t offset, std::uint64_t value, int bytes)
+{
+	KpmOwnersSet(reinterpret_cast<std::uint8_t*>(out.data() + offset), value, bytes);
+}
+
+KpmOwnersLock::KpmOwnersLock(const std::string& file, bool exclusive)
+{
+	const std::string lock = file + ".lock";
+#ifdef _WIN32
+	// Readers only keep writers out, a writer keeps everyone out
+	while(true)
+	{
+		errno_t error = exclusive
+			? _sopen_s(&_fd, lock.c_str(), _O_RDWR | _O_CREAT | _O_BINARY, _SH_DENYRW, _S_IREAD | _S_IWRITE)
+			: _sopen_s(&_fd, lock.c_str(), _O_RDONLY | _O_CREAT | _O_BINARY, _SH_DENYWR, _S_IREAD | _S_IWRITE);
+		if(error != EACCES)
+		{
+			break;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+#else
+	_fd = ::open(lock.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if(_fd < 0 && !exclusive)
+	{
+		// Someone else's cache, reading it still works
+		_fd = ::open(lock.c_str(), O_RDONLY | O_CLOEXEC);
+	}
+
+	while(_fd >= 0 && flock(_fd, exclusive ? LOCK_EX : LOCK_SH) != 0)
+	{
+		if(errno != EINTR)
+		{
+			release();
+		}
+	}
+#endif
+	if(_fd < 0)
+	{
+		KpmLogError("Failed to lock ownership database {}.", file);
+	}
+}
+
+KpmOwnersLock::~KpmOwnersLock()
+{
+	release();
+}
+
+KpmOwnersLock::KpmOwnersLock(KpmOwnersLock&& other) noexcept : _fd(std::exchange(other._fd, -1))
+{
+}
+
+KpmOwnersLock& KpmOwnersLock::operator=(KpmOwnersLock&& other) noexcept
+{
+	if(this != &other)
+	{
+		release();
+		_fd = std::exchange(other._fd, -1);
+	}
+	return *this;
+}
+
+void KpmOwnersLock::release()
+{
+	if(_fd >= 0)
+	{
+#ifdef _WIN32
+		_close(_fd);
+#else
+		::close(_fd);
+#endif
+	}
+	_fd = -1;
+}
+
+std::string KpmGetOwnersPath()
+{
+	return KpmGetCachePath() + "owners.db";
+}
+
+std::optional<KpmOwners> KpmOwners::Open(const std::string& file)
+{
+	KpmOwners owners;
+	std::error_code ec;
+	if(!std::filesystem::exists(file, ec))
+	{
+		return owners;
+	}
+
+	owners._lock = KpmOwnersLock(file, false);
+	if(!owners._lock.is_locked())
+	{
+		return std::nullopt;
+	}
+
+	owners._file = KpmMappedFile(file);
+	if(!owners._file.is_open() || !owners.load())
+	{
+		KpmLogError("Failed to read ownership database {}.", file);
+		return std::nullopt;
+	}
+	return owners;
+}
+
+bool KpmOwners::load()
+{
+	const std::uint8_t* data = _file.data();
+	const std::size_t size = _file.size();
+	if(!data || size < KPM_OWNERS_HEADER_SIZE || std::memcmp(data, KPM_OWNERS_MAGIC, sizeof(KPM_OWNERS_MAGIC)) != 0
+		|| KpmOwnersGet(data + 8, 4) != KPM_OWNERS_VERSION)
+	{
+		return false;
+	}
+
+	_packages = KpmOwnersGet(data + 12, 4);
+	_slots = KpmOwnersGet(data + 16, 8);
+	_count = KpmOwnersGet(data + 24, 8);
+	_used = KpmOwnersGet(data + 32, 8);
+	_capacity = KpmOwnersGet(data + 40, 8);
+	_heap_size = KpmOwnersGet(data + 48, 8);
+	_dirty = KpmOwnersGet(data + 56, 4) != 0;
+
+	if(_slots == 0 || (_slots & (_slots - 1)) != 0 || _count > _used || _used >= _slots || _packages > _capacity
+		|| _slots > (size - KPM_OWNERS_HEADER_SIZE) / KPM_OWNERS_SLOT_SIZE || _capacity >= UINT32_MAX)
+	{
+		return false;
+	}
+
+	_package_table = KPM_OWNERS_HEADER_SIZE + _slots * KPM_OWNERS_SLOT_SIZE;
+	if(_capacity > (size - _package_table) / KPM_OWNERS_PACKAGE_SIZE)
+	{
+		return false;
+	}
+
+	_heap = _package_table + _capacity * KPM_OWNERS_PACKAGE_SIZE;
+	return _heap_size <= size - _heap;
+}
+
+std::string_view KpmOwners::string(std::size_t offset) const
+{
+	if(offset > _heap_size || _heap_size - offset < 4)
+	{
+		return {};
+	}
+
+	const std::uint8_t* data = _file.data() + _heap + offset;
+	std::size_t length = KpmOwnersGet(data, 4);
+	if(length > _heap_size - offset - 4)
+	{
+		return {};
+	}
+	return std::string_view(reinterpret_cast<const char*>(data + 4), length);
+}
+
+std::string_view KpmOwners::package_name(std::size_t index) const
+{
+	return string(KpmOwnersGet(_file.data() + _package_table + index * KPM_OWNERS_PACKAGE_SIZE, 4));
+}
+
+std::optional<std::string_view> KpmOwners::find(std::string_view path) const
+{
+	if(_count == 0)
+	{
+		return std::nullopt;
+	}
+
+	const std::uint64_t hash = KpmOwnersHash(path);
+	const std::uint8_t* slots = _file.data() + KPM_OWNERS_HEADER_SIZE;
+	for(std::size_t i = hash & (_slots - 1), probes = 0; probes < _slots; i = (i + 1) & (_slots - 1), probes++)
+	{
+		const std::uint8_t* slot = slots + i * KPM_OWNERS_SLOT_SIZE;
+		std::size_t package = KpmOwnersGet(slot + 12, 4);
+		if(package == 0)
+		{
+			break;
+		}
+
+		if(package <= _packages && KpmOwnersGet(slot, 8) == hash && string(KpmOwnersGet(slot + 8, 4)) == path)
+		{
+			return package_name(package - 1);
+		}
+	}
+	return std::nullopt;
+}
+
+bool KpmOwners::claim(std::string_view path, std::string_view package) const
+{
+	std::optional<std::string_view> owner = find(path);
+	if(!owner.has_value() || owner.value() == package)
+	{
+		return true;
+	}
+
+	if(KpmIsOverwrite())
+	{
+		KpmLogWarning("Overwriting {} owned by package {}.", path, owner.value());
+		return true;
+	}
+
+	KpmLogError("File {} conflicts with package {}.", path, owner.value());
+	KpmLogWarning("Use --overwrite to replace it anyway.");
+	return false;
+}
+
+bool KpmOwners::update(const std::string& package, const std::vector<std::string>& paths)
+{
+	std::uint8_t* data = _file.writable_data();
+	std::size_t strings = 4 + package.size();
+	for(const auto& path : paths)
+	{
+		strings += 4 + path.size();
+	}
+
+	// Every path may take a new slot and a new string
+	if(!data || _used + paths.size() > _slots / 2 || _heap_size + strings > UINT32_MAX || strings > _file.size() - _heap - _heap_size)
+	{
+		return false;
+	}
+
+	std::size_t index = 0;
+	for(std::size_t i = 0; i < _packages && index == 0; i++)
+	{
+		index = package_name(i) == package ? i + 1 : 0;
+	}
+
+	if(index == 0 && paths.empty())
+	{
+		return true;
+	}
+
+	if(index == 0 && _packages == _capacity)
+	{
+		return false;
+	}
+
+	auto slot = [data](std::size_t i) { return data + KPM_OWNERS_HEADER_SIZE + i * KPM_OWNERS_SLOT_SIZE; };
+	auto head = [this, data](std::size_t package) { return data + _package_table + (package - 1) * KPM_OWNERS_PACKAGE_SIZE + 4; };
+
+	// What the package owns now, a chain that doesn't add up (an interrupted update) means a rebuild
+	std::vector<std::size_t> previous;
+	for(std::size_t next = index != 0 ? KpmOwnersGet(head(index), 4) : 0; next != 0; next = KpmOwnersGet(slot(next - 1) + 20, 4))
+	{
+		if(next > _slots || previous.size() == _count || KpmOwnersGet(slot(next - 1) + 12, 4) != index)
+		{
+			return false;
+		}
+		previous.push_back(next - 1);
+	}
+
+	// Set until the update is complete, the next update rebuilds a database left marked from its slots.
+	// Slots change owner with a single store, they stay meaningful for lookups in between.
+	KpmOwnersSet(data + 56, 1, 4);
+	if(!_file.flush())
+	{
+		return false;
+	}
+
+	auto append = [this, data](std::string_view value) {
+		const std::size_t offset = _heap_size;
+		KpmOwnersSet(data + _heap + offset, value.size(), 4);
+		std::memcpy(data + _heap + offset + 4, value.data(), value.size());
+		_heap_size += 4 + value.size();
+		return offset;
+	};
+
+	auto link = [&slot, &head](std::size_t i, std::size_t package) {
+		const std::size_t first = KpmOwnersGet(head(package), 4);
+		KpmOwnersSet(slot(i) + 16, 0, 4);
+		KpmOwnersSet(slot(i) + 20, first, 4);
+		if(first != 0)
+		{
+			KpmOwnersSet(slot(first - 1) + 16, i + 1, 4);
+		}
+		KpmOwnersSet(head(package), i + 1, 4);
+	};
+
+	auto unlink = [this, &slot, &head](std::size_t i, std::size_t package) {
+		const std::size_t prev = KpmOwnersGet(slot(i) + 16, 4);
+		const std::size_t next = KpmOwnersGet(slot(i) + 20, 4);
+		if(prev == 0)
+		{
+			KpmOwnersSet(head(package), next, 4);
+		}
+		else if(prev <= _slots)
+		{
+			KpmOwnersSet(slot(prev - 1) + 20, next, 4);
+		}
+
+		if(next != 0 && next <= _slots)
+		{
+			KpmOwnersSet(slot(next - 1) + 16, prev, 4);
+		}
+	};
+
+	const std::unordered_set<std::string_view> kept(paths.begin(), paths.end());
+	for(std::size_t i : previous)
+	{
+		if(!kept.contains(string(KpmOwnersGet(slot(i) + 8, 4))))
+		{
+			unlink(i, index);
+			KpmOwnersSet(slot(i) + 12, KPM_OWNERS_TOMBSTONE, 4);
+			_count--;
+		}
+	}
+
+	if(index == 0)
+	{
+		index = ++_packages;
+		KpmOwnersSet(head(index) - 4, append(package), 4);
+		KpmOwnersSet(head(index), 0, 4);
+	}
+
+	for(const auto& path : paths)
+	{
+		const std::uint64_t hash = KpmOwnersHash(path);
+		std::size_t i = hash & (_slots - 1);
+		std::size_t found = SIZE_MAX;
+		std::size_t free = SIZE_MAX;
+		for(std::size_t owner; (owner = KpmOwnersGet(slot(i) + 12, 4)) != 0; i = (i + 1) & (_slots - 1))
+		{
+			if(KpmOwnersGet(slot(i), 8) == hash && string(KpmOwnersGet(slot(i) + 8, 4)) == path)
+			{
+				found = i;
+				break;
+			}
+
+			if(owner == KPM_OWNERS_TOMBSTONE && free == SIZE_MAX)
+			{
+				free = i;
+			}
+		}
+
+		// Owned before (by anyone, or by nobody anymore), the slot and its string are taken over
+		if(found != SIZE_MAX)
+		{
+			const std::size_t owner = KpmOwnersGet(slot(found) + 12, 4);
+			if(owner == index)
+			{
+				continue;
+			}
+
+			if(owner == KPM_OWNERS_TOMBSTONE || owner > _packages)
+			{
+				_count++;
+			}
+			else
+			{
+				unlink(found, owner);
+			}
+			link(found, index);
+			KpmOwnersSet(slot(found) + 12, index, 4);
+			continue;
+		}
+
+		if(free == SIZE_MAX)
+		{
+			free = i;
+			_used++;
+		}
+		KpmOwnersSet(slot(free), hash, 8);
+		KpmOwnersSet(slot(free) + 8, append(path), 4);
+		link(free, index);
+		KpmOwnersSet(slot(free) + 12, index, 4);
+		_count++;
+	}
+
+	KpmOwnersSet(data + 12, _packages, 4);
+	KpmOwnersSet(data + 24, _count, 8);
+	KpmOwnersSet(data + 32, _used, 8);
+	KpmOwnersSet(data + 48, _heap_size, 8);
+	_file.flush();
+
+	KpmOwnersSet(data + 56, 0, 4);
+	return true;
+}
+
+std::optional<std::string> KpmOwners::Build(const KpmOwners* current, const std::string& package, const std::vector<std::string>& paths)
+{
+	struct Owned
+	{
+		std::string_view path;
+		std::uint64_t hash;
+		std::uint32_t package;
+	};
+
+	// Views into the current mapping and into paths, everything is copied out before the file is replaced
+	std::vector<std::string_view> names;
+	std::vector<Owned> owned;
+	owned.reserve((current ? current->_count : 0) + paths.size());
+
+	const std::unordered_set<std::string_view> replaced(paths.begin(), paths.end());
+	std::vector<std::uint32_t> remap(current ? current->_packages : 0, UINT32_MAX);
+	for(std::size_t i = 0; current && i < current->_slots && current->_count > 0; i++)
+	{
+		const std::uint8_t* slot = current->_file.data() + KPM_OWNERS_HEADER_SIZE + i * KPM_OWNERS_SLOT_SIZE;
+		std::size_t index = KpmOwnersGet(slot + 12, 4);
+		if(index == 0 || index > current->_packages)
+		{
+			continue;
+		}
+
+		std::string_view owner = current->package_name(index - 1);
+		std::string_view path = current->string(KpmOwnersGet(slot + 8, 4));
+		if(owner == package || replaced.contains(path))
+		{
+			continue;
+		}
+
+		if(remap[index - 1] == UINT32_MAX)
+		{
+			remap[index - 1] = static_cast<std::uint32_t>(names.size());
+			names.push_back(owner);
+		}
+		owned.push_back({ path, KpmOwnersGet(slot, 8), remap[index - 1] });
+	}
+
+	if(!paths.empty())
+	{
+		names.push_back(package);
+	}
+	for(const auto& path : paths)
+	{
+		owned.push_back({ path, KpmOwnersHash(path), static_cast<std::uint32_t>(names.size() - 1) });
+	}
+
+	// Room for as many paths again before the next rebuild
+	std::size_t slots = KPM_OWNERS_SLOTS_MIN;
+	while(slots < owned.size() * 4)
+	{
+		slots *= 2;
+	}
+	const std::size_t capacity = std::max(KPM_OWNERS_PACKAGES_MIN, names.size() * 2);
+
+	const std::size_t package_table = KPM_OWNERS_HEADER_SIZE + slots * KPM_OWNERS_SLOT_SIZE;
+	const std::size_t heap = package_table + capacity * KPM_OWNERS_PACKAGE_SIZE;
+	std::string out(heap, '\0');
+
+	auto append = [&out, heap](std::string_view value) {
+		std::size_t offset = out.size() - heap;
+		out.append(4, '\0');
+		KpmOwnersPut(out, out.size() - 4, value.size(), 4);
+		out.append(value);
+		return offset;
+	};
+
+	for(std::size_t i = 0; i < names.size(); i++)
+	{
+		KpmOwnersPut(out, package_table + i * KPM_OWNERS_PACKAGE_SIZE, append(names[i]), 4);
+	}
+
+	// Slots are laid out in memory first, each one holds an index into owned plus one
+	std::vector<std::uint32_t> table(slots, 0);
+	for(std::size_t n = 0; n < owned.size(); n++)
+	{
+		std::size_t i = owned[n].hash & (slots - 1);
+		while(table[i] != 0 && owned[table[i] - 1].path != owned[n].path)
+		{
+			i = (i + 1) & (slots - 1);
+		}
+		// Repeated paths keep the last owner
+		table[i] = static_cast<std::uint32_t>(n + 1);
+	}
+
+	std::size_t count = 0;
+	for(std::size_t i = 0; i < slots; i++)
+	{
+		if(table[i] != 0)
+		{
+			const Owned& entry = owned[table[i] - 1];
+			const std::size_t slot = KPM_OWNERS_HEADER_SIZE + i * KPM_OWNERS_SLOT_SIZE;
+			const std::size_t head = package_table + entry.package * KPM_OWNERS_PACKAGE_SIZE + 4;
+			const std::size_t first = KpmOwnersGet(reinterpret_cast<const std::uint8_t*>(out.data() + head), 4);
+			KpmOwnersPut(out, slot, entry.hash, 8);
+			KpmOwnersPut(out, slot + 8, append(entry.path), 4);
+			KpmOwnersPut(out, slot + 12, entry.package + 1, 4);
+			KpmOwnersPut(out, slot + 20, first, 4);
+			if(first != 0)
+			{
+				KpmOwnersPut(out, KPM_OWNERS_HEADER_SIZE + (first - 1) * KPM_OWNERS_SLOT_SIZE + 16, i + 1, 4);
+			}
+			KpmOwnersPut(out, head, i + 1, 4);
+			count++;
+		}
+	}
+
+	if(out.size() - heap > UINT32_MAX)
+	{
+		return std::nullopt;
+	}
+
+	std::memcpy(out.data(), KPM_OWNERS_MAGIC, sizeof(KPM_OWNERS_MAGIC));
+	KpmOwnersPut(out, 8, KPM_OWNERS_VERSION, 4);
+	KpmOwnersPut(out, 12, names.size(), 4);
+	KpmOwnersPut(out, 16, slots, 8);
+	KpmOwnersPut(out, 24, count, 8);
+	KpmOwnersPut(out, 32, count, 8);
+	KpmOwnersPut(out, 40, capacity, 8);
+	KpmOwnersPut(out, 48, out.size() - heap, 8);
+	return out;
+}
+
+bool KpmOwners::Update(const std::string& file, const std::string& package, const std::vector<std::string>& paths)
+{
+	// Installs, removals, store activations and journal replays of other processes would otherwise
+	// change the database at the same time
+	KpmOwnersLock lock(file, true);
+	if(!lock.is_locked())
+	{
+		return false;
+	}
+
+	std::optional<KpmOwners> current;
+	std::error_code ec;
+	if(std::filesystem::exists(file, ec))
+	{
+		current = KpmOwners();
+		current->_file = KpmMappedFile::Writable(file, 0);
+		if(!current->_file.is_open() || !current->load())
+		{
+			KpmLogError("Failed to read ownership database {}.", file);
+			return false;
+		}
+
+		// New strings go at the end of the heap, the file grows by a quarter at least so that it rarely has to
+		std::size_t strings = 4 + package.size();
+		for(const auto& path : paths)
+		{
+			strings += 4 + path.size();
+		}
+
+		const std::size_t size = current->_file.size();
+		if(strings > size - current->_heap - current->_heap_size && !current->_dirty)
+		{
+			current->_file = KpmMappedFile();
+			current->_file = KpmMappedFile::Writable(file, std::max(current->_heap + current->_heap_size + strings, size + size / 4));
+			if(!current->_file.is_open() || !current->load())
+			{
+				KpmLogError("Failed to grow ownership database {}.", file);
+				return false;
+			}
+		}
+
+		if(!current->_dirty && current->update(package, paths))
+		{
+			return true;
+		}
+	}
+
+	KpmLogTrace("Rebuilding ownership database {}.", file);
+	std::optional<std::string> out = Build(current.has_value() ? &current.value() : nullptr, package, paths);
+	if(!out.has_value())
+	{
+		KpmLogError("Ownership database {} is too large.", file);
+		return false;
+	}
+
+	// Unmapped first, Windows can't replace a mapped file
+	current.reset();
+
+	std::string temp = file + ".tmp";
+	{
+		std::ofstream handle(temp, std::ios::binary | std::ios::trunc);
+		if(!handle.is_open() || !handle.write(out->data(), out->size()))
+		{
+			KpmLogError("Failed to write ownership database {}.", file);
+			return false;
+		}
+	}
+
+	std::filesystem::rename(temp, file, ec);
+	if(ec)
+	{
+		KpmLogError("Failed to write ownership database {}: {}", file, ec.message());
+		std::filesystem::remove(temp, ec);
+		return false;
+	}
+	return true;
+}
+
+bool KpmOwns(const std::string& path)
+{
+	std::optional<KpmOwners> owners = KpmOwners::Open(KpmGetOwnersPath());
+	if(!owners.has_value())
+	{
+		return false;
+	}
+
+	// Manifests hold the paths as they were installed, try the absolute path as well
+	std::optional<std::string_view> owner = owners->find(path);
+	if(!owner.has_value())
+	{
+		std::error_code ec;
+		std::filesystem::path absolute = std::filesystem::absolute(path, ec);
+		if(!ec)
+		{
+			owner = owners->find(absolute.lexically_normal().string());
+		}
+	}
+
+	if(!owner.has_value())
+	{
+		KpmLogInfo("{} is not owned by any package.", path);
+		return false;
+	}
+
+	KpmLogInfo("{} is owned by {}.", path, owner.value());
+	return true;
+}
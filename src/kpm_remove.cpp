@@ -1,107 +1,234 @@
 #include "../kpm.h"
 #include "../kpm_logger.h"
+#include "../kpm_manifest.h"
+#include "../kpm_objects.h"
+#include "../kpm_owners.h"
+#include "../kpm_store.h"
+#include "../kpm_uring.h"
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <filesystem>
 #include <fstream>
 #include <optional>
+#include <span>
+#include <thread>
 #include <vector>
 
 
-static std::optional<std::vector<std::string>> KpmReadManifest(const std::string& package)
+static std::optional<KpmManifest> KpmReadManifest(const std::string& package)
 {
 	std::string package_manifest_file = KpmGetCachePath() + package + ".manifest";
-	std::ifstream file(package_manifest_file);
 
 	KpmLogTrace("Reading manifest file: {}", package_manifest_file);
 
-	if(!file.is_open())
+	std::optional<KpmManifest> manifest = KpmManifest::Open(package_manifest_file);
+	if(!manifest.has_value())
 	{
 		KpmLogError("Failed to read manifest file.");
 		KpmLogWarning("Package {} may not be installed.", package);
-		return std::nullopt;
 	}
 
-	std::string line;
-	std::vector<std::string> files;
+	return manifest;
+}
+
+// Unlinking mostly waits on the filesystem, a few threads keep it busy
+constexpr unsigned KPM_REMOVE_THREADS_MIN = 4;
+constexpr unsigned KPM_REMOVE_THREADS_MAX = 8;
+constexpr std::size_t KPM_REMOVE_BATCH = 256;
 
-	while(std::getline(file, line))
+static std::size_t KpmRemovePathDepth(std::string_view path)
+{
+	while(path.size() > 1 && (path.back() == '/' || path.back() == '\\'))
 	{
-		files.push_back(line);
+		path.remove_suffix(1);
 	}
-
-	return files;
+	return std::count_if(path.begin(), path.end(), [](char c) { return c == '/' || c == '\\'; });
 }
 
-static std::tuple<std::vector<std::string>, std::vector<std::string>> KpmOrderFiles(const std::vector<std::string>& files)
+// The manifest records the type of every path, no need to stat them
+static std::optional<std::tuple<std::vector<std::string>, std::vector<std::string>>> KpmOrderFiles(const KpmManifest& manifest)
 {
 	std::vector<std::string> ofiles;
 	std::vector<std::string> odirs;
 
-	for(const auto& file : files)
-	{
-		if(std::filesystem::is_directory(file))
+	bool ok = manifest.for_each([&ofiles, &odirs](const KpmManifestEntry& entry) {
+		if(entry.type == KpmManifestType::DIRECTORY)
 		{
-			odirs.push_back(file);
+			odirs.push_back(entry.path);
 		}
 		else
 		{
-			ofiles.push_back(file);
+			ofiles.push_back(entry.path);
 		}
+		return true;
+	});
+
+	if(!ok)
+	{
+		KpmLogError("Failed to read manifest file.");
+		return std::nullopt;
 	}
 
-	return { ofiles, odirs };
+	return std::make_tuple(std::move(ofiles), std::move(odirs));
 }
 
-static bool KpmRemoveDirIsEmptyRecursive(const std::filesystem::path& path)
+static bool KpmRemoveFile(const std::string& file, bool missing_ok)
 {
-	for(const auto& entry : std::filesystem::directory_iterator(path))
+	KpmLogTrace("Removing file: {}", file);
+	std::error_code ec;
+	if(!std::filesystem::remove(file, ec))
 	{
-		if(std::filesystem::is_directory(entry))
+		if(ec)
 		{
-			if(!KpmRemoveDirIsEmptyRecursive(entry)) return false;
+			KpmLogError("Failed to remove file {}.", file);
+			return false;
 		}
-		else
+		if(!missing_ok)
 		{
-			return false;
+			KpmLogError("Failed to remove file {}. Does not exist.", file);
 		}
 	}
 	return true;
-};
+}
 
-static bool KpmRemoveFiles(const std::vector<std::string>& files)
+// One io_uring submission for the whole batch, result is what unlinkat returned
+static bool KpmRemoveFilesUring(KpmUring& ring, std::span<const std::string> files, bool missing_ok)
 {
-	auto [ofiles, odirs] = KpmOrderFiles(files);
+	std::vector<int> results(files.size());
+	ring.unlink(files, results);
+
 	bool ok = true;
-	for(const auto& file : ofiles)
+	for(std::size_t i = 0; i < files.size(); i++)
 	{
-		if(std::filesystem::exists(file))
+		KpmLogTrace("Removing file: {}", files[i]);
+		if(results[i] == -ENOENT)
 		{
-			KpmLogTrace("Removing file: {}", file);
-			if(!std::filesystem::remove(file))
+			if(!missing_ok)
 			{
-				KpmLogError("Failed to remove file {}.", file);
-				ok = false;
+				KpmLogError("Failed to remove file {}. Does not exist.", files[i]);
 			}
 		}
-		else
+		else if(results[i] < 0)
 		{
-			KpmLogError("Failed to remove file {}. Does not exist.", file);
+			// Whatever unlinkat refused (e.g. a directory in place of the file) gets the regular path
+			ok = KpmRemoveFile(files[i], missing_ok) && ok;
+		}
+	}
+	return ok;
+}
+
+// Threads take batches of the list, neighbouring files (same directory) mostly stay on one thread
+static bool KpmRemoveFilesParallel(const std::vector<std::string>& files, bool missing_ok)
+{
+	std::atomic<std::size_t> next = 0;
+	std::atomic<bool> ok = true;
+
+	auto worker = [&files, &next, &ok, missing_ok]() {
+		std::unique_ptr<KpmUring> ring = KpmIsIoUring() ? KpmUring::Create() : nullptr;
+		for(std::size_t begin = next.fetch_add(KPM_REMOVE_BATCH); begin < files.size(); begin = next.fetch_add(KPM_REMOVE_BATCH))
+		{
+			if(ring)
+			{
+				if(!KpmRemoveFilesUring(*ring, std::span(files).subspan(begin, std::min(KPM_REMOVE_BATCH, files.size() - begin)), missing_ok))
+				{
+					ok = false;
+				}
+				continue;
+			}
+
+			for(std::size_t i = begin; i < std::min(begin + KPM_REMOVE_BATCH, files.size()); i++)
+			{
+				if(!KpmRemoveFile(files[i], missing_ok))
+				{
+					ok = false;
+				}
+			}
+		}
+	};
+
+	const std::size_t batches = (files.size() + KPM_REMOVE_BATCH - 1) / KPM_REMOVE_BATCH;
+	const std::size_t threads = std::min<std::size_t>(std::clamp(std::thread::hardware_concurrency(), KPM_REMOVE_THREADS_MIN, KPM_REMOVE_THREADS_MAX), batches);
+
+	std::vector<std::thread> workers;
+	for(std::size_t i = 1; i < threads; i++)
+	{
+		workers.emplace_back(worker);
+	}
+	worker();
+
+	for(auto& thread : workers)
+	{
+		thread.join();
+	}
+	return ok;
+}
+
+static bool KpmRemoveFiles(const std::string& package, const KpmManifest& manifest)
+{
+	auto ordered = KpmOrderFiles(manifest);
+	if(!ordered.has_value())
+	{
+		return false;
+	}
+
+	std::optional<KpmOwners> owners = KpmOwners::Open(KpmGetOwnersPath());
+	if(!owners.has_value())
+	{
+		return false;
+	}
+
+	auto& [ofiles, odirs] = ordered.value();
+
+	// Overwritten by another package since, it is theirs now
+	std::erase_if(ofiles, [&owners, &package](const std::string& file) {
+		std::optional<std::string_view> owner = owners->find(file);
+		if(owner.has_value() && owner.value() != package)
+		{
+			KpmLogTrace("Keeping file {} owned by package {}.", file, owner.value());
+			return true;
 		}
+		return false;
+	});
+
+	return KpmRemovePaths(ofiles, std::move(odirs), false);
+}
+
+bool KpmRemovePaths(const std::vector<std::string>& files, std::vector<std::string> dirs, bool missing_ok)
+{
+	bool ok = KpmRemoveFilesParallel(files, missing_ok);
+
+	// Deepest first, so that every directory is already emptied of its subdirectories when its turn comes
+	std::vector<std::pair<std::size_t, std::string>> depths;
+	depths.reserve(dirs.size());
+	for(auto& dir : dirs)
+	{
+		depths.emplace_back(KpmRemovePathDepth(dir), std::move(dir));
 	}
+	std::stable_sort(depths.begin(), depths.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
 
-	for(const auto& dir : odirs)
+	// Plain rmdir, directories still holding anything (e.g. files of other packages) stay
+	for(const auto& [depth, dir] : depths)
 	{
-		if(std::filesystem::exists(dir))
+		std::error_code ec;
+		if(std::filesystem::remove(dir, ec))
 		{
-			if(KpmRemoveDirIsEmptyRecursive(dir))
+			KpmLogTrace("Removing empty dir: {}", dir);
+		}
+		else if(!ec)
+		{
+			if(!missing_ok)
 			{
-				KpmLogTrace("Removing empty dir: {}", dir);
-				std::filesystem::remove_all(dir);
+				KpmLogError("Failed to remove dir {}. Does not exist.", dir);
 			}
 		}
+		else if(ec == std::errc::directory_not_empty || ec == std::errc::file_exists)
+		{
+			KpmLogTrace("Keeping dir {}, not empty.", dir);
+		}
 		else
 		{
-			KpmLogError("Failed to remove dir {}. Does not exist.", dir);
+			KpmLogWarning("Failed to remove dir {}: {}", dir, ec.message());
 		}
 	}
 
@@ -125,24 +252,53 @@ static bool KpmRemoveManifest(const std::string& package)
 		return false;
 	}
 
+	// Patches for the next install no longer apply to anything
+	std::error_code ec;
+	std::filesystem::remove(KpmGetCachePath() + package + ".dist", ec);
+
+	if(!KpmOwners::Update(KpmGetOwnersPath(), package, {}))
+	{
+		KpmLogError("Failed to update the ownership database.");
+		return false;
+	}
+
+	// Shared objects of other prefixes stay as long as some package still refers to them
+	if(!KpmObjectsReference(package, {}))
+	{
+		return false;
+	}
+
 	KpmLogInfo("Successfully removed package {}.", package);
 	return true;
 }
 
 bool KpmRemove(const std::string &package)
 {
-	auto files = KpmReadManifest(package);
+	auto manifest = KpmReadManifest(package);
 
-	if(!files.has_value())
+	if(!manifest.has_value())
 	{
 		KpmLogError("Failed to remove package {}.", package);
 		return false;
 	}
 
-	if(KpmRemoveFiles(files.value()))
+	bool removed = KpmRemoveFiles(package, manifest.value());
+
+	// Unmapped first, Windows can't delete a mapped file
+	manifest.reset();
+
+	if(!removed || !KpmRemoveManifest(package))
 	{
-		return KpmRemoveManifest(package);
+		return false;
 	}
 
-	return false;
+	// Every generation goes with the package
+	std::error_code ec;
+	std::filesystem::remove_all(KpmGetStorePath(package), ec);
+	if(ec)
+	{
+		KpmLogError("Failed to remove the store of package {}: {}", package, ec.message());
+		return false;
+	}
+	return true;
 }
@@ -0,0 +1,315 @@
+#include "../kpm.h"
+#include "../kpm_shell.h"
+#include "logger.inl"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <random>
+#include <string_view>
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#else
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+#endif
+
+// Read size for command output, anything longer is read in several pieces
+static constexpr std::size_t KPM_SHELL_READ_SIZE = 64 * 1024;
+
+#ifndef _WIN32
+// Single quoted for the shell, ' becomes '\''
+static std::string KpmShellQuote(const std::string& value)
+{
+	std::string quoted = "'";
+	quoted.reserve(value.size() + 2);
+	for(char c : value)
+	{
+		if(c == '\'')
+		{
+			quoted += "'\\''";
+		}
+		else
+		{
+			quoted.push_back(c);
+		}
+	}
+	quoted.push_back('\'');
+	return quoted;
+}
+#endif
+
+KpmShell::KpmShell(int fd, int pid, std::string token) : _fd(fd), _pid(pid), _token(std::move(token))
+{
+}
+
+KpmShell::~KpmShell()
+{
+#ifndef _WIN32
+	// bash exits on the end of its input
+	::close(_fd);
+	int status = 0;
+	while(waitpid(_pid, &status, 0) < 0 && errno == EINTR);
+#endif
+}
+
+std::unique_ptr<KpmShell> KpmShell::Start()
+{
+#ifdef _WIN32
+	return nullptr;
+#else
+	// One socket for both directions, send() can't raise SIGPIPE if bash is gone
+	int fds[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+	{
+		KpmLogWarning("Failed to create the shell socket: {}", std::strerror(errno));
+		return nullptr;
+	}
+
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], STDIN_FILENO);
+	posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+
+	char arg0[] = "bash";
+	char* argv[] = { arg0, nullptr };
+	pid_t pid = 0;
+	const int error = posix_spawnp(&pid, "bash", &actions, nullptr, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	::close(fds[1]);
+
+	if(error != 0)
+	{
+		KpmLogWarning("Failed to start bash: {}", std::strerror(error));
+		::close(fds[0]);
+		return nullptr;
+	}
+
+	static thread_local std::mt19937_64 rng(std::random_device{}());
+	char token[32];
+	std::snprintf(token, sizeof(token), "KPM%016llx", static_cast<unsigned long long>(rng()));
+	return std::unique_ptr<KpmShell>(new KpmShell(fds[0], pid, token));
+#endif
+}
+
+std::optional<KpmShellResult> KpmShell::run(const std::string& command)
+{
+#ifdef _WIN32
+	return std::nullopt;
+#else
+	const std::string line = "( eval " + KpmShellQuote(command) + " ) </dev/null; printf '\\n" + _token + " %d\\n' $?\n";
+	for(std::size_t sent = 0; sent < line.size();)
+	{
+		const ssize_t count = send(_fd, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+		if(count < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(count <= 0)
+		{
+			return std::nullopt;
+		}
+		sent += static_cast<std::size_t>(count);
+	}
+
+	// Output, then "\n<token> <status>\n"
+	const std::string marker = "\n" + _token + " ";
+	std::string buffer;
+	std::size_t searched = 0;
+	while(true)
+	{
+		const std::size_t found = buffer.find(marker, searched);
+		if(found != std::string::npos)
+		{
+			const std::size_t end = buffer.find('\n', found + marker.size());
+			if(end != std::string::npos)
+			{
+				KpmShellResult result;
+				result.status = std::atoi(buffer.c_str() + found + marker.size());
+				buffer.resize(found);
+				result.output = std::move(buffer);
+				return result;
+			}
+		}
+		else
+		{
+			searched = buffer.size() >= marker.size() ? buffer.size() - marker.size() + 1 : 0;
+		}
+
+		const std::size_t size = buffer.size();
+		buffer.resize(size + KPM_SHELL_READ_SIZE);
+		const ssize_t count = ::read(_fd, buffer.data() + size, KPM_SHELL_READ_SIZE);
+		if(count < 0 && errno == EINTR)
+		{
+			buffer.resize(size);
+			continue;
+		}
+		if(count <= 0)
+		{
+			return std::nullopt;
+		}
+		buffer.resize(size + static_cast<std::size_t>(count));
+	}
+#endif
+}
+
+std::optional<KpmShellResult> KpmShellRunFresh(const std::string& command)
+{
+#ifdef _WIN32
+	const std::string command_full = "cmd.exe /C " + command;
+#else
+	const std::string command_full = "bash -c " + KpmShellQuote(command);
+#endif
+
+	FILE* pipe = popen(command_full.c_str(), "r");
+	if(!pipe)
+	{
+		return std::nullopt;
+	}
+
+	KpmShellResult result;
+	std::array<char, KPM_SHELL_READ_SIZE> buffer;
+	for(std::size_t count; (count = std::fread(buffer.data(), 1, buffer.size(), pipe)) > 0;)
+	{
+		result.output.append(buffer.data(), count);
+	}
+
+	const int status = pclose(pipe);
+#ifdef _WIN32
+	result.status = status;
+#else
+	result.status = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+#endif
+	return result;
+}
+
+// Where the shell finds program, empty if it doesn't
+static std::filesystem::path KpmShellWhich(const std::string& program)
+{
+	std::error_code ec;
+	if(program.find_first_of("/\\") != std::string::npos)
+	{
+		return std::filesystem::canonical(program, ec);
+	}
+
+	const char* path = std::getenv("PATH");
+#ifdef _WIN32
+	const char separator = ';';
+	const std::string suffix = ".exe";
+#else
+	const char separator = ':';
+	const std::string suffix;
+#endif
+	std::string_view dirs = path ? path : "";
+	while(!dirs.empty())
+	{
+		const std::size_t end = std::min(dirs.find(separator), dirs.size());
+		const std::filesystem::path candidate = std::filesystem::path(dirs.substr(0, end)) / (program + suffix);
+		if(std::filesystem::is_regular_file(candidate, ec))
+		{
+			return std::filesystem::canonical(candidate, ec);
+		}
+		dirs.remove_prefix(std::min(end + 1, dirs.size()));
+	}
+	return {};
+}
+
+std::string KpmShellFingerprint(const std::string& command)
+{
+	static const char* const variables[] = {
+		"PATH", "HOME", "USER", "LANG", "LC_ALL", "LD_LIBRARY_PATH",
+		"PYTHONPATH", "PYTHONHOME", "PYTHONUSERBASE", "VIRTUAL_ENV", "CONDA_PREFIX"
+	};
+
+	std::string fingerprint;
+	for(const char* name : variables)
+	{
+		const char* value = std::getenv(name);
+		fingerprint += std::string(name) + '=' + (value ? value : "") + '\n';
+	}
+
+	// The first word of every command in it, after assignments (FOO=1 python3 ...)
+	bool first = true;
+	for(std::size_t i = 0; i < command.size();)
+	{
+		const char c = command[i];
+		if(std::strchr(";|&()`\n", c) != nullptr)
+		{
+			first = true;
+			i++;
+			continue;
+		}
+
+		if(std::isspace(static_cast<unsigned char>(c)))
+		{
+			i++;
+			continue;
+		}
+
+		std::size_t end = i;
+		while(end < command.size() && !std::isspace(static_cast<unsigned char>(command[end])) && std::strchr(";|&()`", command[end]) == nullptr)
+		{
+			end++;
+		}
+
+		const std::string word = command.substr(i, end - i);
+		if(first && word.find('=') == std::string::npos)
+		{
+			first = false;
+			std::error_code ec;
+			const std::filesystem::path program = KpmShellWhich(word);
+			if(!program.empty())
+			{
+				const auto mtime = std::filesystem::last_write_time(program, ec).time_since_epoch().count();
+				fingerprint += program.string() + ' ' + std::to_string(std::filesystem::file_size(program, ec)) + ' ' + std::to_string(mtime) + '\n';
+			}
+		}
+		i = end;
+	}
+	return fingerprint;
+}
+
+std::optional<KpmShellResult> KpmShellPool::run(const std::string& command)
+{
+	std::unique_ptr<KpmShell> shell;
+	{
+		std::lock_guard lock(_mutex);
+		if(!_idle.empty())
+		{
+			shell = std::move(_idle.back());
+			_idle.pop_back();
+		}
+	}
+
+	if(!shell)
+	{
+		shell = KpmShell::Start();
+		if(!shell)
+		{
+			return KpmShellRunFresh(command);
+		}
+	}
+
+	std::optional<KpmShellResult> result = shell->run(command);
+	if(!result.has_value())
+	{
+		// Nothing is known about what it ran, running it again could repeat side effects
+		KpmLogWarning("The shell running post install commands exited.");
+		return std::nullopt;
+	}
+
+	std::lock_guard lock(_mutex);
+	_idle.push_back(std::move(shell));
+	return result;
+}
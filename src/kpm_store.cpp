@@ -0,0 +1,397 @@
+#include "../kpm.h"
+#include "../kpm_journal.h"
+#include "../kpm_manifest.h"
+#include "../kpm_objects.h"
+#include "../kpm_owners.h"
+#include "../kpm_store.h"
+#include "logger.inl"
+
+#include <algorithm>
+#include <charconv>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+static const char KPM_STORE_SEPARATOR = static_cast<char>(std::filesystem::path::preferred_separator);
+
+static std::optional<unsigned> KpmStoreParseGeneration(std::string_view name)
+{
+	unsigned generation = 0;
+	auto [end, error] = std::from_chars(name.data(), name.data() + name.size(), generation);
+	if(error != std::errc() || end != name.data() + name.size() || generation == 0)
+	{
+		return std::nullopt;
+	}
+	return generation;
+}
+
+static std::string KpmStoreCurrentPath(const std::string& package)
+{
+	return KpmGetStorePath(package) + "current";
+}
+
+std::string KpmGetStorePath(const std::string& package)
+{
+	return KpmGetCachePath() + "store" + KPM_STORE_SEPARATOR + package + KPM_STORE_SEPARATOR;
+}
+
+std::string KpmStoreGenerationPath(const std::string& package, unsigned generation)
+{
+	return KpmGetStorePath(package) + std::to_string(generation) + KPM_STORE_SEPARATOR;
+}
+
+std::vector<unsigned> KpmStoreGenerations(const std::string& package)
+{
+	std::vector<unsigned> generations;
+	std::error_code ec;
+	for(const auto& item : std::filesystem::directory_iterator(KpmGetStorePath(package), ec))
+	{
+		// The manifest is written last, without it the generation never finished extracting
+		if(item.path().extension() != ".manifest")
+		{
+			continue;
+		}
+
+		std::optional<unsigned> generation = KpmStoreParseGeneration(item.path().stem().string());
+		if(generation.has_value() && std::filesystem::is_directory(KpmStoreGenerationPath(package, generation.value()), ec))
+		{
+			generations.push_back(generation.value());
+		}
+	}
+
+	std::sort(generations.begin(), generations.end());
+	return generations;
+}
+
+unsigned KpmStoreNextGeneration(const std::string& package)
+{
+	unsigned last = 0;
+	std::error_code ec;
+	for(const auto& item : std::filesystem::directory_iterator(KpmGetStorePath(package), ec))
+	{
+		last = std::max(last, KpmStoreParseGeneration(item.path().stem().string()).value_or(0));
+	}
+	return last + 1;
+}
+
+std::optional<unsigned> KpmStoreCurrent(const std::string& package)
+{
+	std::error_code ec;
+	std::filesystem::path target = std::filesystem::read_symlink(KpmStoreCurrentPath(package), ec);
+	if(ec)
+	{
+		return std::nullopt;
+	}
+	return KpmStoreParseGeneration(target.string());
+}
+
+bool KpmStoreSeal(const std::string& package, unsigned generation, KpmManifestWriter& manifest, const std::string& prefix, KpmJournal& journal)
+{
+	const std::string base = KpmGetStorePath(package) + std::to_string(generation);
+	if(!journal.create(base + ".prefix", KpmJournal::Type::FILE) || !journal.create(base + ".manifest", KpmJournal::Type::FILE))
+	{
+		return false;
+	}
+
+	{
+		std::ofstream handle(base + ".prefix", std::ios::binary | std::ios::trunc);
+		if(!handle.is_open() || !handle.write(prefix.data(), prefix.size()))
+		{
+			KpmLogError("Failed to write store file {}.prefix.", base);
+			return false;
+		}
+	}
+
+	if(!manifest.write(base + ".manifest"))
+	{
+		KpmLogError("Failed to write store file {}.manifest.", base);
+		return false;
+	}
+	return true;
+}
+
+// Symlink and rename over path, an old link or file there is replaced in one step
+static bool KpmStoreLink(const std::string& path, const std::string& target)
+{
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+
+	const std::string temp = path + ".kpm-link";
+	std::filesystem::remove(temp, ec);
+	std::filesystem::create_symlink(target, temp, ec);
+	if(!ec)
+	{
+		std::filesystem::rename(temp, path, ec);
+	}
+
+	if(ec)
+	{
+		KpmLogError("Failed to link {}: {}", path, ec.message());
+		std::filesystem::remove(temp, ec);
+		return false;
+	}
+	return true;
+}
+
+bool KpmStoreActivate(const std::string& package, unsigned generation, KpmJournal& journal)
+{
+	const std::string store = KpmGetStorePath(package);
+	const std::string root = KpmStoreGenerationPath(package, generation);
+	const std::string through = KpmStoreCurrentPath(package) + KPM_STORE_SEPARATOR;
+	const std::string package_manifest_file = KpmGetCachePath() + package + ".manifest";
+
+	std::ifstream handle(store + std::to_string(generation) + ".prefix", std::ios::binary);
+	const std::string prefix((std::istreambuf_iterator<char>(handle)), std::istreambuf_iterator<char>());
+	std::optional<KpmManifest> files = KpmManifest::Open(store + std::to_string(generation) + ".manifest");
+	if(prefix.empty() || !files.has_value())
+	{
+		KpmLogError("Generation {} of package {} is incomplete.", generation, package);
+		return false;
+	}
+
+	std::optional<KpmOwners> owners = KpmOwners::Open(KpmGetOwnersPath());
+	if(!owners.has_value())
+	{
+		KpmLogError("Failed to read the ownership database.");
+		return false;
+	}
+
+	// Links keep pointing through current, those already there from an earlier generation stay untouched
+	KpmManifestWriter manifest;
+	bool linked = true;
+	bool read = files->for_each([&](const KpmManifestEntry& entry) {
+		if(!entry.path.starts_with(root))
+		{
+			// Written by post install steps outside the generation, kept as they are
+			manifest.add(entry);
+			return true;
+		}
+
+		const std::string relative = entry.path.substr(root.size());
+		const std::string path = prefix + relative;
+		if(entry.type == KpmManifestType::DIRECTORY)
+		{
+			std::error_code ec;
+			if(!journal.create(path, KpmJournal::Type::DIRECTORY) || (std::filesystem::create_directories(path, ec), ec))
+			{
+				KpmLogError("Failed to create directory {}.", path);
+				linked = false;
+				return false;
+			}
+
+			KpmManifestEntry& record = manifest.add(entry);
+			record.path = path;
+			return true;
+		}
+
+		if(!owners->claim(path, package))
+		{
+			linked = false;
+			return false;
+		}
+
+		const std::string target = through + relative;
+		std::error_code ec;
+		if(std::filesystem::read_symlink(path, ec).string() != target
+			&& (!journal.create(path, KpmJournal::Type::FILE) || !KpmStoreLink(path, target)))
+		{
+			linked = false;
+			return false;
+		}
+
+		KpmManifestEntry& record = manifest.add(path, KpmManifestType::SYMLINK);
+		record.mode = 0777;
+		record.size = target.size();
+		record.mtime = entry.mtime;
+		return true;
+	});
+
+	if(!read)
+	{
+		KpmLogError("Failed to read the manifest of generation {}.", generation);
+		return false;
+	}
+
+	if(!linked)
+	{
+		return false;
+	}
+
+	// What the previous generation installed and this one doesn't, unless someone else took it over
+	std::vector<std::string> stale_files;
+	std::vector<std::string> stale_dirs;
+	{
+		std::error_code ec;
+		std::optional<KpmManifest> previous = std::filesystem::exists(package_manifest_file, ec) ? KpmManifest::Open(package_manifest_file) : std::nullopt;
+		for(const auto& entry : previous.has_value() ? previous->dropped(manifest) : std::vector<KpmManifestEntry>())
+		{
+			if(entry.type == KpmManifestType::DIRECTORY)
+			{
+				stale_dirs.push_back(entry.path);
+			}
+			else if(owners->find(entry.path).value_or(package) == package)
+			{
+				stale_files.push_back(entry.path);
+			}
+		}
+	}
+
+	// Unmapped first, Windows can't replace a mapped file
+	files.reset();
+	owners.reset();
+
+	if(!journal.relink(KpmStoreCurrentPath(package), std::to_string(generation)))
+	{
+		return false;
+	}
+
+	if(!manifest.write(package_manifest_file))
+	{
+		KpmLogError("Failed to write manifest file.");
+		return false;
+	}
+
+	// From here on a crash completes the switch instead of rolling it back
+	if(!journal.commit())
+	{
+		return false;
+	}
+
+	std::vector<std::string> owned;
+	for(const auto& entry : manifest.entries())
+	{
+		if(entry.type != KpmManifestType::DIRECTORY)
+		{
+			owned.push_back(entry.path);
+		}
+	}
+
+	if(!KpmOwners::Update(KpmGetOwnersPath(), package, owned))
+	{
+		KpmLogError("Failed to update the ownership database.");
+		return false;
+	}
+
+	return KpmRemovePaths(stale_files, std::move(stale_dirs), true);
+}
+
+bool KpmRollback(const std::string& package, unsigned generation)
+{
+	std::unique_ptr<KpmJournal> journal = KpmJournal::Begin(package);
+	if(!journal)
+	{
+		return false;
+	}
+
+	std::optional<unsigned> current = KpmStoreCurrent(package);
+	const std::vector<unsigned> generations = KpmStoreGenerations(package);
+	if(!current.has_value())
+	{
+		KpmLogError("Package {} is not installed from the store.", package);
+		journal->close();
+		return false;
+	}
+
+	if(generation == 0)
+	{
+		// The newest one before the active generation
+		auto older = std::lower_bound(generations.begin(), generations.end(), current.value());
+		if(older == generations.begin())
+		{
+			KpmLogError("Package {} has no generation older than {}.", package, current.value());
+			journal->close();
+			return false;
+		}
+		generation = *std::prev(older);
+	}
+	else if(!std::binary_search(generations.begin(), generations.end(), generation))
+	{
+		KpmLogError("Package {} has no generation {}.", package, generation);
+		journal->close();
+		return false;
+	}
+
+	if(!KpmStoreActivate(package, generation, *journal))
+	{
+		KpmLogError("Failed to activate generation {} of package {}.", generation, package);
+		if(journal->rollback())
+		{
+			journal->close();
+		}
+		return false;
+	}
+
+	journal->close();
+	KpmLogInfo("Package {} is at generation {}.", package, generation);
+	return true;
+}
+
+static bool KpmGcPackage(const std::string& package)
+{
+	// Held so that no install of the package is extracting a generation meanwhile
+	std::unique_ptr<KpmJournal> journal = KpmJournal::Begin(package);
+	if(!journal)
+	{
+		return false;
+	}
+
+	std::optional<unsigned> current = KpmStoreCurrent(package);
+	const std::string store = KpmGetStorePath(package);
+
+	// Also whatever an install that failed before sealing its generation left behind
+	std::size_t removed = 0;
+	bool ok = true;
+	std::error_code ec;
+	std::vector<std::filesystem::path> items;
+	for(const auto& item : std::filesystem::directory_iterator(store, ec))
+	{
+		std::optional<unsigned> generation = KpmStoreParseGeneration(item.path().stem().string());
+		if(generation.has_value() && generation != current)
+		{
+			items.push_back(item.path());
+		}
+	}
+
+	for(const auto& item : items)
+	{
+		removed += std::filesystem::is_directory(item, ec) ? 1 : 0;
+		std::filesystem::remove_all(item, ec);
+		if(ec)
+		{
+			KpmLogError("Failed to remove {}: {}", item.string(), ec.message());
+			ok = false;
+		}
+	}
+
+	journal->close();
+	KpmLogInfo("Removed {} old generations of package {}.", removed, package);
+	return ok;
+}
+
+bool KpmGc(const std::string& package)
+{
+	if(!package.empty())
+	{
+		return KpmGcPackage(package);
+	}
+
+	std::vector<std::string> packages;
+	std::error_code ec;
+	for(const auto& item : std::filesystem::directory_iterator(KpmGetCachePath() + "store", ec))
+	{
+		if(item.is_directory(ec))
+		{
+			packages.push_back(item.path().filename().string());
+		}
+	}
+
+	bool ok = true;
+	for(const auto& name : packages)
+	{
+		ok = KpmGcPackage(name) && ok;
+	}
+
+	// Left behind by installs that failed or were interrupted before referring to them
+	KpmLogInfo("Removed {} unused objects.", KpmObjectsPrune());
+	return ok;
+}
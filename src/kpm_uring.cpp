@@ -0,0 +1,419 @@
+#include "../kpm.h"
+#include "../kpm_uring.h"
+#include "logger.inl"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+// Direct descriptors and sparse file tables (Linux 5.19 headers and up)
+#if defined(IORING_FILE_INDEX_ALLOC) && defined(IORING_RSRC_REGISTER_SPARSE)
+#define KPM_IO_URING 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Submission queue entries, a file takes up to four of them
+static constexpr unsigned KPM_URING_ENTRIES = 256;
+static constexpr unsigned KPM_URING_FILES = KPM_URING_ENTRIES / 4;
+
+static std::atomic<bool> _kpm_io_uring = false;
+
+void KpmSetIoUring(bool enable)
+{
+	_kpm_io_uring = enable;
+}
+
+bool KpmIsIoUring()
+{
+	return _kpm_io_uring;
+}
+
+std::uint32_t KpmProcessUmask()
+{
+#ifndef _WIN32
+	mode_t mask = ::umask(0);
+	::umask(mask);
+	return mask;
+#else
+	return 0;
+#endif
+}
+
+#ifdef KPM_IO_URING
+
+enum class KpmUringOp : std::uint64_t
+{
+	UNLINK,
+	OPEN,
+	WRITE,
+	CLOSE
+};
+
+static std::uint64_t KpmUringTag(std::size_t index, KpmUringOp op)
+{
+	return (static_cast<std::uint64_t>(index) << 2) | static_cast<std::uint64_t>(op);
+}
+
+struct KpmUring::Ring
+{
+	int fd = -1;
+
+	void* sq = MAP_FAILED;
+	std::size_t sq_size = 0;
+	void* cq = MAP_FAILED;
+	std::size_t cq_size = 0;
+	io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+	std::size_t sqes_size = 0;
+
+	unsigned* sq_head = nullptr;
+	unsigned* sq_tail = nullptr;
+	unsigned* sq_array = nullptr;
+	unsigned sq_mask = 0;
+	unsigned sq_entries = 0;
+	unsigned* cq_head = nullptr;
+	unsigned* cq_tail = nullptr;
+	io_uring_cqe* cqes = nullptr;
+	unsigned cq_mask = 0;
+
+	unsigned pending = 0; // Queued but not submitted yet
+
+	~Ring()
+	{
+		if(sqes != MAP_FAILED)
+		{
+			munmap(sqes, sqes_size);
+		}
+		if(cq != MAP_FAILED && cq != sq)
+		{
+			munmap(cq, cq_size);
+		}
+		if(sq != MAP_FAILED)
+		{
+			munmap(sq, sq_size);
+		}
+		if(fd >= 0)
+		{
+			close(fd);
+		}
+	}
+};
+
+static void KpmUringUnavailable(const std::string& reason)
+{
+	static std::once_flag once;
+	std::call_once(once, [&reason]() {
+		KpmLogWarning("io_uring is not available ({}), using blocking file IO.", reason);
+	});
+}
+
+KpmUring::KpmUring() : _ring(std::make_unique<Ring>())
+{
+}
+
+KpmUring::~KpmUring() = default;
+
+std::unique_ptr<KpmUring> KpmUring::Create()
+{
+	std::unique_ptr<KpmUring> uring(new KpmUring());
+	Ring& ring = *uring->_ring;
+
+	io_uring_params params = {};
+	ring.fd = static_cast<int>(syscall(__NR_io_uring_setup, KPM_URING_ENTRIES, &params));
+	if(ring.fd < 0)
+	{
+		KpmUringUnavailable(std::strerror(errno));
+		return nullptr;
+	}
+
+	ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		ring.sq_size = ring.cq_size = std::max(ring.sq_size, ring.cq_size);
+	}
+
+	ring.sq = mmap(nullptr, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	ring.cq = (params.features & IORING_FEAT_SINGLE_MMAP) ? ring.sq
+		: mmap(nullptr, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+	ring.sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	ring.sqes = static_cast<io_uring_sqe*>(mmap(nullptr, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES));
+	if(ring.sq == MAP_FAILED || ring.cq == MAP_FAILED || ring.sqes == MAP_FAILED)
+	{
+		KpmUringUnavailable("failed to map the rings");
+		return nullptr;
+	}
+
+	auto* sq = static_cast<std::uint8_t*>(ring.sq);
+	auto* cq = static_cast<std::uint8_t*>(ring.cq);
+	ring.sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+	ring.sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+	ring.sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+	ring.sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+	ring.sq_entries = params.sq_entries;
+	ring.cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+	ring.cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+	ring.cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+	ring.cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+
+	// Every operation used has to be there, older kernels lack unlinkat or direct descriptors
+	std::vector<std::uint8_t> probe_buffer(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op));
+	auto* probe = reinterpret_cast<io_uring_probe*>(probe_buffer.data());
+	if(syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+	{
+		KpmUringUnavailable("no operation probe");
+		return nullptr;
+	}
+
+	for(int op : { IORING_OP_UNLINKAT, IORING_OP_OPENAT, IORING_OP_WRITE, IORING_OP_CLOSE })
+	{
+		if(op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+		{
+			KpmUringUnavailable("unsupported operation " + std::to_string(op));
+			return nullptr;
+		}
+	}
+
+	// Files are opened into these slots, the write and close that follow refer to them
+	io_uring_rsrc_register files = {};
+	files.nr = KPM_URING_FILES;
+	files.flags = IORING_RSRC_REGISTER_SPARSE;
+	if(syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES2, &files, sizeof(files)) < 0)
+	{
+		KpmUringUnavailable("no direct descriptors");
+		return nullptr;
+	}
+
+	return uring;
+}
+
+io_uring_sqe* KpmUring::next_sqe()
+{
+	Ring& ring = *_ring;
+	unsigned tail = *ring.sq_tail + ring.pending;
+	unsigned head = std::atomic_ref(*ring.sq_head).load(std::memory_order_acquire);
+	if(tail - head >= ring.sq_entries)
+	{
+		return nullptr;
+	}
+
+	unsigned index = tail & ring.sq_mask;
+	io_uring_sqe* sqe = &ring.sqes[index];
+	std::memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[index] = index;
+	ring.pending++;
+	return sqe;
+}
+
+bool KpmUring::submit_and_wait(unsigned count, const std::function<void(std::uint64_t, int)>& complete)
+{
+	Ring& ring = *_ring;
+	std::atomic_ref(*ring.sq_tail).store(*ring.sq_tail + ring.pending, std::memory_order_release);
+	unsigned submit = ring.pending;
+	ring.pending = 0;
+
+	unsigned done = 0;
+	while(done < count)
+	{
+		int ret = static_cast<int>(syscall(__NR_io_uring_enter, ring.fd, submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0));
+		if(ret < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			KpmLogError("io_uring_enter failed: {}", std::strerror(errno));
+			return false;
+		}
+		submit -= std::min<unsigned>(submit, ret);
+
+		unsigned head = *ring.cq_head;
+		unsigned tail = std::atomic_ref(*ring.cq_tail).load(std::memory_order_acquire);
+		for(; head != tail; head++)
+		{
+			const io_uring_cqe& cqe = ring.cqes[head & ring.cq_mask];
+			complete(cqe.user_data, cqe.res);
+			done++;
+		}
+		std::atomic_ref(*ring.cq_head).store(head, std::memory_order_release);
+	}
+	return true;
+}
+
+void KpmUring::write_files(std::span<File> files)
+{
+	for(std::size_t begin = 0; begin < files.size(); begin += KPM_URING_FILES)
+	{
+		const std::size_t end = std::min<std::size_t>(begin + KPM_URING_FILES, files.size());
+		unsigned count = 0;
+
+		for(std::size_t i = begin; i < end; i++)
+		{
+			File& file = files[i];
+			const unsigned slot = static_cast<unsigned>(i - begin);
+			file.result = 0;
+
+			// Like archive_write_disk, replace whatever is there by a new inode.
+			// A hard link does not stop the chain when there is nothing to unlink.
+			io_uring_sqe* sqe = next_sqe();
+			sqe->opcode = IORING_OP_UNLINKAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = reinterpret_cast<std::uint64_t>(file.path);
+			sqe->flags = IOSQE_IO_HARDLINK;
+			sqe->user_data = KpmUringTag(i, KpmUringOp::UNLINK);
+
+			sqe = next_sqe();
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = reinterpret_cast<std::uint64_t>(file.path);
+			sqe->len = file.mode;
+			sqe->open_flags = O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW; // Direct descriptors are never inherited, O_CLOEXEC is refused
+			sqe->file_index = slot + 1;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = KpmUringTag(i, KpmUringOp::OPEN);
+
+			if(file.size > 0)
+			{
+				sqe = next_sqe();
+				sqe->opcode = IORING_OP_WRITE;
+				sqe->fd = static_cast<int>(slot);
+				sqe->addr = reinterpret_cast<std::uint64_t>(file.data);
+				sqe->len = file.size;
+				sqe->off = 0;
+				sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+				sqe->user_data = KpmUringTag(i, KpmUringOp::WRITE);
+				count++;
+			}
+
+			sqe = next_sqe();
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->file_index = slot + 1;
+			sqe->user_data = KpmUringTag(i, KpmUringOp::CLOSE);
+			count += 3;
+		}
+
+		bool submitted = submit_and_wait(count, [&files](std::uint64_t tag, int res) {
+			File& file = files[tag >> 2];
+			switch(static_cast<KpmUringOp>(tag & 3))
+			{
+				case KpmUringOp::UNLINK:
+					break;
+				case KpmUringOp::WRITE:
+					// A short write cancels the close, the slot is reused (and that file closed) by the next open
+					if(file.result == 0 && res >= 0 && static_cast<std::uint32_t>(res) != file.size)
+					{
+						file.result = -EIO;
+						break;
+					}
+					[[fallthrough]];
+				default:
+					if(file.result == 0 && res < 0)
+					{
+						file.result = res;
+					}
+					break;
+			}
+		});
+
+		for(std::size_t i = begin; i < end; i++)
+		{
+			File& file = files[i];
+			if(!submitted)
+			{
+				file.result = -EIO;
+				continue;
+			}
+
+			if(file.result == 0)
+			{
+				// No io_uring operation for this one
+				timespec times[2] = { { 0, UTIME_OMIT }, { static_cast<time_t>(file.mtime), file.mtime_nsec } };
+				if(utimensat(AT_FDCWD, file.path, times, AT_SYMLINK_NOFOLLOW) != 0)
+				{
+					file.result = -errno;
+				}
+			}
+		}
+	}
+}
+
+void KpmUring::unlink(std::span<const std::string> paths, std::span<int> results)
+{
+	for(std::size_t begin = 0; begin < paths.size(); begin += KPM_URING_ENTRIES)
+	{
+		const std::size_t end = std::min<std::size_t>(begin + KPM_URING_ENTRIES, paths.size());
+		for(std::size_t i = begin; i < end; i++)
+		{
+			io_uring_sqe* sqe = next_sqe();
+			sqe->opcode = IORING_OP_UNLINKAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = reinterpret_cast<std::uint64_t>(paths[i].c_str());
+			sqe->user_data = KpmUringTag(i, KpmUringOp::UNLINK);
+		}
+
+		bool submitted = submit_and_wait(static_cast<unsigned>(end - begin), [&results](std::uint64_t tag, int res) {
+			results[tag >> 2] = res;
+		});
+
+		if(!submitted)
+		{
+			std::fill(results.begin() + begin, results.begin() + end, -EIO);
+		}
+	}
+}
+
+#else
+
+struct KpmUring::Ring
+{
+};
+
+KpmUring::KpmUring() = default;
+KpmUring::~KpmUring() = default;
+
+std::unique_ptr<KpmUring> KpmUring::Create()
+{
+	static std::once_flag once;
+	std::call_once(once, []() {
+		KpmLogWarning("io_uring is not available on this platform, using blocking file IO.");
+	});
+	return nullptr;
+}
+
+struct io_uring_sqe* KpmUring::next_sqe()
+{
+	return nullptr;
+}
+
+bool KpmUring::submit_and_wait(unsigned, const std::function<void(std::uint64_t, int)>&)
+{
+	return false;
+}
+
+void KpmUring::write_files(std::span<File> files)
+{
+	for(auto& file : files)
+	{
+		file.result = -ENOSYS;
+	}
+}
+
+void KpmUring::unlink(std::span<const std::string>, std::span<int> results)
+{
+	std::fill(results.begin(), results.end(), -ENOSYS);
+}
+
+#endif